@@ -13,7 +13,13 @@
  * debugging.
  *
  * Manually compile with
- * gcc -o kbstats kbstats.c
+ * gcc -o kbstats kbstats.c -pthread
+ * or, for --export-sqlite,
+ * gcc -DHAVE_SQLITE3 -o kbstats kbstats.c -pthread -lsqlite3
+ * Add -DHAVE_ZSTD and -lzstd to compress the old history (see
+ * history_compact()), -DHAVE_SDT, with <sys/sdt.h> from systemtap, to
+ * build in the USDT probes listed next to PROBE(), and -DSTAGES=MASK to
+ * build in only some statistics stages (see STAGE_ON()).
  */
 
 /*
@@ -43,21 +49,55 @@
 #if HAVE_CONFIG_H
 #include <config.h>
 #endif
+#if HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+#if HAVE_SDT
+#include <sys/sdt.h>
+#endif
+#if HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
 
 #include <linux/input.h>
 #include <linux/version.h>
 
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <grp.h>
+#include <limits.h>
+#include <linux/uinput.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define BITS_PER_LONG (sizeof(long) * 8)
@@ -69,6 +109,11 @@
 
 #define DEV_INPUT_EVENT "/dev/input"
 #define EVENT_DEV_NAME "event"
+#define SYS_INPUT_VIRTUAL "/sys/devices/virtual/input"
+#define SNAPSHOT_NAME "/kbstats"
+#define SERVE_PORT 7482
+#define ARCHIVE_AFTER_DAYS 30 /* see history_compact() */
+#define MAX_DEVICES 64
 
 #ifndef EV_SYN
 #define EV_SYN 0
@@ -83,6 +128,35 @@
 #ifndef SYN_DROPPED
 #define SYN_DROPPED 3
 #endif
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+/*
+ * USDT probes, built in with -DHAVE_SDT. Each is a nop until a tracer such
+ * as bpftrace or perf attaches to the running process; readelf -n kbstats
+ * lists them. All are in the kbstats provider:
+ *
+ *   read_batch(dev, events, t_read_ns)  a read from a device returned
+ *   decode(dev, events, keys)           the key events of a read were found
+ *   resync(dev)                         the kernel dropped events (SYN_DROPPED)
+ *   stage_enter(stage)                  a stage starts on a key event or word;
+ *   stage_exit(stage)                   stage is its name
+ *   flush_queued(queue)                 a flush was handed to the writer;
+ *                                       queue are waiting or being written
+ *   flush_start()                       a flush is being written
+ *   flush_done(err)                     and has been, err 0 on success
+ *
+ * e.g. bpftrace -e 'usdt:./kbstats:stage_enter { @t[tid] = nsecs; }
+ *   usdt:./kbstats:stage_exit { @ns[str(arg0)] = hist(nsecs - @t[tid]); }'
+ */
+#if HAVE_SDT
+#define PROBE(name, ...) STAP_PROBEV(kbstats, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...)
+#endif
 
 #define NAME_ELEMENT(element) [element] = #element
 
@@ -90,6 +164,17 @@ enum evtest_mode {
   MODE_CAPTURE,
   MODE_QUERY,
   MODE_VERSION,
+  MODE_LOOPBACK,
+  MODE_BENCH,
+  MODE_RECORDS,
+  MODE_WORDS,
+  MODE_EXPORT_SQLITE,
+  MODE_EXPORT_ARROW,
+  MODE_METRICS,
+  MODE_VIEWS,
+  MODE_ARCHIVE,
+  MODE_SOAK,
+  MODE_VERIFY,
 };
 
 static const struct query_mode {
@@ -102,6 +187,16 @@ static const struct query_mode {
 };
 
 static int grab_flag = 0;
+static int privsep_flag = 1;
+static int fast_start_flag = 0;
+static const char *stats_file = NULL;
+static const char *config_file = NULL;
+static int word_text_flag = 0;
+static unsigned int stage_mask = ~0u;
+static int serve_port = 0;
+static uint64_t memory_budget = 0; /* bytes, 0 for the built-in sizes */
+static int sync_point = 0;         /* enum sync_point, SYNC_FLUSH */
+static int layout_keymap = -1;     /* named with --layout, -1 to infer it */
 static volatile sig_atomic_t stop = 0;
 
 static void interrupt_handler(int sig) { stop = 1; }
@@ -302,12 +397,117 @@ static int version(void) {
 static int usage(void) {
   printf("USAGE:\n");
   printf(" Capture mode:\n");
-  printf("   %s [--grab] /dev/input/eventX\n", program_invocation_short_name);
+  printf("   %s [--grab] [--no-privsep] [--fast-start] [--stats-file F]\n"
+         "     [--serve[=P]] /dev/input/eventX\n",
+         program_invocation_short_name);
   printf("     --grab  grab the device for exclusive access\n");
+  printf("     --fast-start  without a device, open the ones of the last run\n"
+         "                   from STATS.devices; print their details and\n"
+         "                   check the grab once capture has started\n");
+  printf("     --no-privsep  when root, aggregate in the privileged process\n"
+         "                   instead of an unprivileged child\n");
+  printf("     --stats-file  where to keep statistics (default:\n"
+         "                   ~/.local/share/kbstats/stats)\n");
+  printf("     --config      the config file, in any mode (default:\n"
+         "                   ~/.config/kbstats/config)\n");
+  printf("     --stages      comma-separated statistics to keep (default:\n"
+         "                   debounce,counts,records,words,rollups,\n"
+         "                   bigrams,layout; fixed in a build with\n"
+         "                   -DSTAGES)\n");
+  printf("     --word-text   remember the text of the slowest words\n");
+  printf("     --serve[=P]   stream live aggregates as server-sent events "
+         "from\n"
+         "                   http://127.0.0.1:P/events (default port %d),\n"
+         "                   the memory use from /memory, the flushes from\n"
+         "                   /flush and the keyboard layout from /layout\n",
+         SERVE_PORT);
+  printf("     --memory-budget SIZE  bytes to size the word statistics for,\n"
+         "                   with a K, M or G suffix (default: built-in sizes;\n"
+         "                   or memory_budget = SIZE in the config file)\n");
+  printf("     --sync WHEN   wait for saved statistics to reach the disk at\n"
+         "                   every flush, only when a day is added to the\n"
+         "                   history, or only on exit: flush, day or exit\n"
+         "                   (default: flush)\n");
+  printf("     --layout NAME the keyboard layout words are typed in: qwerty,\n"
+         "                   dvorak, colemak, azerty or qwertz, or auto to\n"
+         "                   infer it from the bigrams typed (default: auto;\n"
+         "                   a named one is only checked against them)\n");
+  printf("\n");
+  printf(" Report mode:\n");
+  printf("   %s --records|--words [--stats-file F]\n",
+         program_invocation_short_name);
+  printf("     --records  print the personal records in the stats file\n");
+  printf("     --words    print the slowest frequently typed words\n");
+  printf("\n");
+  printf(" Metrics mode:\n");
+  printf("   %s --metrics QUERY [--stats-file F]\n",
+         program_invocation_short_name);
+  printf("     QUERY is AGG(COLUMN), ... [where CONDITION and ...] "
+         "[group by TIME],\n"
+         "     e.g. \"avg(wpm) where hour in 9..12 group by weekday\"\n");
+  printf("     AGG: count sum avg min max, ratio(A, B) for sum(A) / sum(B),\n"
+         "     or a percentile p1..p99\n");
+  printf("     COLUMN: keystrokes chars backspaces words wpm, or TIME\n");
+  printf("     TIME: hour weekday day month year date (local time)\n");
+  printf("     CONDITION: COLUMN in A..B (inclusive), or COLUMN OP VALUE\n"
+         "     with OP one of = != < <= > >= and VALUE a number, a\n"
+         "     YYYY-MM-DD date or a weekday (sun..sat)\n");
+  printf("     The same query is answered as JSON by GET /metrics?q=QUERY "
+         "with --serve.\n");
+  printf("\n");
+  printf(" Views mode:\n");
+  printf("   %s --views [--stats-file F]\n", program_invocation_short_name);
+  printf("     print the views kept by capture mode, as of its last save;\n"
+         "     each is a line \"view NAME = QUERY\" of the config file\n");
+  printf("\n");
+  printf(" Archive mode:\n");
+  printf("   %s --archive [--stats-file F]\n", program_invocation_short_name);
+  printf("     compress the history older than %d days now (needs zstd),\n"
+         "     after rewriting blocks left by older versions in the latest\n"
+         "     layout; capture mode otherwise does both in the background\n",
+         ARCHIVE_AFTER_DAYS);
+  printf("\n");
+  printf(" Verify mode:\n");
+  printf("   %s --verify [--stats-file F]\n", program_invocation_short_name);
+  printf("     check every block of the stats and history files against its\n"
+         "     checksum, in parallel\n");
+  printf("\n");
+  printf(" Export mode:\n");
+  printf("   %s --export-sqlite DB|--export-arrow FILE [--stats-file F]\n",
+         program_invocation_short_name);
+  printf("     --export-sqlite  add new history to SQLite database DB\n");
+  printf("     --export-arrow   write the per-minute history to Arrow IPC "
+         "file FILE\n");
   printf("\n");
   printf(" Query mode: (check exit code)\n");
   printf("   %s --query /dev/input/eventX <type> <value>\n",
          program_invocation_short_name);
+  printf("\n");
+  printf(" Loopback mode: (needs /dev/uinput)\n");
+  printf("   %s --loopback[=N] [--rate R] [--count C] [--text T]\n",
+         program_invocation_short_name);
+  printf("     --loopback  type on N virtual keyboards (default 1) and\n"
+         "                 report capture latency\n");
+  printf("     --rate      keystrokes per second per keyboard (default: "
+         "unthrottled)\n");
+  printf("     --count     keystrokes per keyboard (default 10000)\n");
+  printf("     --text      text to type (default: a pangram)\n");
+  printf("\n");
+  printf(" Benchmark mode:\n");
+  printf("   %s --bench [--simd V] [--stages S]\n",
+         program_invocation_short_name);
+  printf("     --bench     time the batch kernels of each SIMD variant\n"
+         "                 and the statistics pipeline (with --stages)\n");
+  printf("     --simd      force variant V (scalar, sse2, avx2, avx512) in\n"
+         "                 any mode\n");
+  printf("\n");
+  printf(" Soak mode:\n");
+  printf("   %s --soak[=N] [--stages S]\n", program_invocation_short_name);
+  printf("     --soak      type N key events (default a billion) through\n"
+         "                 capture in accelerated time, with hotplugs,\n"
+         "                 dropped events and restarts, in a directory of its\n"
+         "                 own under /tmp; fails if memory, file sizes, cost\n"
+         "                 per event or totals go out of bounds\n");
 
   printf("\n");
   printf("<type> should be EV_KEY\n");
@@ -369,239 +569,9488 @@ static int print_device_info(int fd) {
   return 0;
 }
 
-// currently dead code intended to debounce key presses
-// adapted from
-// https://stackoverflow.com/questions/48434575/switch-debouncing-logic-in-c
-#define CHECK_MSEC 5     // Read hardware every 5 msec
-#define PRESS_MSEC 10    // Stable time before registering pressed
-#define RELEASE_MSEC 100 // Stable time before registering released
-//
-// This holds the debounced state of the key.
-char *debounced_delimited_key;
-
-// Service routine called every CHECK_MSEC to debounce both edges
-void debounce_keypress(int *key_changed, char *raw_delimited_key) {
-  printf("%s\n", raw_delimited_key);
-  static uint8_t Timer = RELEASE_MSEC / CHECK_MSEC;
-  *key_changed = 0;
-  raw_delimited_key = debounced_delimited_key;
-  if (raw_delimited_key == debounced_delimited_key) {
-    // Set the timer which will allow a change from the current state.
-    if (debounced_delimited_key)
-      Timer = RELEASE_MSEC / CHECK_MSEC;
-    else
-      Timer = PRESS_MSEC / CHECK_MSEC;
-  } else {
-    // Key has changed - wait for new state to become stable.
-    if (--Timer == 0) {
-      // Timer expired - accept the change.
-      debounced_delimited_key = raw_delimited_key;
-      *key_changed = 1;
-      raw_delimited_key = debounced_delimited_key;
-      // And reset the timer.
-      if (debounced_delimited_key)
-        Timer = RELEASE_MSEC / CHECK_MSEC;
-      else
-        Timer = PRESS_MSEC / CHECK_MSEC;
-    }
+/*
+ * Batch kernels. Each has a portable scalar version and, on x86, SSE2, AVX2
+ * and AVX-512 versions built with per-function target attributes, so the
+ * binary runs on any x86-64 and picks the widest variant the CPU supports
+ * once at startup (see simd_init()).
+ */
+/* count, sum, min and max of a set of values */
+struct agg {
+  uint64_t count;
+  double sum;
+  float min; /* INFINITY if empty */
+  float max; /* -INFINITY if empty */
+};
+
+/* A key event packed into 8 bytes for the ring, see struct ring: the time in
+ * microseconds since ring.epoch_us in the low PACK_TIME_BITS, then the value,
+ * the code and the device index. */
+#define PACK_TIME_BITS 46 /* over two years */
+#define PACK_TIME_MAX ((1ULL << PACK_TIME_BITS) - 1)
+#define PACK_VALUE_SHIFT 46 /* 2 bits: release, press or autorepeat */
+#define PACK_CODE_SHIFT 48  /* 10 bits, up to KEY_MAX */
+#define PACK_DEV_SHIFT 58   /* 6 bits, up to MAX_DEVICES */
+
+struct simd_kernels {
+  const char *name;
+  int (*supported)(void);
+  /* Store the indices of the EV_KEY events in ev[0..n) in idx, return the
+   * number stored. */
+  int (*key_filter)(const struct input_event *ev, int n, uint16_t *idx);
+  /* Pack ev[idx[i]] for i in [0, n) into out, as events of device dev with
+   * times relative to epoch_us, clamped to [0, PACK_TIME_MAX]. */
+  void (*key_pack)(const struct input_event *ev, const uint16_t *idx, int n,
+                   uint64_t epoch_us, unsigned int dev, uint64_t *out);
+  /* dst[i] += src[i] for i in [0, n) */
+  void (*counts_merge)(uint64_t *dst, const uint64_t *src, size_t n);
+  /* Set bit i of bits iff lo <= v[i] <= hi for i in [0, n), clearing the
+   * rest of the last word. */
+  void (*range_bits)(const float *v, size_t n, float lo, float hi,
+                     uint64_t *bits);
+  /* Add v[i] to a for each i in [lo, hi) whose bit is set. */
+  void (*masked_agg)(const float *v, const uint64_t *bits, size_t lo,
+                     size_t hi, struct agg *a);
+  /* The sum of a[i] * b[i] for i in [0, n). */
+  double (*dot)(const float *a, const float *b, size_t n);
+};
+
+static int always_supported(void) { return 1; }
+
+static int key_filter_scalar(const struct input_event *ev, int n,
+                             uint16_t *idx) {
+  int i, k = 0;
+
+  for (i = 0; i < n; i++) {
+    if (ev[i].type == EV_KEY)
+      idx[k++] = i;
   }
+  return k;
 }
 
-/**
- * Print device events as they come in.
- *
- * @param fd The file descriptor to the device.
- * @return 0 on success or 1 otherwise.
- */
-static int print_events(int fd) {
-  struct input_event event[64];
-  int i, rd;
-  fd_set rdfs;
+static void key_pack_scalar(const struct input_event *ev,
+                            const uint16_t *idx, int n, uint64_t epoch_us,
+                            unsigned int dev, uint64_t *out) {
+  int i;
 
-  FD_ZERO(&rdfs);
-  FD_SET(fd, &rdfs);
+  for (i = 0; i < n; i++) {
+    const struct input_event *e = &ev[idx[i]];
+    int64_t t = (int64_t)((uint64_t)e->input_event_sec * 1000000 +
+                          e->input_event_usec - epoch_us);
 
-  const char *last_code_name = "";
+    if (t < 0)
+      t = 0;
+    else if (t > (int64_t)PACK_TIME_MAX)
+      t = PACK_TIME_MAX;
+    out[i] = t | (uint64_t)(e->value & 3) << PACK_VALUE_SHIFT |
+             (uint64_t)(e->code & 0x3ff) << PACK_CODE_SHIFT |
+             (uint64_t)dev << PACK_DEV_SHIFT;
+  }
+}
 
-  while (!stop) {
-    select(fd + 1, &rdfs, NULL, NULL, NULL);
-    if (stop)
-      break;
-    rd = read(fd, event, sizeof(event));
+static void counts_merge_scalar(uint64_t *dst, const uint64_t *src,
+                                size_t n) {
+  size_t i;
 
-    if (rd < (int)sizeof(struct input_event)) {
-      printf("expected %d bytes, got %d\n", (int)sizeof(struct input_event),
-             rd);
-      perror("\nevtest: error reading");
-      return 1;
-    }
+  for (i = 0; i < n; i++)
+    dst[i] += src[i];
+}
 
-    for (i = 0; i < rd / sizeof(struct input_event); i++) {
-      unsigned int type, code;
+static void range_bits_scalar(const float *v, size_t n, float lo, float hi,
+                              uint64_t *bits) {
+  size_t i;
 
-      type = event[i].type;
-      code = event[i].code;
-      const char *code_name = codename(type, code);
+  memset(bits, 0, (n + 63) / 64 * sizeof(*bits));
+  for (i = 0; i < n; i++)
+    bits[i / 64] |= (uint64_t)(v[i] >= lo && v[i] <= hi) << i % 64;
+}
+
+static void masked_agg_scalar(const float *v, const uint64_t *bits, size_t lo,
+                              size_t hi, struct agg *a) {
+  size_t i;
+
+  for (i = lo; i < hi; i++) {
+    if (!(bits[i / 64] >> i % 64 & 1))
+      continue;
+    a->count++;
+    a->sum += v[i];
+    if (v[i] < a->min)
+      a->min = v[i];
+    if (v[i] > a->max)
+      a->max = v[i];
+  }
+}
 
-      // create malloced code_name
-      // and ptr to code_name_dup (to_free) to use in strtok
-      char *to_free;
-      char *code_name_dup = strdup(code_name);
-      to_free = code_name_dup;
+static double dot_scalar(const float *a, const float *b, size_t n) {
+  double sum = 0;
+  size_t i;
 
-      int same_codes = strcmp(last_code_name, code_name);
+  for (i = 0; i < n; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
 
-      // if code_name !contains "?"
-      if (strstr(code_name, "?") == NULL) {
-        char *prefix = strtok(code_name_dup, "_");
-        char *raw_delimited_key = strtok(NULL, "_");
-        debounce_keypress(&same_codes, raw_delimited_key);
-        last_code_name = code_name;
-      }
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-      free(code_name_dup);
+/* input_event is a whole number of dwords, so a dword gather with a stride of
+ * sizeof(struct input_event) / 4 picks up type | code << 16 of consecutive
+ * events. */
+#define EVENT_DWORDS ((int)(sizeof(struct input_event) / 4))
+#define TYPE_DWORD ((int)(offsetof(struct input_event, type) / 4))
+
+/* On x86-64 an input_event is three qwords, seconds, microseconds and
+ * type | code << 16 | value << 32, which a qword gather picks up for the
+ * packing kernels. On i386 they pack in scalar code. */
+#if defined(__x86_64__)
+#define EVENT_QWORDS ((int)(sizeof(struct input_event) / 8))
+#define KEY_PACK_AVX2 key_pack_avx2
+#define KEY_PACK_AVX512 key_pack_avx512
+#else
+#define KEY_PACK_AVX2 key_pack_scalar
+#define KEY_PACK_AVX512 key_pack_scalar
+#endif
+
+static int sse2_supported(void) { return __builtin_cpu_supports("sse2"); }
+static int avx2_supported(void) { return __builtin_cpu_supports("avx2"); }
+static int avx512_supported(void) {
+  return __builtin_cpu_supports("avx512f");
+}
+
+__attribute__((target("sse2"))) static void
+counts_merge_sse2(uint64_t *dst, const uint64_t *src, size_t n) {
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi64(d, s));
+  }
+  counts_merge_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+range_bits_sse2(const float *v, size_t n, float lo, float hi, uint64_t *bits) {
+  const __m128 l = _mm_set1_ps(lo), h = _mm_set1_ps(hi);
+  uint8_t *out = (uint8_t *)bits;
+  size_t i = 0;
+
+  memset(bits, 0, (n + 63) / 64 * sizeof(*bits));
+  for (; i + 8 <= n; i += 8) {
+    __m128 a = _mm_loadu_ps(v + i), b = _mm_loadu_ps(v + i + 4);
+    __m128 ma = _mm_and_ps(_mm_cmpge_ps(a, l), _mm_cmple_ps(a, h));
+    __m128 mb = _mm_and_ps(_mm_cmpge_ps(b, l), _mm_cmple_ps(b, h));
+
+    out[i / 8] = _mm_movemask_ps(ma) | _mm_movemask_ps(mb) << 4;
+  }
+  for (; i < n; i++)
+    bits[i / 64] |= (uint64_t)(v[i] >= lo && v[i] <= hi) << i % 64;
+}
+
+__attribute__((target("sse2"))) static void
+masked_agg_sse2(const float *v, const uint64_t *bits, size_t lo, size_t hi,
+                struct agg *a) {
+  const __m128i lane = _mm_setr_epi32(1, 2, 4, 8);
+  __m128 sum = _mm_setzero_ps();
+  __m128 mn = _mm_set1_ps(a->min), mx = _mm_set1_ps(a->max);
+  float s[4], m[4], x[4];
+  size_t i = (lo + 3) & ~(size_t)3;
+  int k;
+
+  if (i >= hi) {
+    masked_agg_scalar(v, bits, lo, hi, a);
+    return;
+  }
+  masked_agg_scalar(v, bits, lo, i, a);
+  for (; i + 4 <= hi; i += 4) {
+    unsigned int b = bits[i / 64] >> i % 64 & 0xf;
+    __m128 sel, val;
+
+    if (!b)
+      continue;
+    sel = _mm_castsi128_ps(
+        _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(b), lane), lane));
+    val = _mm_loadu_ps(v + i);
+    sum = _mm_add_ps(sum, _mm_and_ps(sel, val));
+    mn = _mm_min_ps(mn, _mm_or_ps(_mm_and_ps(sel, val),
+                                  _mm_andnot_ps(sel, mn)));
+    mx = _mm_max_ps(mx, _mm_or_ps(_mm_and_ps(sel, val),
+                                  _mm_andnot_ps(sel, mx)));
+    a->count += __builtin_popcount(b);
+  }
+  _mm_storeu_ps(s, sum);
+  _mm_storeu_ps(m, mn);
+  _mm_storeu_ps(x, mx);
+  for (k = 0; k < 4; k++) {
+    a->sum += s[k];
+    if (m[k] < a->min)
+      a->min = m[k];
+    if (x[k] > a->max)
+      a->max = x[k];
+  }
+  masked_agg_scalar(v, bits, i, hi, a);
+}
+
+__attribute__((target("sse2"))) static double
+dot_sse2(const float *a, const float *b, size_t n) {
+  __m128 sum = _mm_setzero_ps();
+  float s[4];
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4)
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  _mm_storeu_ps(s, sum);
+  return (double)s[0] + s[1] + s[2] + s[3] + dot_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int
+key_filter_avx2(const struct input_event *ev, int n, uint16_t *idx) {
+  const __m256i stride =
+      _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                         _mm256_set1_epi32(EVENT_DWORDS));
+  const __m256i mask = _mm256_set1_epi32(0xffff);
+  const __m256i key = _mm256_set1_epi32(EV_KEY);
+  int i = 0, k = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    const int *base = (const int *)&ev[i] + TYPE_DWORD;
+    __m256i tc = _mm256_i32gather_epi32(base, stride, 4);
+    __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(tc, mask), key);
+    unsigned int bits = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+
+    while (bits) {
+      idx[k++] = i + __builtin_ctz(bits);
+      bits &= bits - 1;
     }
   }
+  for (; i < n; i++) {
+    if (ev[i].type == EV_KEY)
+      idx[k++] = i;
+  }
+  return k;
+}
 
-  ioctl(fd, EVIOCGRAB, (void *)0);
-  return EXIT_SUCCESS;
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static void
+key_pack_avx2(const struct input_event *ev, const uint16_t *idx, int n,
+              uint64_t epoch_us, unsigned int dev, uint64_t *out) {
+  const long long *base = (const long long *)ev;
+  const __m128i qwords = _mm_set1_epi32(EVENT_QWORDS);
+  const __m256i usec = _mm256_set1_epi64x(1000000);
+  const __m256i epoch = _mm256_set1_epi64x(epoch_us);
+  const __m256i max = _mm256_set1_epi64x(PACK_TIME_MAX);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i code = _mm256_set1_epi64x(0x3ff);
+  const __m256i value = _mm256_set1_epi64x(3);
+  const __m256i tag = _mm256_set1_epi64x((uint64_t)dev << PACK_DEV_SHIFT);
+  int i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i q = _mm_mullo_epi32(
+        _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(idx + i))),
+        qwords);
+    __m256i sec = _mm256_i32gather_epi64(base, q, 8);
+    __m256i us = _mm256_i32gather_epi64(base + 1, q, 8);
+    __m256i tcv = _mm256_i32gather_epi64(base + 2, q, 8);
+    __m256i t = _mm256_sub_epi64(
+        _mm256_add_epi64(_mm256_mul_epu32(sec, usec), us), epoch);
+
+    t = _mm256_andnot_si256(_mm256_cmpgt_epi64(zero, t), t);
+    t = _mm256_blendv_epi8(t, max, _mm256_cmpgt_epi64(t, max));
+    t = _mm256_or_si256(t, tag);
+    t = _mm256_or_si256(
+        t, _mm256_slli_epi64(
+               _mm256_and_si256(_mm256_srli_epi64(tcv, 32), value),
+               PACK_VALUE_SHIFT));
+    t = _mm256_or_si256(
+        t, _mm256_slli_epi64(
+               _mm256_and_si256(_mm256_srli_epi64(tcv, 16), code),
+               PACK_CODE_SHIFT));
+    _mm256_storeu_si256((__m256i *)(out + i), t);
+  }
+  key_pack_scalar(ev, idx + i, n - i, epoch_us, dev, out + i);
 }
+#endif
 
-/**
- * Grab and immediately ungrab the device.
- *
- * @param fd The file descriptor to the device.
- * @return 0 if the grab was successful, or 1 otherwise.
- */
-static int test_grab(int fd, int grab_flag) {
-  int rc;
+__attribute__((target("avx2"))) static void
+counts_merge_avx2(uint64_t *dst, const uint64_t *src, size_t n) {
+  size_t i = 0;
 
-  rc = ioctl(fd, EVIOCGRAB, (void *)1);
+  for (; i + 4 <= n; i += 4) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi64(d, s));
+  }
+  counts_merge_scalar(dst + i, src + i, n - i);
+}
 
-  if (rc == 0 && !grab_flag)
-    ioctl(fd, EVIOCGRAB, (void *)0);
+__attribute__((target("avx2"))) static void
+range_bits_avx2(const float *v, size_t n, float lo, float hi, uint64_t *bits) {
+  const __m256 l = _mm256_set1_ps(lo), h = _mm256_set1_ps(hi);
+  uint8_t *out = (uint8_t *)bits;
+  size_t i = 0;
 
-  return rc;
+  memset(bits, 0, (n + 63) / 64 * sizeof(*bits));
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(v + i);
+    __m256 m = _mm256_and_ps(_mm256_cmp_ps(x, l, _CMP_GE_OQ),
+                             _mm256_cmp_ps(x, h, _CMP_LE_OQ));
+
+    out[i / 8] = _mm256_movemask_ps(m);
+  }
+  for (; i < n; i++)
+    bits[i / 64] |= (uint64_t)(v[i] >= lo && v[i] <= hi) << i % 64;
 }
 
-/**
- * Enter capture mode. The requested event device will be monitored, and any
- * captured events will be decoded and printed on the console.
- *
- * @param device The device to monitor, or NULL if the user should be prompted.
- * @return 0 on success, non-zero on error.
- */
-static int do_capture(const char *device, int grab_flag) {
-  int fd;
-  char *filename = NULL;
+__attribute__((target("avx2"))) static void
+masked_agg_avx2(const float *v, const uint64_t *bits, size_t lo, size_t hi,
+                struct agg *a) {
+  const __m256i lane = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  __m256 sum = _mm256_setzero_ps();
+  __m256 mn = _mm256_set1_ps(a->min), mx = _mm256_set1_ps(a->max);
+  float s[8], m[8], x[8];
+  size_t i = (lo + 7) & ~(size_t)7;
+  int k;
 
-  if (!device) {
-    fprintf(stderr, "No device specified, trying to scan all of %s/%s*\n",
-            DEV_INPUT_EVENT, EVENT_DEV_NAME);
+  if (i >= hi) {
+    masked_agg_scalar(v, bits, lo, hi, a);
+    return;
+  }
+  masked_agg_scalar(v, bits, lo, i, a);
+  for (; i + 8 <= hi; i += 8) {
+    unsigned int b = bits[i / 64] >> i % 64 & 0xff;
+    __m256 sel, val;
+
+    if (!b)
+      continue;
+    sel = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+        _mm256_and_si256(_mm256_set1_epi32(b), lane), lane));
+    val = _mm256_loadu_ps(v + i);
+    sum = _mm256_add_ps(sum, _mm256_and_ps(sel, val));
+    mn = _mm256_min_ps(mn, _mm256_blendv_ps(mn, val, sel));
+    mx = _mm256_max_ps(mx, _mm256_blendv_ps(mx, val, sel));
+    a->count += __builtin_popcount(b);
+  }
+  _mm256_storeu_ps(s, sum);
+  _mm256_storeu_ps(m, mn);
+  _mm256_storeu_ps(x, mx);
+  for (k = 0; k < 8; k++) {
+    a->sum += s[k];
+    if (m[k] < a->min)
+      a->min = m[k];
+    if (x[k] > a->max)
+      a->max = x[k];
+  }
+  masked_agg_scalar(v, bits, i, hi, a);
+}
 
-    if (getuid() != 0)
-      fprintf(stderr, "Not running as root, no devices may be available.\n");
+__attribute__((target("avx2"))) static double
+dot_avx2(const float *a, const float *b, size_t n) {
+  __m256 sum = _mm256_setzero_ps();
+  float s[8];
+  double total = 0;
+  size_t i = 0;
+  int k;
 
-    filename = scan_devices();
-    if (!filename)
-      return usage();
-  } else {
-    filename = strdup(device);
+  for (; i + 8 <= n; i += 8)
+    sum = _mm256_add_ps(
+        sum, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+  _mm256_storeu_ps(s, sum);
+  for (k = 0; k < 8; k++)
+    total += s[k];
+  return total + dot_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static int
+key_filter_avx512(const struct input_event *ev, int n, uint16_t *idx) {
+  const __m512i stride = _mm512_mullo_epi32(
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+      _mm512_set1_epi32(EVENT_DWORDS));
+  const __m512i mask = _mm512_set1_epi32(0xffff);
+  const __m512i key = _mm512_set1_epi32(EV_KEY);
+  int i = 0, k = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    const int *base = (const int *)&ev[i] + TYPE_DWORD;
+    __m512i tc = _mm512_i32gather_epi32(stride, base, 4);
+    unsigned int bits =
+        _mm512_cmpeq_epi32_mask(_mm512_and_si512(tc, mask), key);
+
+    while (bits) {
+      idx[k++] = i + __builtin_ctz(bits);
+      bits &= bits - 1;
+    }
   }
+  for (; i < n; i++) {
+    if (ev[i].type == EV_KEY)
+      idx[k++] = i;
+  }
+  return k;
+}
 
-  if (!filename)
-    return EXIT_FAILURE;
+#if defined(__x86_64__)
+__attribute__((target("avx512f"))) static void
+key_pack_avx512(const struct input_event *ev, const uint16_t *idx, int n,
+                uint64_t epoch_us, unsigned int dev, uint64_t *out) {
+  const long long *base = (const long long *)ev;
+  const __m256i qwords = _mm256_set1_epi32(EVENT_QWORDS);
+  const __m512i usec = _mm512_set1_epi64(1000000);
+  const __m512i epoch = _mm512_set1_epi64(epoch_us);
+  const __m512i max = _mm512_set1_epi64(PACK_TIME_MAX);
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i code = _mm512_set1_epi64(0x3ff);
+  const __m512i value = _mm512_set1_epi64(3);
+  const __m512i tag = _mm512_set1_epi64((uint64_t)dev << PACK_DEV_SHIFT);
+  int i = 0;
 
-  if ((fd = open(filename, O_RDONLY)) < 0) {
-    perror("evtest");
-    if (errno == EACCES && getuid() != 0)
-      fprintf(stderr,
-              "You do not have access to %s. Try "
-              "running as root instead.\n",
-              filename);
-    goto error;
+  for (; i + 8 <= n; i += 8) {
+    __m256i q = _mm256_mullo_epi32(
+        _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(idx + i))),
+        qwords);
+    __m512i sec = _mm512_i32gather_epi64(q, base, 8);
+    __m512i us = _mm512_i32gather_epi64(q, base + 1, 8);
+    __m512i tcv = _mm512_i32gather_epi64(q, base + 2, 8);
+    __m512i t = _mm512_sub_epi64(
+        _mm512_add_epi64(_mm512_mul_epu32(sec, usec), us), epoch);
+
+    t = _mm512_min_epi64(_mm512_max_epi64(t, zero), max);
+    t = _mm512_or_si512(t, tag);
+    t = _mm512_or_si512(
+        t, _mm512_slli_epi64(
+               _mm512_and_si512(_mm512_srli_epi64(tcv, 32), value),
+               PACK_VALUE_SHIFT));
+    t = _mm512_or_si512(
+        t, _mm512_slli_epi64(
+               _mm512_and_si512(_mm512_srli_epi64(tcv, 16), code),
+               PACK_CODE_SHIFT));
+    _mm512_storeu_si512(out + i, t);
   }
+  key_pack_scalar(ev, idx + i, n - i, epoch_us, dev, out + i);
+}
+#endif
 
-  if (!isatty(fileno(stdout)))
-    setbuf(stdout, NULL);
+__attribute__((target("avx512f"))) static void
+counts_merge_avx512(uint64_t *dst, const uint64_t *src, size_t n) {
+  size_t i = 0;
 
-  if (print_device_info(fd))
-    goto error;
+  for (; i + 8 <= n; i += 8) {
+    __m512i d = _mm512_loadu_si512(dst + i);
+    __m512i s = _mm512_loadu_si512(src + i);
+    _mm512_storeu_si512(dst + i, _mm512_add_epi64(d, s));
+  }
+  counts_merge_scalar(dst + i, src + i, n - i);
+}
 
-  printf("Testing ... (interrupt to exit)\n");
+__attribute__((target("avx512f"))) static void
+range_bits_avx512(const float *v, size_t n, float lo, float hi,
+                  uint64_t *bits) {
+  const __m512 l = _mm512_set1_ps(lo), h = _mm512_set1_ps(hi);
+  uint16_t *out = (uint16_t *)bits;
+  size_t i = 0;
 
-  if (test_grab(fd, grab_flag)) {
-    printf("***********************************************\n");
-    printf("  This device is grabbed by another process.\n");
-    printf("  No events are available to evtest while the\n"
-           "  other grab is active.\n");
-    printf("  In most cases, this is caused by an X driver,\n"
-           "  try VT-switching and re-run evtest again.\n");
-    printf("  Run the following command to see processes with\n"
-           "  an open fd on this device\n"
-           " \"fuser -v %s\"\n",
-           filename);
-    printf("***********************************************\n");
+  memset(bits, 0, (n + 63) / 64 * sizeof(*bits));
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_loadu_ps(v + i);
+
+    out[i / 16] = _mm512_cmp_ps_mask(x, l, _CMP_GE_OQ) &
+                  _mm512_cmp_ps_mask(x, h, _CMP_LE_OQ);
   }
+  for (; i < n; i++)
+    bits[i / 64] |= (uint64_t)(v[i] >= lo && v[i] <= hi) << i % 64;
+}
 
-  signal(SIGINT, interrupt_handler);
-  signal(SIGTERM, interrupt_handler);
+__attribute__((target("avx512f"))) static void
+masked_agg_avx512(const float *v, const uint64_t *bits, size_t lo, size_t hi,
+                  struct agg *a) {
+  __m512 sum = _mm512_setzero_ps();
+  __m512 mn = _mm512_set1_ps(a->min), mx = _mm512_set1_ps(a->max);
+  size_t i = (lo + 15) & ~(size_t)15;
+  float m, x;
 
-  free(filename);
+  if (i >= hi) {
+    masked_agg_scalar(v, bits, lo, hi, a);
+    return;
+  }
+  masked_agg_scalar(v, bits, lo, i, a);
+  for (; i + 16 <= hi; i += 16) {
+    __mmask16 b = bits[i / 64] >> i % 64 & 0xffff;
+    __m512 val;
 
-  return print_events(fd);
+    if (!b)
+      continue;
+    val = _mm512_loadu_ps(v + i);
+    sum = _mm512_mask_add_ps(sum, b, sum, val);
+    mn = _mm512_mask_min_ps(mn, b, mn, val);
+    mx = _mm512_mask_max_ps(mx, b, mx, val);
+    a->count += __builtin_popcount(b);
+  }
+  a->sum += _mm512_reduce_add_ps(sum);
+  m = _mm512_reduce_min_ps(mn);
+  x = _mm512_reduce_max_ps(mx);
+  if (m < a->min)
+    a->min = m;
+  if (x > a->max)
+    a->max = x;
+  masked_agg_scalar(v, bits, i, hi, a);
+}
 
-error:
-  free(filename);
-  return EXIT_FAILURE;
+__attribute__((target("avx512f"))) static double
+dot_avx512(const float *a, const float *b, size_t n) {
+  __m512 sum = _mm512_setzero_ps();
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16)
+    sum = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum);
+  return _mm512_reduce_add_ps(sum) + dot_scalar(a + i, b + i, n - i);
 }
+#endif
+
+/* Narrowest first; simd_init() picks the last supported entry. */
+static const struct simd_kernels simd_variants[] = {
+    {"scalar", always_supported, key_filter_scalar, key_pack_scalar,
+     counts_merge_scalar, range_bits_scalar, masked_agg_scalar, dot_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+    /* SSE2 has no gather, so its filter and packing are the scalar ones */
+    {"sse2", sse2_supported, key_filter_scalar, key_pack_scalar,
+     counts_merge_sse2, range_bits_sse2, masked_agg_sse2, dot_sse2},
+    {"avx2", avx2_supported, key_filter_avx2, KEY_PACK_AVX2,
+     counts_merge_avx2, range_bits_avx2, masked_agg_avx2, dot_avx2},
+    {"avx512", avx512_supported, key_filter_avx512, KEY_PACK_AVX512,
+     counts_merge_avx512, range_bits_avx512, masked_agg_avx512,
+     dot_avx512},
+#endif
+};
+
+#define N_SIMD_VARIANTS (sizeof(simd_variants) / sizeof(*simd_variants))
+
+static const struct simd_kernels *simd = &simd_variants[0];
 
 /**
- * Perform a one-shot state query on a specific device. The query can be of
- * any known mode, on any valid keycode.
+ * Select the batch kernels, once, before any events are processed.
  *
- * @param device Path to the evdev device node that should be queried.
- * @param query_mode The event type that is being queried (should be EV_KEY)
- * @param keycode The code of the key to be queried
- * @return 0 if the state bit is unset, 10 if the state bit is set, 1 on error.
+ * @param force The name of the variant to use, or NULL for the widest one
+ * this CPU supports.
+ * @return 0 on success, or 1 if the forced variant is unknown or unsupported.
  */
-static int query_device(const char *device, const struct query_mode *query_mode,
-                        int keycode) {
-  int fd;
-  int r;
-  unsigned long state[NBITS(query_mode->max)];
+static int simd_init(const char *force) {
+  int i;
 
-  fd = open(device, O_RDONLY);
-  if (fd < 0) {
-    perror("open");
-    return EXIT_FAILURE;
+  __builtin_cpu_init();
+  for (i = 0; i < N_SIMD_VARIANTS; i++) {
+    const struct simd_kernels *k = &simd_variants[i];
+
+    if (force && strcmp(force, k->name) != 0)
+      continue;
+    if (!k->supported()) {
+      if (force) {
+        fprintf(stderr, "kbstats: this CPU does not support %s\n", force);
+        return 1;
+      }
+      continue;
+    }
+    simd = k;
+    if (force)
+      return 0;
   }
-  memset(state, 0, sizeof(state));
-  r = ioctl(fd, query_mode->rq, state);
-  close(fd);
+  if (force) {
+    fprintf(stderr, "kbstats: unknown SIMD variant %s\n", force);
+    return 1;
+  }
+  return 0;
+}
 
-  if (r == -1) {
-    perror("ioctl");
-    return EXIT_FAILURE;
+/*
+ * Checksums. Blocks of the stats and history files carry a CRC32C (see
+ * BLOCK_CHECKSUM), computed with the SSE4.2 crc32 instruction or the ARMv8
+ * CRC extension where the CPU has one, and a table otherwise. The choice is
+ * made once at startup by crc32c_init(), apart from --simd since the result
+ * is the same either way; the table is filled there too, before any thread
+ * can checksum.
+ */
+#define CRC32C_POLY 0x82f63b78 /* reflected */
+
+static uint32_t crc32c_lut[256];
+
+static uint32_t crc32c_table(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+
+  for (crc = ~crc; len--; p++)
+    crc = crc >> 8 ^ crc32c_lut[(crc ^ *p) & 0xff];
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  uint64_t c = ~crc, v;
+
+  for (; len && (uintptr_t)p & 7; len--)
+    c = _mm_crc32_u8(c, *p++);
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
   }
+  for (; len; len--)
+    c = _mm_crc32_u8(c, *p++);
+  return ~(uint32_t)c;
+}
+#endif
 
-  if (test_bit(keycode, state))
-    return 10; /* different from EXIT_FAILURE */
-  else
-    return 0;
+#if defined(__aarch64__)
+__attribute__((target("+crc"))) static uint32_t
+crc32c_armv8(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  uint64_t v;
+
+  crc = ~crc;
+  for (; len && (uintptr_t)p & 7; len--)
+    crc = __crc32cb(crc, *p++);
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+  }
+  for (; len; len--)
+    crc = __crc32cb(crc, *p++);
+  return ~crc;
 }
+#endif
 
-int main(int argc, char **argv) {
-  const char *device = NULL;
-  const char *keyname;
-  const char *event_type;
-  enum evtest_mode mode = MODE_CAPTURE;
+/* crc32c(0, buf, len) of a buffer; pass the result on to continue it */
+static uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len) =
+    crc32c_table;
+static const char *crc32c_name = "table";
 
-  if (mode == MODE_CAPTURE)
-    return do_capture(device, grab_flag);
+static void crc32c_init(void) {
+  uint32_t c;
+  int i, k;
 
-  if ((argc - optind) < 2) {
-    fprintf(stderr, "Query mode requires device, type and key parameters\n");
-    return usage();
+  for (i = 0; i < 256; i++) {
+    for (c = i, k = 0; k < 8; k++)
+      c = c & 1 ? c >> 1 ^ CRC32C_POLY : c >> 1;
+    crc32c_lut[i] = c;
+  }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c = crc32c_sse42;
+    crc32c_name = "sse4.2";
   }
+#elif defined(__aarch64__)
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    crc32c = crc32c_armv8;
+    crc32c_name = "armv8";
+  }
+#endif
+}
+
+/**
+ * Running totals kept by the aggregator.
+ */
+struct kb_stats {
+  uint64_t events;     /* EV_KEY events of any value */
+  uint64_t keystrokes; /* key presses, autorepeat excluded */
+  uint64_t presses[KEY_CNT];
+};
+
+/**
+ * A key event as the statistics stages see it, unpacked from the ring by the
+ * aggregator.
+ */
+struct key_record {
+  uint64_t time_us; /* kernel timestamp */
+  uint16_t dev;     /* index into capture.fds */
+  uint16_t code;
+  int32_t value;
+};
+
+#define RING_SLOTS 4096 /* must be a power of two */
+#define RING_EPOCH_SLACK_US 3600000000ULL /* for events from before epoch_us */
+
+/**
+ * Single-producer single-consumer ring of key records in shared memory. The
+ * reader only advances head and the aggregator only advances tail; record i
+ * lives in slot[i % RING_SLOTS]. The aggregator sets waiting before it sleeps
+ * on the wake eventfd, so the reader only needs the syscall to wake it when it
+ * would otherwise miss a batch.
+ *
+ * Records travel packed into 8 bytes (see PACK_TIME_BITS), eight to a cache
+ * line, with times relative to epoch_us. The reader sets that an hour before
+ * the first key it sees, so that slightly older events on another device
+ * still fit.
+ */
+struct ring {
+  _Alignas(64) uint64_t head;
+  uint64_t dropped; /* records lost to a full ring */
+  uint64_t first_event_us; /* from the start of capture, 0 until then */
+  uint64_t epoch_us;       /* 0 until the first key */
+  _Alignas(64) uint64_t tail;
+  uint32_t waiting;
+  _Alignas(64) uint64_t slot[RING_SLOTS];
+};
+
+static void key_unpack(uint64_t slot, uint64_t epoch_us,
+                       struct key_record *rec) {
+  rec->time_us = epoch_us + (slot & PACK_TIME_MAX);
+  rec->value = slot >> PACK_VALUE_SHIFT & 3;
+  rec->code = slot >> PACK_CODE_SHIFT & 0x3ff;
+  rec->dev = slot >> PACK_DEV_SHIFT;
+}
+
+/*
+ * Word splitting. Key presses are classified by key_class; runs of KC_WORD
+ * keys form a word, ended by any other printable key. Words are handed to the
+ * statistics stages as a struct word.
+ */
+#define WORD_MAX 31
+#define WORD_MAX_PAUSE_US 2000000 /* a longer pause spoils the word's timing */
+
+enum key_class {
+  KC_OTHER,
+  KC_WORD,      /* letters, digits, apostrophe */
+  KC_PUNCT,     /* other printable keys, end a word */
+  KC_SPACE,     /* space, tab and enter, end a word */
+  KC_BACKSPACE, /* a correction */
+};
+
+static const unsigned char key_class[KEY_CNT] = {
+    [KEY_1 ... KEY_0] = KC_WORD,
+    [KEY_Q ... KEY_P] = KC_WORD,
+    [KEY_A ... KEY_L] = KC_WORD,
+    [KEY_Z ... KEY_M] = KC_WORD,
+    [KEY_APOSTROPHE] = KC_WORD,
+    [KEY_MINUS] = KC_PUNCT,
+    [KEY_EQUAL] = KC_PUNCT,
+    [KEY_LEFTBRACE] = KC_PUNCT,
+    [KEY_RIGHTBRACE] = KC_PUNCT,
+    [KEY_SEMICOLON] = KC_PUNCT,
+    [KEY_GRAVE] = KC_PUNCT,
+    [KEY_BACKSLASH] = KC_PUNCT,
+    [KEY_COMMA ... KEY_SLASH] = KC_PUNCT,
+    [KEY_SPACE] = KC_SPACE,
+    [KEY_TAB] = KC_SPACE,
+    [KEY_ENTER] = KC_SPACE,
+    [KEY_BACKSPACE] = KC_BACKSPACE,
+};
+
+static const char key_chars[KEY_CNT] = {
+    [KEY_1] = '1', [KEY_2] = '2', [KEY_3] = '3', [KEY_4] = '4',
+    [KEY_5] = '5', [KEY_6] = '6', [KEY_7] = '7', [KEY_8] = '8',
+    [KEY_9] = '9', [KEY_0] = '0', [KEY_Q] = 'q', [KEY_W] = 'w',
+    [KEY_E] = 'e', [KEY_R] = 'r', [KEY_T] = 't', [KEY_Y] = 'y',
+    [KEY_U] = 'u', [KEY_I] = 'i', [KEY_O] = 'o', [KEY_P] = 'p',
+    [KEY_A] = 'a', [KEY_S] = 's', [KEY_D] = 'd', [KEY_F] = 'f',
+    [KEY_G] = 'g', [KEY_H] = 'h', [KEY_J] = 'j', [KEY_K] = 'k',
+    [KEY_L] = 'l', [KEY_Z] = 'z', [KEY_X] = 'x', [KEY_C] = 'c',
+    [KEY_V] = 'v', [KEY_B] = 'b', [KEY_N] = 'n', [KEY_M] = 'm',
+    [KEY_APOSTROPHE] = '\'',
+};
+
+/*
+ * Keyboard layouts. Key codes name the keys of a US QWERTY keyboard, but
+ * what a key types depends on the layout set on the system, which kbstats
+ * can't see. Words are spelt through a keymap, which gives the character
+ * each of the LAYOUT_KEYS keys of the main block that layouts move types, in
+ * the order of layout_slot(): the keymap named with --layout or, by default,
+ * the one the layout stage infers from what is typed. Letters outside ASCII are
+ * written in Latin-1 and folded to their base letter in words (see
+ * keymap_fold()); dead keys are written as the ASCII accent.
+ */
+#define LAYOUT_KEYS 35
+#define LAYOUT_PAIRS (LAYOUT_KEYS * LAYOUT_KEYS)
+#define LAYOUT_NAME_MAX 16
+
+struct keymap {
+  const char *name;
+  const char chars[LAYOUT_KEYS + 1];
+};
+
+static const struct keymap keymaps[] = {
+    {"qwerty", "-=qwertyuiop[]asdfghjkl;'zxcvbnm,./"},
+    {"dvorak", "[]',.pyfgcrl/=aoeuidhtns-;qjkxbmwvz"},
+    {"colemak", "-=qwfpgjluy;[]arstdhneio'zxcvbkm,./"},
+    {"azerty", ")=azertyuiop^$qsdfghjklm\xf9wxcvbn,;:!"},
+    {"qwertz", "\xdf`qwertzuiop\xfc+asdfghjkl\xf6\xe4yxcvbnm,.-"},
+};
+
+#define N_KEYMAPS (sizeof(keymaps) / sizeof(*keymaps))
+
+/* The keymap position of a key: the row from minus to equal, then the three
+ * letter rows from Q, A and Z; -1 for keys no layout moves. */
+static int layout_slot(unsigned int code) {
+  if (code >= KEY_MINUS && code <= KEY_EQUAL)
+    return code - KEY_MINUS;
+  if (code >= KEY_Q && code <= KEY_RIGHTBRACE)
+    return code - KEY_Q + 2;
+  if (code >= KEY_A && code <= KEY_APOSTROPHE)
+    return code - KEY_A + 14;
+  if (code >= KEY_Z && code <= KEY_SLASH)
+    return code - KEY_Z + 25;
+  return -1;
+}
+
+/* A keymap character as it is spelt in words. */
+static char keymap_fold(unsigned char c) {
+  switch (c) {
+  case 0xdf:
+    return 's';
+  case 0xe4:
+    return 'a';
+  case 0xf6:
+    return 'o';
+  case 0xf9:
+  case 0xfc:
+    return 'u';
+  default:
+    return c;
+  }
+}
+
+/**
+ * Look up a keymap by name.
+ *
+ * @return Its index in keymaps, or -1 if there is none of that name.
+ */
+static int keymap_find(const char *name) {
+  int k;
+
+  for (k = 0; k < N_KEYMAPS; k++) {
+    if (strcmp(keymaps[k].name, name) == 0)
+      return k;
+  }
+  return -1;
+}
+
+/*
+ * Layout inference. The layout stage counts the bigrams typed between keys
+ * of the keymap, within LAYOUT_MAX_GAP_US of each other, into a LAYOUT_KEYS
+ * square matrix, which halves whenever it reaches LAYOUT_WINDOW bigrams so
+ * that it follows a change of layout. After LAYOUT_FIRST bigrams, and every
+ * LAYOUT_RECHECK after that, layout_check() scores the matrix against each
+ * keymap read through a language model: the model's cost of each bigram of
+ * keys, as the characters the keymap has them type, makes a matrix of
+ * weights per keymap, and a keymap's score is the dot product of its weights
+ * and the counts, on the batch kernels, over the number of bigrams. The best
+ * keymap is used from then on unless it was named with --layout, in which
+ * case it is only suggested; either way the bigrams have to be at least
+ * LAYOUT_EVIDENCE likelier through it than through the keymap in use. That
+ * takes a few hundred for layouts that move most letters, and a few thousand
+ * for QWERTZ, which only swaps Y and Z.
+ *
+ * The model is of English: the letter frequencies and the 50 commonest
+ * letter bigrams, as costs in tenths of a bit. A bigram not listed costs its
+ * letters' costs and LAYOUT_BACKOFF_COST more, as if it came half as often as
+ * by chance, and any character other than a-z costs LAYOUT_OTHER_COST. It is
+ * crude, but the layouts differ by so much on the commonest letters that
+ * typing in other languages is told apart as well.
+ */
+#define LAYOUT_MAX_GAP_US 2000000
+#define LAYOUT_WINDOW 8192
+#define LAYOUT_FIRST 256
+#define LAYOUT_RECHECK 1024
+#define LAYOUT_EVIDENCE 300 /* tenths of a bit, odds of 2^30 */
+#define LAYOUT_BACKOFF_COST 10
+#define LAYOUT_OTHER_COST 90 /* 1 in 500 */
+
+static const uint8_t letter_cost[26] = {
+    36, 61, 49, 47, 30, 54, 57, 43, 37, 93, 75, 46, 53,
+    38, 37, 55, 97, 40, 39, 34, 52, 66, 59, 88, 59, 101};
+
+static const char common_pairs[] =
+    "thheineranreonatenndtiesorteofedisitalarsttontngsehaasouiolevecomedehir"
+    "iroicneearacelichllbemasiomur";
+
+static const uint8_t common_pair_cost[] = {
+    48, 50, 54, 56, 57, 58, 58, 61, 61, 62, 62, 62, 63, 64, 64, 64, 65,
+    65, 65, 65, 66, 66, 66, 67, 67, 67, 68, 68, 69, 69, 69, 70, 70, 70,
+    70, 71, 71, 72, 72, 72, 72, 73, 73, 74, 74, 74, 75, 75, 75, 75};
+
+/* minus the model's cost of each bigram of keys, per keymap */
+static float layout_model[N_KEYMAPS][LAYOUT_PAIRS];
+
+enum layout_fix {
+  LAYOUT_INFER,
+  LAYOUT_NAMED,  /* with --layout, only suggest others */
+  LAYOUT_PINNED, /* by a mode typing a known text, not even suggest */
+};
+
+struct layout {
+  /* saved in the stats file */
+  char name[LAYOUT_NAME_MAX]; /* of the keymap in use */
+  float pairs[LAYOUT_PAIRS];  /* recent bigrams, by slot of both keys */
+  float total;                /* their sum */
+  /* not saved */
+  int keymap;             /* in use, index in keymaps */
+  int fixed;              /* enum layout_fix */
+  int guess;              /* the best fit at the last check, -1 before */
+  float score[N_KEYMAPS]; /* minus the cost of a bigram at the last check */
+  uint32_t since;         /* bigrams since the last check */
+  int last_slot;          /* of the last key press, -1 if none */
+  uint64_t last_us;
+  char chars[KEY_CNT];            /* as spelt in words, */
+  unsigned char classes[KEY_CNT]; /* and how they split them */
+};
+
+#define LAYOUT_SAVED offsetof(struct layout, keymap)
+
+static int model_cost(unsigned char a, unsigned char b) {
+  int cost, i;
+
+  if (a < 'a' || a > 'z' || b < 'a' || b > 'z')
+    return (a >= 'a' && a <= 'z' ? letter_cost[a - 'a'] : LAYOUT_OTHER_COST) +
+           (b >= 'a' && b <= 'z' ? letter_cost[b - 'a'] : LAYOUT_OTHER_COST) +
+           LAYOUT_BACKOFF_COST;
+  cost = letter_cost[a - 'a'] + letter_cost[b - 'a'] + LAYOUT_BACKOFF_COST;
+  for (i = 0; common_pairs[2 * i]; i++) {
+    if (common_pairs[2 * i] == a && common_pairs[2 * i + 1] == b &&
+        common_pair_cost[i] < cost)
+      cost = common_pair_cost[i];
+  }
+  return cost;
+}
+
+/* Spell words through keymap k from now on. */
+static void layout_use(struct layout *l, int k) {
+  unsigned int code;
+  int slot;
+
+  l->keymap = k;
+  snprintf(l->name, sizeof(l->name), "%s", keymaps[k].name);
+  memcpy(l->chars, key_chars, sizeof(l->chars));
+  memcpy(l->classes, key_class, sizeof(l->classes));
+  for (code = 0; code <= KEY_SLASH; code++) {
+    unsigned char c;
+
+    if ((slot = layout_slot(code)) < 0)
+      continue;
+    c = keymaps[k].chars[slot];
+    l->chars[code] = keymap_fold(c);
+    l->classes[code] =
+        c >= 0x80 || isalpha(c) || c == '\'' ? KC_WORD : KC_PUNCT;
+  }
+}
+
+/* Work out the weights of each keymap, once. */
+static void layout_model_init(void) {
+  int k, i, j;
+
+  if (layout_model[0][0])
+    return;
+  for (k = 0; k < N_KEYMAPS; k++) {
+    const char *c = keymaps[k].chars;
+
+    for (i = 0; i < LAYOUT_KEYS; i++) {
+      for (j = 0; j < LAYOUT_KEYS; j++)
+        layout_model[k][i * LAYOUT_KEYS + j] = -model_cost(c[i], c[j]);
+    }
+  }
+}
+
+/**
+ * Set up layout inference.
+ *
+ * @param keymap The keymap named with --layout, or -1 to infer it.
+ */
+static void layout_init(struct layout *l, int keymap) {
+  layout_model_init();
+  memset(l, 0, sizeof(*l));
+  l->fixed = keymap >= 0 ? LAYOUT_NAMED : LAYOUT_INFER;
+  l->guess = -1;
+  l->last_slot = -1;
+  layout_use(l, keymap >= 0 ? keymap : 0);
+}
+
+/**
+ * Restore the recent bigrams, and unless --layout named one the keymap in
+ * use, from the stats file.
+ *
+ * @return 0 on success or 1 if the payload is malformed.
+ */
+static int layout_load(struct layout *l, const void *payload, uint32_t len) {
+  int k;
+
+  if (len != LAYOUT_SAVED)
+    return 1;
+  memcpy(l, payload, LAYOUT_SAVED);
+  l->name[sizeof(l->name) - 1] = '\0';
+  k = keymap_find(l->name);
+  layout_use(l, l->fixed || k < 0 ? l->keymap : k);
+  return 0;
+}
+
+/*
+ * Score the recent bigrams against each keymap, and switch to or suggest the
+ * best one if the evidence for it over the one in use is strong enough.
+ */
+static void layout_check(struct layout *l) {
+  int k, best = 0, was = l->guess;
+
+  for (k = 0; k < N_KEYMAPS; k++) {
+    l->score[k] = simd->dot(layout_model[k], l->pairs, LAYOUT_PAIRS) / l->total;
+    if (l->score[k] > l->score[best])
+      best = k;
+  }
+  if ((l->score[best] - l->score[l->keymap]) * l->total < LAYOUT_EVIDENCE)
+    best = l->keymap;
+  l->since = 0;
+  l->guess = best;
+  if (best == l->keymap || best == was)
+    return;
+  if (l->fixed) {
+    if (l->fixed == LAYOUT_NAMED)
+      fprintf(stderr, "kbstats: typing looks like %s rather than %s, "
+              "see --layout\n", keymaps[best].name, l->name);
+    return;
+  }
+  fprintf(stderr, "kbstats: typing looks like %s, spelling words in it "
+          "rather than %s\n", keymaps[best].name, l->name);
+  layout_use(l, best);
+}
+
+static void layout_key(struct layout *l, const struct key_record *rec) {
+  int slot = layout_slot(rec->code), i;
+
+  if (slot >= 0 && l->last_slot >= 0 && rec->time_us >= l->last_us &&
+      rec->time_us - l->last_us <= LAYOUT_MAX_GAP_US) {
+    l->pairs[l->last_slot * LAYOUT_KEYS + slot]++;
+    l->since++;
+    if (++l->total >= LAYOUT_WINDOW) {
+      for (i = 0; i < LAYOUT_PAIRS; i++)
+        l->pairs[i] /= 2;
+      l->total /= 2;
+    }
+    if (l->total >= LAYOUT_FIRST &&
+        l->since >= (l->guess < 0 ? LAYOUT_FIRST : LAYOUT_RECHECK))
+      layout_check(l);
+  }
+  l->last_slot = slot;
+  l->last_us = rec->time_us;
+}
+
+/**
+ * A word being typed, or just finished.
+ */
+struct word {
+  uint64_t start_us; /* press of the first letter */
+  uint64_t end_us;   /* press of the key that ended the word */
+  uint64_t last_us;  /* press of the latest letter */
+  uint64_t hash;     /* FNV-1a of the letters */
+  uint32_t len;
+  int clean; /* no backspace, no long pause, no longer than WORD_MAX */
+  char text[WORD_MAX + 1];
+};
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/**
+ * Feed one key press to the word being typed, spelt through the keymap in
+ * use.
+ *
+ * @return 1 if the press ended a word, 0 otherwise.
+ */
+static int word_key(struct word *w, const struct key_record *rec,
+                    const struct layout *l) {
+  enum key_class kc = rec->code < KEY_CNT ? l->classes[rec->code] : KC_OTHER;
+
+  switch (kc) {
+  case KC_WORD:
+    if (w->len == 0) {
+      w->start_us = rec->time_us;
+      w->hash = FNV_OFFSET;
+      w->clean = 1;
+    }
+    if (w->len < WORD_MAX)
+      w->text[w->len] = l->chars[rec->code];
+    else
+      w->clean = 0;
+    if (rec->time_us - w->last_us > WORD_MAX_PAUSE_US && w->len)
+      w->clean = 0;
+    w->last_us = rec->time_us;
+    w->hash = (w->hash ^ l->chars[rec->code]) * FNV_PRIME;
+    w->len++;
+    return 0;
+  case KC_BACKSPACE:
+    w->clean = 0;
+    return 0;
+  case KC_PUNCT:
+  case KC_SPACE:
+    if (w->len == 0)
+      return 0;
+    w->end_us = rec->time_us;
+    if (w->end_us - w->last_us > WORD_MAX_PAUSE_US)
+      w->clean = 0;
+    w->text[w->len < WORD_MAX ? w->len : WORD_MAX] = '\0';
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Personal records. Characters typed are counted per second over the last
+ * WPM_HORIZON seconds, so the 15 s, 60 s and 5 min window sums move by O(1)
+ * per keystroke and an all-time best is just a comparison. The best of each
+ * window over the last hour comes from a monotonic deque of the per-second
+ * window sums, which is O(1) amortised per second.
+ */
+#define WPM_HORIZON 300
+#define RECENT_SEC 3600
+#define WORD_MIN_LEN 4
+
+enum record_kind {
+  REC_WPM_15S,
+  REC_WPM_60S,
+  REC_WPM_5MIN,
+  REC_STREAK, /* characters typed without a backspace */
+  REC_WORD,   /* WPM of a single word, detail is its length */
+  REC_COUNT,
+};
+
+static const char *const record_names[REC_COUNT] = {
+    [REC_WPM_15S] = "Best 15 s WPM",
+    [REC_WPM_60S] = "Best 60 s WPM",
+    [REC_WPM_5MIN] = "Best 5 min WPM",
+    [REC_STREAK] = "Longest error-free streak",
+    [REC_WORD] = "Fastest word (WPM)",
+};
+
+/* window length in seconds of REC_WPM_15S .. REC_WPM_5MIN */
+static const int wpm_windows[] = {15, 60, 300};
+#define N_WPM_WINDOWS (sizeof(wpm_windows) / sizeof(*wpm_windows))
+
+/**
+ * A personal record as stored in the stats file.
+ */
+struct personal_record {
+  double value;
+  int64_t time; /* seconds since the epoch when it was set, 0 if never */
+  uint32_t detail;
+  uint32_t reserved;
+};
+
+/**
+ * Monotonic deque for a sliding-window maximum: values strictly decrease from
+ * front to back, so the front is the maximum of everything still in the
+ * window.
+ */
+struct max_deque {
+  struct {
+    int64_t t;
+    uint32_t v;
+  } e[RECENT_SEC + 1];
+  uint32_t head, len;
+};
+
+struct records {
+  struct personal_record best[REC_COUNT];
+
+  uint16_t per_sec[WPM_HORIZON]; /* characters typed in second s % HORIZON */
+  int64_t sec;                   /* second of the latest keystroke */
+  uint32_t window_sum[N_WPM_WINDOWS];
+  struct max_deque *recent[N_WPM_WINDOWS];
+
+  uint64_t streak;
+};
+
+static double window_wpm(uint32_t chars, int window) {
+  return chars / 5.0 * 60.0 / window;
+}
+
+static void deque_push(struct max_deque *d, int64_t t, uint32_t v) {
+  while (d->len && d->e[(d->head + d->len - 1) % (RECENT_SEC + 1)].v <= v)
+    d->len--;
+  while (d->len && d->e[d->head].t <= t - RECENT_SEC) {
+    d->head = (d->head + 1) % (RECENT_SEC + 1);
+    d->len--;
+  }
+  d->e[(d->head + d->len) % (RECENT_SEC + 1)].t = t;
+  d->e[(d->head + d->len) % (RECENT_SEC + 1)].v = v;
+  d->len++;
+}
+
+static uint32_t deque_max(const struct max_deque *d) {
+  return d->len ? d->e[d->head].v : 0;
+}
+
+static int records_init(struct records *r) {
+  int w;
+
+  for (w = 0; w < N_WPM_WINDOWS; w++) {
+    r->recent[w] = calloc(1, sizeof(struct max_deque));
+    if (!r->recent[w]) {
+      perror("kbstats: calloc");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void records_set(struct records *r, enum record_kind kind, double value,
+                        uint64_t time_us, uint32_t detail) {
+  if (value <= r->best[kind].value)
+    return;
+  r->best[kind].value = value;
+  r->best[kind].time = time_us / 1000000;
+  r->best[kind].detail = detail;
+}
+
+/**
+ * Move the per-second counts forward to second t, closing the seconds in
+ * between: each closed second's window sums go into the recent-best deques.
+ */
+static void records_advance(struct records *r, int64_t t) {
+  int64_t s;
+  int w;
+
+  if (t <= r->sec)
+    return; /* same second, or a slightly older event from another device */
+
+  if (t - r->sec > WPM_HORIZON) {
+    for (w = 0; w < N_WPM_WINDOWS; w++) {
+      deque_push(r->recent[w], r->sec, r->window_sum[w]);
+      r->window_sum[w] = 0;
+    }
+    memset(r->per_sec, 0, sizeof(r->per_sec));
+    r->sec = t;
+    return;
+  }
+
+  for (s = r->sec + 1; s <= t; s++) {
+    for (w = 0; w < N_WPM_WINDOWS; w++) {
+      deque_push(r->recent[w], s - 1, r->window_sum[w]);
+      r->window_sum[w] -= r->per_sec[(s - wpm_windows[w]) % WPM_HORIZON];
+    }
+    r->per_sec[s % WPM_HORIZON] = 0;
+  }
+  r->sec = t;
+}
+
+/**
+ * Update the records with one key press.
+ */
+static void records_key(struct records *r, const struct key_record *rec) {
+  enum key_class kc = rec->code < KEY_CNT ? key_class[rec->code] : KC_OTHER;
+  int w;
+
+  if (kc == KC_OTHER)
+    return;
+
+  if (kc == KC_BACKSPACE) {
+    r->streak = 0;
+    return;
+  }
+
+  records_advance(r, rec->time_us / 1000000);
+  r->per_sec[r->sec % WPM_HORIZON]++;
+  for (w = 0; w < N_WPM_WINDOWS; w++)
+    records_set(r, REC_WPM_15S + w,
+                window_wpm(++r->window_sum[w], wpm_windows[w]), rec->time_us,
+                0);
+
+  records_set(r, REC_STREAK, ++r->streak, rec->time_us, 0);
+}
+
+static void records_word(struct records *r, const struct word *w) {
+  if (w->len >= WORD_MIN_LEN && w->clean && w->end_us > w->start_us)
+    records_set(r, REC_WORD, w->len / 5.0 * 60e6 / (w->end_us - w->start_us),
+                w->end_us, w->len);
+}
+
+/*
+ * Slow words. Typing time per word goes into a count-min sketch keyed by a
+ * salted hash of the word, so no word text is kept unless --word-text is
+ * given. Each cell accumulates words, letters and microseconds; a word's
+ * estimate comes from the row where its count is smallest, i.e. the least
+ * polluted by collisions. Words seen at least SLOW_WORD_MIN_COUNT times
+ * compete for the slots of the slow list by time per letter.
+ *
+ * The day's words go into their own sketch, which is merged into the
+ * all-time one when the day changes. Memory is fixed at startup, where the
+ * sketch width and the length of the slow list follow the memory budget (see
+ * memory_plan()), and every update is O(SKETCH_DEPTH + slow list length).
+ * Widths are powers of two, so a sketch saved under a larger budget folds
+ * down to a smaller one.
+ */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024 /* without a memory budget */
+#define SKETCH_MIN_WIDTH 64
+#define SKETCH_MAX_WIDTH (1 << 20)
+#define SKETCH_LEN(width)                                                      \
+  (3 * SKETCH_DEPTH * (size_t)(width) * sizeof(uint64_t))
+#define SLOW_WORDS 16 /* without a memory budget */
+#define SLOW_WORDS_MIN 4
+#define SLOW_WORDS_MAX 256
+#define SLOW_WORD_MIN_COUNT 5
+
+/* Three columns of SKETCH_DEPTH rows of cells, in one allocation at count. */
+struct sketch {
+  uint64_t *count;
+  uint64_t *letters;
+  uint64_t *time_us;
+};
+
+struct slow_word {
+  uint64_t hash; /* salted, 0 for an empty slot */
+  double us_per_letter;
+  uint32_t count;
+  uint32_t len;
+  char text[WORD_MAX + 1]; /* empty unless --word-text was given */
+};
+
+/* BLOCK_WORDS payload; the two sketches follow in their own blocks */
+struct words_info {
+  uint64_t salt;
+  int64_t day; /* days since the epoch (UTC) the today sketch covers */
+  struct slow_word slow[]; /* nslow */
+};
+
+struct words {
+  struct words_info *info;
+  uint32_t nslow;
+  uint32_t width; /* cells per sketch row */
+  struct sketch today, total;
+};
+
+static void sketch_layout(struct sketch *s, uint64_t *cells, uint32_t width) {
+  size_t n = SKETCH_DEPTH * (size_t)width;
+
+  s->count = cells;
+  s->letters = cells + n;
+  s->time_us = cells + 2 * n;
+}
+
+static int words_init(struct words *ws, uint32_t width, uint32_t nslow) {
+  uint64_t *today = calloc(1, SKETCH_LEN(width));
+  uint64_t *total = calloc(1, SKETCH_LEN(width));
+
+  ws->info = calloc(1, sizeof(*ws->info) + nslow * sizeof(struct slow_word));
+  if (!today || !total || !ws->info) {
+    perror("kbstats: calloc");
+    return 1;
+  }
+  ws->nslow = nslow;
+  ws->width = width;
+  sketch_layout(&ws->today, today, width);
+  sketch_layout(&ws->total, total, width);
+  if (getrandom(&ws->info->salt, sizeof(ws->info->salt), 0) !=
+      sizeof(ws->info->salt)) {
+    perror("kbstats: getrandom");
+    return 1;
+  }
+  return 0;
+}
+
+static unsigned int sketch_cell(uint64_t hash, int row, uint32_t width) {
+  hash ^= (row + 1) * 0x9e3779b97f4a7c15ULL;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return row * width + (hash & (width - 1));
+}
+
+/**
+ * Halve the width of the sketch at cells until it is to, adding up the cells
+ * that then hold the same hashes.
+ */
+static void sketch_fold(uint64_t *cells, uint32_t from, uint32_t to) {
+  uint64_t *src, *dst;
+  uint32_t w, c;
+  int row;
+
+  /* rows of every column in turn; each cell moves down, never up */
+  for (w = from; w > to; w /= 2) {
+    for (row = 0; row < 3 * SKETCH_DEPTH; row++) {
+      src = cells + (size_t)row * w;
+      dst = cells + (size_t)row * (w / 2);
+      for (c = 0; c < w / 2; c++)
+        dst[c] = src[c] + src[w / 2 + c];
+    }
+  }
+}
+
+/**
+ * Restore a sketch from the stats file. One saved with a larger width is
+ * folded down; one saved with a smaller width can't be widened, so both
+ * sketches are folded down to it instead.
+ *
+ * @return 0 on success or 1 if the payload is malformed.
+ */
+static int words_load_sketch(struct words *ws, struct sketch *s,
+                             const void *payload, uint32_t len) {
+  uint32_t width = len / SKETCH_LEN(1);
+  uint64_t *cells;
+
+  if (!width || (width & (width - 1)) || len != SKETCH_LEN(width))
+    return 1;
+  if (width < ws->width) {
+    sketch_fold(ws->today.count, ws->width, width);
+    sketch_fold(ws->total.count, ws->width, width);
+    /* shrinking, so realloc can only fail to give memory back */
+    cells = realloc(ws->today.count, SKETCH_LEN(width));
+    sketch_layout(&ws->today, cells ? cells : ws->today.count, width);
+    cells = realloc(ws->total.count, SKETCH_LEN(width));
+    sketch_layout(&ws->total, cells ? cells : ws->total.count, width);
+    ws->width = width;
+  }
+
+  cells = malloc(len);
+  if (!cells) {
+    perror("kbstats: malloc");
+    return 1;
+  }
+  memcpy(cells, payload, len);
+  sketch_fold(cells, width, ws->width);
+  memcpy(s->count, cells, SKETCH_LEN(ws->width));
+  free(cells);
+  return 0;
+}
+
+static int cmp_slow_word(const void *a, const void *b) {
+  const struct slow_word *x = a, *y = b;
+  return (x->us_per_letter < y->us_per_letter) -
+         (x->us_per_letter > y->us_per_letter);
+}
+
+/**
+ * Restore the salt, day and slow list from the stats file, keeping the
+ * slowest words if the list was saved longer than it is now.
+ *
+ * @return 0 on success or 1 if the payload is malformed.
+ */
+static int words_load_info(struct words *ws, const void *payload,
+                           uint32_t len) {
+  const struct words_info *info = payload;
+  uint32_t n = (len - sizeof(*info)) / sizeof(struct slow_word);
+  struct slow_word *slow;
+
+  if (len < sizeof(*info) ||
+      len != sizeof(*info) + n * sizeof(struct slow_word))
+    return 1;
+  slow = malloc(n * sizeof(*slow) + 1);
+  if (!slow) {
+    perror("kbstats: malloc");
+    return 1;
+  }
+  memcpy(slow, info->slow, n * sizeof(*slow));
+  qsort(slow, n, sizeof(*slow), cmp_slow_word);
+
+  ws->info->salt = info->salt;
+  ws->info->day = info->day;
+  memset(ws->info->slow, 0, ws->nslow * sizeof(*slow));
+  memcpy(ws->info->slow, slow, (n < ws->nslow ? n : ws->nslow) * sizeof(*slow));
+  free(slow);
+  return 0;
+}
+
+/**
+ * Merge the day's sketch into the all-time one once words arrive from a later
+ * day.
+ */
+static void words_rollover(struct words *ws, int64_t day) {
+  size_t cells = SKETCH_DEPTH * (size_t)ws->width;
+
+  if (day <= ws->info->day)
+    return;
+  simd->counts_merge(ws->total.count, ws->today.count, cells);
+  simd->counts_merge(ws->total.letters, ws->today.letters, cells);
+  simd->counts_merge(ws->total.time_us, ws->today.time_us, cells);
+  memset(ws->today.count, 0, SKETCH_LEN(ws->width));
+  ws->info->day = day;
+}
+
+static void words_word(struct words *ws, const struct word *w) {
+  uint64_t hash = ws->info->salt ^ w->hash;
+  unsigned int cell[SKETCH_DEPTH], best = 0;
+  uint64_t count = UINT64_MAX, letters, time_us;
+  struct slow_word *slot = NULL;
+  int i;
+
+  if (!w->clean || w->end_us <= w->start_us)
+    return;
+
+  words_rollover(ws, w->end_us / 1000000 / 86400);
+
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    unsigned int c = cell[i] = sketch_cell(hash, i, ws->width);
+    uint64_t n;
+
+    ws->today.count[c]++;
+    ws->today.letters[c] += w->len;
+    ws->today.time_us[c] += w->end_us - w->start_us;
+
+    n = ws->today.count[c] + ws->total.count[c];
+    if (n < count) {
+      count = n;
+      best = c;
+    }
+  }
+
+  if (count < SLOW_WORD_MIN_COUNT)
+    return;
+  letters = ws->today.letters[best] + ws->total.letters[best];
+  time_us = ws->today.time_us[best] + ws->total.time_us[best];
+
+  /* update the word's slot, or take the slot of the fastest listed word */
+  for (i = 0; i < (int)ws->nslow; i++) {
+    struct slow_word *sw = &ws->info->slow[i];
+
+    if (sw->hash == hash) {
+      slot = sw;
+      break;
+    }
+    if (!slot || sw->us_per_letter < slot->us_per_letter)
+      slot = sw;
+  }
+  if (slot->hash != hash && slot->us_per_letter >= (double)time_us / letters)
+    return;
+
+  slot->hash = hash;
+  slot->us_per_letter = (double)time_us / letters;
+  slot->count = count;
+  slot->len = w->len;
+  if (word_text_flag)
+    memcpy(slot->text, w->text, sizeof(slot->text));
+  else
+    slot->text[0] = '\0';
+}
+
+/*
+ * Rollups and sessions. Key presses are counted per minute, and runs of
+ * typing without a SESSION_GAP_SEC pause form sessions. Closed minutes go
+ * into today's segment, which is sealed when the UTC day changes. Sealed
+ * segments and closed sessions wait until the next flush appends them to the
+ * history file (see history_pack()); today's segment lives in the stats
+ * file.
+ */
+#define SESSION_GAP_SEC 300
+#define PENDING_SESSIONS 16
+#define PENDING_SEGMENTS 4
+#define SEGMENT_ROWS 1440 /* minutes in a day */
+
+/**
+ * Key presses in one minute.
+ */
+struct rollup {
+  int64_t minute; /* seconds since the epoch at the start of the minute */
+  uint32_t keystrokes;
+  uint32_t chars; /* printable keys, including space and enter */
+  uint32_t backspaces;
+  uint32_t words;
+};
+
+struct session {
+  int64_t start; /* seconds since the epoch of the first key press */
+  int64_t end;   /* and of the last */
+  uint64_t keystrokes;
+  uint64_t chars;
+  uint64_t backspaces;
+  uint64_t words;
+};
+
+/*
+ * Rollup segments store minutes column by column. On disk each column is a
+ * run of LEB128 varints, the minute column as zigzag deltas, so a minute of
+ * typing costs a handful of bytes. Decoded, every column is a plain array at
+ * a 64-byte aligned offset of one 64-byte aligned body: the layout of an
+ * Arrow record batch body, which --export-arrow writes out unchanged.
+ */
+enum rollup_count {
+  COUNT_KEYSTROKES,
+  COUNT_CHARS,
+  COUNT_BACKSPACES,
+  COUNT_WORDS,
+  ROLLUP_COUNTS,
+};
+
+#define ROLLUP_COLUMNS (1 + ROLLUP_COUNTS)
+
+static const char *const rollup_column_names[ROLLUP_COLUMNS] = {
+    "minute", "keystrokes", "chars", "backspaces", "words"};
+
+struct segment {
+  uint32_t rows;
+  uint32_t cap;     /* rows the columns are laid out for */
+  uint8_t *body;    /* all columns */
+  size_t body_len;  /* bytes of body used by the columns */
+  size_t alloc_len; /* bytes allocated */
+  int64_t *minute;
+  uint32_t *count[ROLLUP_COUNTS];
+};
+
+struct segment_header {
+  uint32_t rows;
+  uint32_t columns; /* readers skip columns they don't know */
+  int64_t first_minute;
+};
+
+/* worst case encoded size of a segment */
+#define SEGMENT_MAX_LEN(rows)                                                  \
+  (sizeof(struct segment_header) + (size_t)(rows) * (10 + 5 * ROLLUP_COUNTS))
+
+static size_t column_len(uint32_t rows, size_t width) {
+  return (rows * width + 63) & ~(size_t)63;
+}
+
+/**
+ * Lay the columns of a segment out for cap rows, growing its body if needed.
+ * The segment is left empty.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int segment_layout(struct segment *s, uint32_t cap) {
+  size_t off, len = column_len(cap, sizeof(int64_t)) +
+                    ROLLUP_COUNTS * column_len(cap, sizeof(uint32_t));
+  int i;
+
+  if (len > s->alloc_len) {
+    void *p = aligned_alloc(64, len);
+
+    if (!p) {
+      perror("kbstats: segment");
+      return 1;
+    }
+    free(s->body);
+    s->body = p;
+    s->alloc_len = len;
+  }
+  if (len)
+    memset(s->body, 0, len);
+
+  s->minute = (int64_t *)s->body;
+  off = column_len(cap, sizeof(int64_t));
+  for (i = 0; i < ROLLUP_COUNTS; i++) {
+    s->count[i] = (uint32_t *)(s->body + off);
+    off += column_len(cap, sizeof(uint32_t));
+  }
+  s->body_len = len;
+  s->rows = 0;
+  s->cap = cap;
+  return 0;
+}
+
+static void segment_append(struct segment *s, const struct rollup *r) {
+  uint32_t i = s->rows++;
+
+  s->minute[i] = r->minute;
+  s->count[COUNT_KEYSTROKES][i] = r->keystrokes;
+  s->count[COUNT_CHARS][i] = r->chars;
+  s->count[COUNT_BACKSPACES][i] = r->backspaces;
+  s->count[COUNT_WORDS][i] = r->words;
+}
+
+static void segment_row(const struct segment *s, uint32_t i, struct rollup *r) {
+  r->minute = s->minute[i];
+  r->keystrokes = s->count[COUNT_KEYSTROKES][i];
+  r->chars = s->count[COUNT_CHARS][i];
+  r->backspaces = s->count[COUNT_BACKSPACES][i];
+  r->words = s->count[COUNT_WORDS][i];
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v) {
+  for (; v >= 0x80; v >>= 7)
+    *p++ = v | 0x80;
+  *p++ = v;
+  return p;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+  int shift;
+
+  *v = 0;
+  for (shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t b = *(*p)++;
+
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Encode a segment for the stats or history file.
+ *
+ * @param s The segment.
+ * @param out Room for SEGMENT_MAX_LEN(s->rows) bytes.
+ * @return The encoded length.
+ */
+static size_t segment_encode(const struct segment *s, uint8_t *out) {
+  struct segment_header h = {.rows = s->rows, .columns = ROLLUP_COLUMNS};
+  uint8_t *p = out + sizeof(h);
+  int64_t prev;
+  uint32_t i;
+  int c;
+
+  h.first_minute = s->rows ? s->minute[0] : 0;
+  memcpy(out, &h, sizeof(h));
+
+  for (i = 0, prev = h.first_minute; i < s->rows; prev = s->minute[i++]) {
+    int64_t d = s->minute[i] - prev;
+
+    p = put_varint(p, (uint64_t)d << 1 ^ (uint64_t)(d >> 63));
+  }
+  for (c = 0; c < ROLLUP_COUNTS; c++) {
+    for (i = 0; i < s->rows; i++)
+      p = put_varint(p, s->count[c][i]);
+  }
+
+  return p - out;
+}
+
+/**
+ * Decode a segment, laying its columns out for exactly its rows.
+ *
+ * @param s The segment to decode into; its body is reused if large enough.
+ * @return 0 on success or 1 if the payload is malformed.
+ */
+static int segment_decode(struct segment *s, const void *payload,
+                          uint32_t len) {
+  const uint8_t *p = payload, *end = p + len;
+  struct segment_header h;
+  int64_t minute;
+  uint64_t v;
+  uint32_t i;
+  int c;
+
+  if (len < sizeof(h))
+    return 1;
+  memcpy(&h, p, sizeof(h));
+  p += sizeof(h);
+  /* every value takes at least a byte */
+  if (h.columns < ROLLUP_COLUMNS || h.rows > len || segment_layout(s, h.rows))
+    return 1;
+
+  for (i = 0, minute = h.first_minute; i < h.rows; i++) {
+    if (get_varint(&p, end, &v))
+      return 1;
+    minute += (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    s->minute[i] = minute;
+  }
+  for (c = 0; c < ROLLUP_COUNTS; c++) {
+    for (i = 0; i < h.rows; i++) {
+      if (get_varint(&p, end, &v))
+        return 1;
+      s->count[c][i] = v;
+    }
+  }
+
+  s->rows = h.rows;
+  return 0;
+}
+
+struct rollups {
+  struct rollup cur;   /* minute being filled, minute 0 if none */
+  struct session sess; /* session in progress, start 0 if none */
+  struct segment seg;  /* today's closed minutes */
+  struct {
+    uint8_t *data; /* encoded */
+    uint32_t len;
+  } sealed[PENDING_SEGMENTS];
+  int nsealed;
+  struct session done[PENDING_SESSIONS];
+  int ndone;
+};
+
+static int rollups_init(struct rollups *r) {
+  return segment_layout(&r->seg, SEGMENT_ROWS);
+}
+
+/**
+ * Encode today's segment, and move it to the sealed list for the next flush.
+ */
+static void rollups_seal(struct rollups *r) {
+  uint8_t *p;
+
+  if (r->nsealed == PENDING_SEGMENTS)
+    return;
+  p = malloc(SEGMENT_MAX_LEN(r->seg.rows));
+  if (!p) {
+    perror("kbstats: malloc");
+    return;
+  }
+  r->sealed[r->nsealed].data = p;
+  r->sealed[r->nsealed++].len = segment_encode(&r->seg, p);
+  r->seg.rows = 0;
+}
+
+static void rollups_close_minute(struct rollups *r) {
+  struct segment *s = &r->seg;
+
+  if (r->cur.minute) {
+    if (s->rows == s->cap)
+      rollups_seal(r);
+    if (s->rows < s->cap)
+      segment_append(s, &r->cur);
+  }
+  memset(&r->cur, 0, sizeof(r->cur));
+}
+
+static void rollups_close_session(struct rollups *r) {
+  if (r->sess.start && r->ndone < PENDING_SESSIONS)
+    r->done[r->ndone++] = r->sess;
+  memset(&r->sess, 0, sizeof(r->sess));
+}
+
+/**
+ * Whether there is a sealed segment to flush, or the sessions should be
+ * flushed before they overflow.
+ */
+static int rollups_full(const struct rollups *r) {
+  return r->nsealed || r->ndone >= PENDING_SESSIONS / 2;
+}
+
+/**
+ * Restore today's segment from the stats file. The minute in progress is
+ * saved in a block of its own and only joins the segment once it closes.
+ *
+ * @return 0 on success or 1 if the payload is malformed.
+ */
+static int rollups_load(struct rollups *r, const void *payload, uint32_t len) {
+  struct segment tmp = {0};
+  struct rollup row;
+  uint32_t i;
+  int err;
+
+  err = segment_decode(&tmp, payload, len);
+  r->seg.rows = 0;
+  for (i = 0; !err && i < tmp.rows && i < r->seg.cap; i++) {
+    segment_row(&tmp, i, &row);
+    segment_append(&r->seg, &row);
+  }
+  free(tmp.body);
+
+  return err;
+}
+
+/**
+ * Count a key press.
+ *
+ * @param r The rollups.
+ * @param rec The key press.
+ * @param closed Set to the minute the key press closed, if any.
+ * @return 1 if a minute closed, 0 otherwise.
+ */
+static int rollups_key(struct rollups *r, const struct key_record *rec,
+                       struct rollup *closed) {
+  enum key_class kc = rec->code < KEY_CNT ? key_class[rec->code] : KC_OTHER;
+  struct segment *s = &r->seg;
+  int64_t sec = rec->time_us / 1000000;
+  int64_t minute = sec - sec % 60;
+  int is_char = kc == KC_WORD || kc == KC_PUNCT || kc == KC_SPACE;
+  int ret = 0;
+
+  if (r->sess.start && sec - r->sess.end > SESSION_GAP_SEC)
+    rollups_close_session(r);
+  if (!r->sess.start)
+    r->sess.start = sec;
+  if (sec > r->sess.end)
+    r->sess.end = sec;
+
+  if (minute > r->cur.minute) {
+    *closed = r->cur;
+    ret = r->cur.minute != 0;
+    rollups_close_minute(r);
+    if (s->rows && s->minute[0] / 86400 != minute / 86400)
+      rollups_seal(r);
+    r->cur.minute = minute;
+  }
+
+  r->cur.keystrokes++;
+  r->cur.chars += is_char;
+  r->cur.backspaces += kc == KC_BACKSPACE;
+  r->sess.keystrokes++;
+  r->sess.chars += is_char;
+  r->sess.backspaces += kc == KC_BACKSPACE;
+  return ret;
+}
+
+static void rollups_word(struct rollups *r, const struct word *w) {
+  r->cur.words++;
+  r->sess.words++;
+}
+
+/*
+ * Bigrams: for each ordered pair of keys pressed one after the other (within
+ * BIGRAM_MAX_GAP_US), how often and the total press-to-press interval. Only
+ * the first BIGRAM_KEYS key codes, which cover the main block of a keyboard,
+ * are tracked.
+ */
+#define BIGRAM_KEYS 128
+#define BIGRAM_MAX_GAP_US 2000000
+
+struct bigram_table {
+  uint64_t count[BIGRAM_KEYS * BIGRAM_KEYS];
+  uint64_t interval_us[BIGRAM_KEYS * BIGRAM_KEYS];
+};
+
+struct bigrams {
+  struct bigram_table *table;
+  uint16_t last_code; /* KEY_RESERVED if none */
+  uint64_t last_us;
+};
+
+static int bigrams_init(struct bigrams *b) {
+  b->table = calloc(1, sizeof(*b->table));
+  if (!b->table) {
+    perror("kbstats: calloc");
+    return 1;
+  }
+  return 0;
+}
+
+static void bigrams_key(struct bigrams *b, const struct key_record *rec) {
+  uint64_t gap = rec->time_us - b->last_us;
+
+  if (rec->code >= BIGRAM_KEYS) {
+    b->last_code = KEY_RESERVED;
+    return;
+  }
+  if (b->last_code != KEY_RESERVED && rec->time_us >= b->last_us &&
+      gap <= BIGRAM_MAX_GAP_US) {
+    unsigned int i = b->last_code * BIGRAM_KEYS + rec->code;
+
+    b->table->count[i]++;
+    b->table->interval_us[i] += gap;
+  }
+  b->last_code = rec->code;
+  b->last_us = rec->time_us;
+}
+
+/*
+ * Debounce. A bouncy or worn switch can report a press, a release and
+ * another press within a few milliseconds; a press that comes sooner than
+ * its key's threshold after the key's last release is taken for chatter and
+ * dropped before any other stage sees it.
+ *
+ * The thresholds are learned per key from a histogram of the release to
+ * press gaps under DEBOUNCE_BUCKETS ms, where deliberate re-presses hardly
+ * ever fall. Every DEBOUNCE_EVAL presses of a key its target becomes the
+ * DEBOUNCE_QUANTILE of those gaps plus a margin, or the minimum once the key
+ * has stopped chattering. A threshold widens as soon as the target is
+ * DEBOUNCE_HYSTERESIS ms above it, but narrows only when the target has been
+ * that far below it for DEBOUNCE_SETTLE evaluations running, so it doesn't
+ * flap. The histograms halve every DEBOUNCE_WINDOW presses, following a
+ * switch as it wears. What is learned is kept in the stats file per device
+ * identity, see device_identity().
+ */
+#define DEBOUNCE_KEYS 256 /* key codes debounced; the rest pass through */
+#define DEBOUNCE_BUCKETS 32
+#define DEBOUNCE_DEFAULT_MSEC 5
+#define DEBOUNCE_MIN_MSEC 1
+#define DEBOUNCE_MAX_MSEC 20
+#define DEBOUNCE_MARGIN_MSEC 1
+#define DEBOUNCE_QUANTILE 98
+#define DEBOUNCE_HYSTERESIS 2
+#define DEBOUNCE_SETTLE 4
+#define DEBOUNCE_EVAL 32
+#define DEBOUNCE_WINDOW 4096
+#define DEBOUNCE_MIN_SAMPLES 8
+#define DEVICE_ID_MAX 96
+
+struct debounce_key {
+  uint16_t gaps[DEBOUNCE_BUCKETS]; /* release to press gaps, 1 ms each */
+  uint16_t presses;                /* since the histogram last halved */
+  uint8_t msec;                    /* threshold */
+  uint8_t settle; /* evaluations the target has been below msec */
+};
+
+struct debounce_dev {
+  /* saved in the stats file */
+  char id[DEVICE_ID_MAX];
+  uint64_t dropped;
+  struct debounce_key key[DEBOUNCE_KEYS];
+  /* not saved */
+  uint64_t up_us[DEBOUNCE_KEYS]; /* last release, 0 if none */
+};
+
+#define DEBOUNCE_SAVED offsetof(struct debounce_dev, up_us)
+
+struct debounce {
+  struct debounce_dev *known[MAX_DEVICES]; /* loaded or seen */
+  int nknown;
+  struct debounce_dev *dev[MAX_DEVICES]; /* by index in capture.fds */
+};
+
+/**
+ * Find the state of a device by identity, adding it if it is new.
+ *
+ * @return The state, or NULL if there is no room.
+ */
+static struct debounce_dev *debounce_find(struct debounce *d, const char *id) {
+  struct debounce_dev *dd;
+  int i;
+
+  for (i = 0; i < d->nknown; i++) {
+    if (strncmp(d->known[i]->id, id, DEVICE_ID_MAX) == 0)
+      return d->known[i];
+  }
+  if (d->nknown == MAX_DEVICES)
+    return NULL;
+  dd = calloc(1, sizeof(*dd));
+  if (!dd) {
+    perror("kbstats: calloc");
+    return NULL;
+  }
+  snprintf(dd->id, sizeof(dd->id), "%s", id);
+  for (i = 0; i < DEBOUNCE_KEYS; i++)
+    dd->key[i].msec = DEBOUNCE_DEFAULT_MSEC;
+  return d->known[d->nknown++] = dd;
+}
+
+/**
+ * Restore the thresholds learned for a device from the stats file.
+ *
+ * @return 0 on success or 1 if the payload is malformed.
+ */
+static int debounce_load(struct debounce *d, const void *payload,
+                         uint32_t len) {
+  struct debounce_dev *dd;
+  char id[DEVICE_ID_MAX];
+
+  if (len != DEBOUNCE_SAVED)
+    return 1;
+  memcpy(id, payload, sizeof(id));
+  id[sizeof(id) - 1] = '\0';
+  dd = debounce_find(d, id);
+  if (dd)
+    memcpy(dd, payload, DEBOUNCE_SAVED);
+  return 0;
+}
+
+/**
+ * Move a key's threshold towards the one its gap histogram calls for.
+ */
+static void debounce_adapt(struct debounce_key *k) {
+  uint32_t n = 0, seen = 0;
+  int b, target = DEBOUNCE_MIN_MSEC;
+
+  for (b = 0; b < DEBOUNCE_BUCKETS; b++)
+    n += k->gaps[b];
+  if (n >= DEBOUNCE_MIN_SAMPLES) {
+    for (b = 0; b < DEBOUNCE_BUCKETS - 1; b++) {
+      seen += k->gaps[b];
+      if (seen * 100 >= n * DEBOUNCE_QUANTILE)
+        break;
+    }
+    /* bucket b holds gaps up to b + 1 ms */
+    target = b + 1 + DEBOUNCE_MARGIN_MSEC;
+    if (target > DEBOUNCE_MAX_MSEC)
+      target = DEBOUNCE_MAX_MSEC;
+  }
+
+  if (target >= k->msec + DEBOUNCE_HYSTERESIS) {
+    k->msec = target;
+    k->settle = 0;
+  } else if (target + DEBOUNCE_HYSTERESIS <= k->msec) {
+    if (++k->settle == DEBOUNCE_SETTLE) {
+      k->msec = target;
+      k->settle = 0;
+    }
+  } else {
+    k->settle = 0;
+  }
+}
+
+/**
+ * Learn from a key event and decide whether it is chatter.
+ *
+ * @param d The debounce state.
+ * @param rec The key event.
+ * @param id Identity of the device it came from.
+ * @return 1 if the event should be dropped, 0 otherwise.
+ */
+static int debounce_key(struct debounce *d, const struct key_record *rec,
+                        const char *id) {
+  struct debounce_dev *dd;
+  struct debounce_key *k;
+  uint64_t up, gap;
+  int b, bounce;
+
+  if (rec->code >= DEBOUNCE_KEYS || rec->dev >= MAX_DEVICES)
+    return 0;
+  dd = d->dev[rec->dev];
+  if (!dd && !(dd = d->dev[rec->dev] = debounce_find(d, id)))
+    return 0;
+  k = &dd->key[rec->code];
+
+  if (rec->value == 0)
+    dd->up_us[rec->code] = rec->time_us;
+  if (rec->value != 1)
+    return 0;
+
+  up = dd->up_us[rec->code];
+  gap = rec->time_us - up;
+  bounce = up && rec->time_us >= up && gap < DEBOUNCE_BUCKETS * 1000;
+  if (bounce && k->gaps[gap / 1000] < UINT16_MAX)
+    k->gaps[gap / 1000]++;
+  if (++k->presses % DEBOUNCE_EVAL == 0)
+    debounce_adapt(k);
+  if (k->presses == DEBOUNCE_WINDOW) {
+    for (b = 0; b < DEBOUNCE_BUCKETS; b++)
+      k->gaps[b] /= 2;
+    k->presses /= 2;
+  }
+
+  if (bounce && gap < k->msec * 1000ULL) {
+    dd->dropped++;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Key counts are sharded by device. Each device's counts live in a shard of
+ * their own, found by the device's identity like its debounce state, and a
+ * shard is only ever written for records of its device, by whoever owns that
+ * device's batches; there are no counters all devices write to. The global
+ * counts are merged from the shards when read, by kb_totals() for the
+ * snapshot and kb_merge() for saving and export, so per-device and global
+ * figures come from the same counters. Counts from before devices had shards,
+ * and from records of no known device, stay in base.
+ */
+struct kb_shard {
+  char id[DEVICE_ID_MAX];
+  struct kb_stats stats;
+};
+
+struct kb_shards {
+  struct kb_stats base;
+  struct kb_shard *known[MAX_DEVICES]; /* loaded or seen */
+  int nknown;
+  struct kb_shard *dev[MAX_DEVICES]; /* by index in capture.fds */
+};
+
+/**
+ * Find the shard of a device by identity, adding it if it is new.
+ *
+ * @return The shard, or NULL if there is no room.
+ */
+static struct kb_shard *kb_shard_find(struct kb_shards *ks, const char *id) {
+  struct kb_shard *sh;
+  int i;
+
+  for (i = 0; i < ks->nknown; i++) {
+    if (strncmp(ks->known[i]->id, id, DEVICE_ID_MAX) == 0)
+      return ks->known[i];
+  }
+  if (ks->nknown == MAX_DEVICES)
+    return NULL;
+  sh = calloc(1, sizeof(*sh));
+  if (!sh) {
+    perror("kbstats: calloc");
+    return NULL;
+  }
+  snprintf(sh->id, sizeof(sh->id), "%s", id);
+  return ks->known[ks->nknown++] = sh;
+}
+
+/**
+ * Restore the counts of a device from the stats file.
+ *
+ * @return 0 on success or 1 if the payload is malformed.
+ */
+static int kb_shard_load(struct kb_shards *ks, const void *payload,
+                         uint32_t len) {
+  struct kb_shard *sh;
+  char id[DEVICE_ID_MAX];
+
+  if (len != sizeof(*sh))
+    return 1;
+  memcpy(id, payload, sizeof(id));
+  id[sizeof(id) - 1] = '\0';
+  sh = kb_shard_find(ks, id);
+  if (sh)
+    memcpy(sh, payload, sizeof(*sh));
+  return 0;
+}
+
+/**
+ * The counts a record goes into: its device's shard, or base.
+ */
+static struct kb_stats *kb_shard(struct kb_shards *ks,
+                                 const struct key_record *rec,
+                                 const char *id) {
+  struct kb_shard *sh;
+
+  if (rec->dev >= MAX_DEVICES)
+    return &ks->base;
+  sh = ks->dev[rec->dev];
+  if (!sh && !(sh = ks->dev[rec->dev] = kb_shard_find(ks, id)))
+    return &ks->base;
+  return &sh->stats;
+}
+
+/**
+ * Add up the events and keystrokes of all shards.
+ */
+static void kb_totals(const struct kb_shards *ks, uint64_t *events,
+                      uint64_t *keystrokes) {
+  int i;
+
+  *events = ks->base.events;
+  *keystrokes = ks->base.keystrokes;
+  for (i = 0; i < ks->nknown; i++) {
+    *events += ks->known[i]->stats.events;
+    *keystrokes += ks->known[i]->stats.keystrokes;
+  }
+}
+
+/**
+ * Add up all the counts of all shards.
+ */
+static void kb_merge(const struct kb_shards *ks, struct kb_stats *out) {
+  int i, k;
+
+  *out = ks->base;
+  for (i = 0; i < ks->nknown; i++) {
+    const struct kb_stats *s = &ks->known[i]->stats;
+
+    out->events += s->events;
+    out->keystrokes += s->keystrokes;
+    for (k = 0; k < KEY_CNT; k++)
+      out->presses[k] += s->presses[k];
+  }
+}
+
+static uint64_t sub_sat(uint64_t a, uint64_t b) { return a > b ? a - b : 0; }
+
+/**
+ * Take the counts of the shards out of base once both are loaded from a
+ * stats file, where base was saved as the merged counts.
+ */
+static void kb_unmerge(struct kb_shards *ks) {
+  struct kb_stats *b = &ks->base;
+  int i, k;
+
+  for (i = 0; i < ks->nknown; i++) {
+    const struct kb_stats *s = &ks->known[i]->stats;
+
+    b->events = sub_sat(b->events, s->events);
+    b->keystrokes = sub_sat(b->keystrokes, s->keystrokes);
+    for (k = 0; k < KEY_CNT; k++)
+      b->presses[k] = sub_sat(b->presses[k], s->presses[k]);
+  }
+}
+
+/*
+ * Memory accounting. Every subsystem reports the bytes it has allocated
+ * (reserved), the part of them holding data (used), and the most it has used
+ * since start (high), so that growth shows up long before the RSS does.
+ * Besides the RSS, they are in the snapshot, at GET /memory and in the
+ * loopback report.
+ *
+ * The allocations that grow with use are bounded by the memory budget: the
+ * word sketches and the slow list are sized from it at startup, and nothing
+ * else grows past a day's worth of rollups or the queries of the views.
+ */
+enum mem_subsystem {
+  MEM_RING,
+  MEM_COUNTS,
+  MEM_RECORDS,
+  MEM_WORDS,
+  MEM_ROLLUPS,
+  MEM_BIGRAMS,
+  MEM_DEBOUNCE,
+  MEM_GROUPS,
+  MEM_VIEWS,
+  MEM_SERVER,
+  N_MEM
+};
+
+static const char *const mem_names[N_MEM] = {
+    "ring",     "counts", "records", "words",  "rollups",
+    "bigrams", "debounce", "groups", "views", "server"};
+
+struct mem_usage {
+  uint64_t reserved;
+  uint64_t used;
+  uint64_t high;
+};
+
+/**
+ * Parse a size in bytes with an optional K, M or G suffix (powers of 1024).
+ *
+ * @return 0 on success or 1 if s isn't a size.
+ */
+static int parse_size(const char *s, uint64_t *size) {
+  unsigned long long n;
+  char *end;
+  int shift = 0;
+
+  errno = 0;
+  n = strtoull(s, &end, 10);
+  if (end == s || errno || *s == '-')
+    return 1;
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    shift += 10; /* fall through */
+  case 'M':
+    shift += 10; /* fall through */
+  case 'K':
+    shift += 10;
+    end++;
+  }
+  while (isspace((unsigned char)*end))
+    end++;
+  if (*end || n > UINT64_MAX >> shift)
+    return 1;
+  *size = (uint64_t)n << shift;
+  return 0;
+}
+
+/**
+ * Size the word sketches and the slow list for a memory budget. The tables
+ * of fixed size come off the top; of the rest, the sketches get the widest
+ * power of two that fits in three quarters and the slow list what fits in
+ * the last quarter.
+ *
+ * @param budget Bytes, 0 for the built-in sizes.
+ * @param width Set to the width of the sketch rows.
+ * @param nslow Set to the length of the slow list.
+ */
+static void memory_plan(uint64_t budget, uint32_t *width, uint32_t *nslow) {
+  uint64_t fixed = sizeof(struct ring) + sizeof(struct bigram_table) +
+                   sizeof(struct records) +
+                   column_len(SEGMENT_ROWS, sizeof(int64_t)) +
+                   ROLLUP_COUNTS * column_len(SEGMENT_ROWS, sizeof(uint32_t));
+  uint64_t rest = budget > fixed ? budget - fixed : 0, n;
+  uint32_t w;
+
+  if (!budget) {
+    *width = SKETCH_WIDTH;
+    *nslow = SLOW_WORDS;
+    return;
+  }
+
+  for (w = SKETCH_MAX_WIDTH;
+       w > SKETCH_MIN_WIDTH && 2 * SKETCH_LEN(w) > rest / 4 * 3; w /= 2)
+    ;
+  n = rest / 4 / sizeof(struct slow_word);
+  *width = w;
+  *nslow = n < SLOW_WORDS_MIN ? SLOW_WORDS_MIN
+           : n > SLOW_WORDS_MAX ? SLOW_WORDS_MAX
+                                : n;
+  if (2 * SKETCH_LEN(w) > rest / 4 * 3 || n < SLOW_WORDS_MIN)
+    fprintf(stderr,
+            "kbstats: memory budget of %llu bytes is too small, using %llu\n",
+            (unsigned long long)budget,
+            (unsigned long long)(fixed + 2 * SKETCH_LEN(w) +
+                                 *nslow * sizeof(struct slow_word)));
+}
+
+/**
+ * Aggregates published in shared memory for other processes. The writer makes
+ * seq odd while it updates the fields and even again afterwards; a reader that
+ * sees an odd or changed seq retries.
+ */
+struct kb_snapshot {
+  uint32_t seq;
+  uint32_t devices;
+  uint64_t events;
+  uint64_t keystrokes;
+  uint64_t dropped;
+  uint64_t first_event_us; /* time to the first event, 0 until then */
+  struct timespec updated; /* CLOCK_MONOTONIC */
+  /* WPM over the 15 s, 60 s and 5 min windows ending now, their best over
+   * the last hour and their all-time best */
+  double wpm[N_WPM_WINDOWS];
+  double hour_best_wpm[N_WPM_WINDOWS];
+  double best_wpm[N_WPM_WINDOWS];
+  uint64_t streak;
+  uint64_t best_streak;
+  /* typing session in progress, start 0 if none */
+  int64_t session_start;
+  int64_t session_end;
+  uint64_t session_keystrokes;
+  /* memory, in bytes; see memory_update() */
+  uint64_t memory_budget; /* 0 for none */
+  uint64_t rss;
+  uint64_t rss_high;
+  struct mem_usage mem[N_MEM];
+  /* flushes; see "Persistence" */
+  uint32_t flush_queue; /* waiting or being written */
+  uint64_t flushes;     /* written, failed included */
+  uint64_t flushes_failed;
+  uint64_t flush_ns;     /* from handed over to written, the last */
+  uint64_t flush_max_ns; /* and the slowest */
+  /* keyboard layout; see "Layout inference" */
+  uint32_t layout;       /* keymap in use, index in keymaps */
+  uint32_t layout_fixed; /* named with --layout */
+  int32_t layout_guess;  /* the best fit at the last check, -1 before */
+  float layout_bigrams;  /* recent bigrams scored */
+  float layout_score[N_KEYMAPS];
+};
+
+/**
+ * Per-event latency samples, only collected in loopback mode.
+ */
+struct latency {
+  uint64_t *ns;
+  size_t n, cap;
+};
+
+/*
+ * Persistence. Files are never written on the capture or aggregator
+ * threads: a flush packs what is due, the history blocks as they are to be
+ * appended and the stats file as an image in memory, into a struct flush
+ * that nothing changes after, and in capture mode hands it to a writer
+ * thread running at idle I/O priority. Each file takes the writer one
+ * syscall. Flushes queue up behind a slow disk without ever holding up the
+ * aggregator; only the newest stats image is kept among those waiting, as
+ * it supersedes the others, so what waits behind it is history blocks.
+ * fdatasync() is only called at the durability points --sync asks for, see
+ * enum sync_point; the last save, when the aggregator stops, is always made
+ * durable. Elsewhere, as in the modes that save once, flushes are written on
+ * the spot. Either way a stats file is only written once the history blocks
+ * ahead of it are appended, as it no longer holds their days; blocks that
+ * fail to append are kept and tried again ahead of the next flush.
+ */
+enum sync_point {
+  SYNC_FLUSH, /* every flush */
+  SYNC_DAY,   /* flushes that append a day's rollups to the history */
+  SYNC_EXIT,  /* only the last save */
+  N_SYNC_POINTS,
+};
+
+static const char *const sync_names[N_SYNC_POINTS] = {"flush", "day", "exit"};
+
+struct flush {
+  char *stats; /* image of the stats file, NULL if a newer one waits */
+  size_t stats_len;
+  uint8_t *history; /* blocks to append to the history file */
+  size_t history_len;
+  int sync;           /* make both durable */
+  uint64_t queued_ns; /* when the aggregator handed it over */
+  struct flush *next;
+};
+
+struct persister {
+  pthread_t thread;
+  pthread_mutex_t lock; /* for waiting and stopping */
+  pthread_cond_t cond;
+  struct flush *waiting; /* oldest first */
+  int stalled;           /* the first failed to append, wait for the next */
+  int stopping;          /* write what waits, then stop */
+  const char *stats_path;
+  const char *history_path;
+  /* atomic, for snapshot_publish() */
+  uint32_t queue;           /* flushes waiting or being written */
+  int retry;                /* one failed, for drain_ring() to save again */
+  uint64_t flushes, failed; /* written, and of those not */
+  uint64_t last_ns, max_ns; /* from handed over to written */
+};
+
+/**
+ * State of the capture pipeline. The reader half (fds, epfd) and the
+ * aggregator half (stats, snapshot) meet at the ring; they run in the same
+ * process, or in two when capture is privilege separated.
+ */
+struct capture {
+  int epfd;
+  int ndev;
+  int fds[MAX_DEVICES];
+  uint8_t resyncing[MAX_DEVICES]; /* dropping events until SYN_REPORT */
+  struct ring *ring;
+  int wakefd; /* eventfd the reader signals when the aggregator is waiting */
+  int peer;   /* socket to the other process, or -1 if there is none */
+  unsigned int stages; /* bitmask of enabled stages, see STAGE_ON() */
+  struct kb_shards shards; /* key counts */
+  struct word word;
+  struct records records;
+  struct words words;
+  struct rollups rollups;
+  struct bigrams bigrams;
+  struct layout layout;
+  struct debounce debounce;
+  char dev_id[MAX_DEVICES][DEVICE_ID_MAX]; /* see device_identity() */
+  struct views *views; /* NULL if the config file names none */
+  struct device_groups *groups; /* NULL if the config file names none */
+  struct kb_snapshot *snapshot;
+  struct server *server; /* NULL if not serving */
+  struct archiver *archiver; /* NULL if not compacting the history */
+  struct persister *persister; /* NULL if flushes are written on the spot */
+  char *stats_path;      /* where to persist aggregates, NULL for nowhere */
+  char *history_path;    /* where closed rollups and sessions are appended */
+  uint8_t *unwritten;    /* packed for the history but not appended yet */
+  size_t unwritten_len;
+  int dirty;             /* aggregates changed since the last save */
+  uint64_t flushed_ns;
+  int quiet;       /* don't print keys as they come in */
+  int idle_msec;   /* give up after this long without events, -1 for never */
+  uint64_t expect; /* stop after this many keystrokes, 0 for never */
+  uint64_t start_ns; /* when capture started, for ring.first_event_us */
+  struct latency *read_lat;
+  struct latency *publish_lat;
+  uint64_t memory_budget;      /* bytes, 0 for the built-in sizes */
+  struct mem_usage mem[N_MEM]; /* see memory_update() */
+  uint64_t rss, rss_high;
+  uint64_t rss_ns; /* when rss was last read */
+};
+
+static uint64_t timespec_ns(const struct timespec *ts) {
+  return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return timespec_ns(&ts);
+}
+
+/**
+ * Map the shared snapshot, creating it if necessary.
+ *
+ * @param name The POSIX shared memory object name, e.g. SNAPSHOT_NAME.
+ * @return The mapped snapshot, or NULL on error.
+ */
+static struct kb_snapshot *snapshot_open(const char *name) {
+  struct kb_snapshot *s;
+  int fd;
+
+  fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("kbstats: shm_open");
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(*s)) < 0) {
+    perror("kbstats: ftruncate");
+    close(fd);
+    return NULL;
+  }
+  s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  return s == MAP_FAILED ? NULL : s;
+}
+
+/**
+ * Copy the current totals into the shared snapshot.
+ */
+static void snapshot_publish(struct capture *cap) {
+  struct kb_snapshot *s = cap->snapshot;
+  const struct records *r = &cap->records;
+  int w;
+
+  if (!s)
+    return;
+
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  s->devices = cap->ndev;
+  kb_totals(&cap->shards, &s->events, &s->keystrokes);
+  s->dropped = __atomic_load_n(&cap->ring->dropped, __ATOMIC_RELAXED);
+  s->first_event_us =
+      __atomic_load_n(&cap->ring->first_event_us, __ATOMIC_RELAXED);
+  clock_gettime(CLOCK_MONOTONIC, &s->updated);
+  for (w = 0; w < N_WPM_WINDOWS; w++) {
+    uint32_t sum = r->window_sum[w], hour = deque_max(r->recent[w]);
+
+    s->wpm[w] = window_wpm(sum, wpm_windows[w]);
+    s->hour_best_wpm[w] = window_wpm(sum > hour ? sum : hour, wpm_windows[w]);
+    s->best_wpm[w] = r->best[REC_WPM_15S + w].value;
+  }
+  s->streak = r->streak;
+  s->best_streak = r->best[REC_STREAK].value;
+  s->session_start = cap->rollups.sess.start;
+  s->session_end = cap->rollups.sess.end;
+  s->session_keystrokes = cap->rollups.sess.keystrokes;
+  s->memory_budget = cap->memory_budget;
+  s->rss = cap->rss;
+  s->rss_high = cap->rss_high;
+  memcpy(s->mem, cap->mem, sizeof(s->mem));
+  if (cap->persister) {
+    const struct persister *p = cap->persister;
+
+    s->flush_queue = __atomic_load_n(&p->queue, __ATOMIC_RELAXED);
+    s->flushes = __atomic_load_n(&p->flushes, __ATOMIC_RELAXED);
+    s->flushes_failed = __atomic_load_n(&p->failed, __ATOMIC_RELAXED);
+    s->flush_ns = __atomic_load_n(&p->last_ns, __ATOMIC_RELAXED);
+    s->flush_max_ns = __atomic_load_n(&p->max_ns, __ATOMIC_RELAXED);
+  }
+  s->layout = cap->layout.keymap;
+  s->layout_fixed = cap->layout.fixed;
+  s->layout_guess = cap->layout.guess;
+  s->layout_bigrams = cap->layout.total;
+  memcpy(s->layout_score, cap->layout.score, sizeof(s->layout_score));
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The stats file: a header followed by typed, length-prefixed blocks. Blocks
+ * of unknown type are skipped on load, so aggregates can be added without
+ * breaking older files or older binaries. So is the BLOCK_CHECKSUM written
+ * ahead of each block, the CRC32C of the block's header and payload, which is
+ * checked whenever the block is read. A block that fails it is left out
+ * rather than failing the whole read; stats_load() keeps a copy in
+ * STATS.quarantine, as the next save will not have it. The top byte of a
+ * block's type is the version of its layout, see "Block schemas" below.
+ */
+#define STATS_MAGIC "KBSTATS"
+#define STATS_VERSION 1
+#define STATS_FLUSH_SEC 60
+
+enum block_type {
+  BLOCK_RECORDS = 1,
+  BLOCK_WORDS,
+  BLOCK_SKETCH_TODAY,
+  BLOCK_SKETCH_TOTAL,
+  BLOCK_KEYS,
+  BLOCK_BIGRAMS,
+  /* history file */
+  BLOCK_ROLLUPS, /* rows, written before segments */
+  BLOCK_SESSIONS,
+  /* today's segment in the stats file, sealed ones in the history file */
+  BLOCK_SEGMENT,
+  /* stats file */
+  BLOCK_MINUTE, /* the minute in progress, a struct rollup */
+  BLOCK_VIEW,
+  BLOCK_DEBOUNCE, /* one per device */
+  /* history file, once compacted */
+  BLOCK_ARCHIVE_DICT,
+  BLOCK_ARCHIVE,
+  /* stats file */
+  BLOCK_DEVICE_KEYS, /* one per device, a struct kb_shard */
+  /* both, ahead of the block it covers */
+  BLOCK_CHECKSUM,
+  /* history file, filling out a block rewritten shorter */
+  BLOCK_PAD,
+  /* stats file */
+  BLOCK_LAYOUT, /* the saved part of a struct layout */
+};
+
+struct stats_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct block_header {
+  uint32_t type;
+  uint32_t len; /* payload bytes following the header */
+};
+
+/* BLOCK_CHECKSUM payload */
+struct block_checksum {
+  uint32_t crc; /* of the next block, header and payload */
+};
+
+/* the checksum the next block read has to match */
+struct block_check {
+  int pending;
+  uint32_t crc;
+};
+
+static uint32_t block_crc(const struct block_header *bh, const void *payload) {
+  return crc32c(crc32c(0, bh, sizeof(*bh)), payload, bh->len);
+}
+
+/**
+ * Check a block against the BLOCK_CHECKSUM read ahead of it, if any. Called
+ * with every block of a file in turn, checksums included.
+ *
+ * @return 1 if the block is corrupt, 0 if it matches, has no checksum or is
+ * one.
+ */
+static int block_corrupt(struct block_check *bc, const struct block_header *bh,
+                         const void *payload) {
+  int pending = bc->pending;
+
+  bc->pending = 0;
+  if (bh->type == BLOCK_CHECKSUM) {
+    if (bh->len == sizeof(struct block_checksum)) {
+      memcpy(&bc->crc, payload, sizeof(bc->crc));
+      bc->pending = 1;
+    }
+    return 0;
+  }
+  return pending && block_crc(bh, payload) != bc->crc;
+}
+
+/*
+ * Block schemas. The top byte of a block's type is the version of its
+ * layout, 0 for the layout the type started with. To change the layout of a
+ * block, add a shim from its latest version to block_shims: writers tag
+ * blocks with the latest version (block_tag()) and readers get every block
+ * brought up to it as it is read (block_upgrade()), so a new binary starts
+ * on old files as fast as ever. Older binaries skip versions they don't know
+ * like any unknown type. The stats file is upgraded by its next save; in the
+ * history, where blocks stay for years, history_migrate() rewrites them at
+ * idle priority. A shim can also retire a type: BLOCK_ROLLUPS, the rows
+ * written before segments, becomes a BLOCK_SEGMENT.
+ */
+#define BLOCK_VERSION_SHIFT 24
+#define BLOCK_TYPE(tag) ((tag) & ((1U << BLOCK_VERSION_SHIFT) - 1))
+#define BLOCK_VERSION(tag) ((tag) >> BLOCK_VERSION_SHIFT)
+
+struct block_shim {
+  uint32_t from, to; /* type and version */
+  /* the payload in the new layout, malloc()ed, or NULL if it is malformed */
+  void *(*upgrade)(const void *payload, uint32_t *len);
+};
+
+/* Shim: rows of struct rollup to a segment. */
+static void *rollups_upgrade(const void *payload, uint32_t *len) {
+  const struct rollup *r = payload;
+  struct segment s = {0};
+  uint32_t i, n = *len / sizeof(*r);
+  uint8_t *out = NULL;
+
+  if (!segment_layout(&s, n) && (out = malloc(SEGMENT_MAX_LEN(n)))) {
+    for (i = 0; i < n; i++)
+      segment_append(&s, &r[i]);
+    *len = segment_encode(&s, out);
+  }
+  free(s.body);
+  return out;
+}
+
+static const struct block_shim block_shims[] = {
+    {BLOCK_ROLLUPS, BLOCK_SEGMENT, rollups_upgrade},
+};
+
+#define N_BLOCK_SHIMS (sizeof(block_shims) / sizeof(block_shims[0]))
+
+/* The type tagged with the latest version of its layout. */
+static uint32_t block_tag(uint32_t type) {
+  uint32_t tag = type;
+  size_t i;
+
+  for (i = 0; i < N_BLOCK_SHIMS; i++) {
+    if (BLOCK_TYPE(block_shims[i].to) == type && block_shims[i].to > tag)
+      tag = block_shims[i].to;
+  }
+  return tag;
+}
+
+static const struct block_shim *block_shim(uint32_t tag) {
+  size_t i;
+
+  for (i = 0; i < N_BLOCK_SHIMS; i++) {
+    if (block_shims[i].from == tag)
+      return &block_shims[i];
+  }
+  return NULL;
+}
+
+/**
+ * Bring a block read from a stats or history file up to the latest layout of
+ * its type.
+ *
+ * @param bh The block's header, left with the plain type and new length.
+ * @param payload The payload, pointed at *buf if upgraded.
+ * @param buf Holds the upgraded payload, to be freed by the caller; what it
+ * held before is freed.
+ * @return 0 on success, or 1 if the block can't be upgraded or is of a
+ * version newer than this binary knows, and is to be skipped.
+ */
+static int block_upgrade(struct block_header *bh, void **payload,
+                         void **buf) {
+  const struct block_shim *shim;
+  uint32_t len;
+  void *p;
+
+  while ((shim = block_shim(bh->type))) {
+    len = bh->len;
+    p = shim->upgrade(*payload, &len);
+    if (!p)
+      return 1;
+    free(*buf);
+    *payload = *buf = p;
+    bh->type = shim->to;
+    bh->len = len;
+  }
+  if (bh->type != block_tag(BLOCK_TYPE(bh->type)))
+    return 1;
+  bh->type = BLOCK_TYPE(bh->type);
+  return 0;
+}
+
+/**
+ * Create a directory and any missing parents.
+ *
+ * @param path The directory; modified during the call but restored.
+ * @return 0 on success or 1 otherwise.
+ */
+static int make_dirs(char *path) {
+  char *p;
+
+  for (p = path + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    if (mkdir(path, 0755) && errno != EEXIST) {
+      *p = '/';
+      return 1;
+    }
+    *p = '/';
+  }
+  return mkdir(path, 0755) && errno != EEXIST;
+}
+
+/**
+ * Work out where the current user's stats file lives, creating its
+ * directory: $XDG_DATA_HOME/kbstats/stats or ~/.local/share/kbstats/stats.
+ *
+ * @return The path, to be freed by the caller, or NULL on error.
+ */
+static char *default_stats_path(void) {
+  const char *data = getenv("XDG_DATA_HOME");
+  struct passwd *pw = getpwuid(getuid());
+  char *dir = NULL, *path = NULL;
+
+  if (data && *data)
+    asprintf(&dir, "%s/kbstats", data);
+  else if (pw)
+    asprintf(&dir, "%s/.local/share/kbstats", pw->pw_dir);
+  if (!dir)
+    return NULL;
+
+  if (make_dirs(dir))
+    fprintf(stderr, "kbstats: can't create %s: %s\n", dir, strerror(errno));
+  else
+    asprintf(&path, "%s/stats", dir);
+  free(dir);
+
+  return path;
+}
+
+/*
+ * Archived history. Once compacted (see history_compact()), the history file
+ * starts with BLOCK_ARCHIVE blocks, each holding a run of the blocks older
+ * than ARCHIVE_AFTER_DAYS compressed with zstd, usually against a dictionary
+ * trained on them and kept in a BLOCK_ARCHIVE_DICT block ahead of the
+ * archives using it. Each archive remembers the offsets its blocks had, and
+ * history_read() hands out offsets as the file had them before compaction,
+ * so readers that keep their place across runs, like --export-sqlite, never
+ * notice. An archive is only decompressed when a read reaches it.
+ */
+#define ARCHIVE_BLOCK_RAW (1 << 20) /* bytes of blocks per archive at most */
+#define ARCHIVE_DICT_MAX (16 << 10)
+#define ARCHIVE_LEVEL 19
+#define HISTORY_SKIP 2 /* see history_read() */
+
+/* BLOCK_ARCHIVE payload; the compressed blocks follow */
+struct archive_header {
+  int64_t from, to; /* offsets of the blocks in the history file */
+  int64_t first_minute, last_minute; /* like rollup.minute */
+  uint32_t raw_len;
+  uint32_t dict_id; /* 0 if compressed without a dictionary */
+};
+
+struct archive_reader {
+#if HAVE_ZSTD
+  ZSTD_DCtx *dctx;
+  ZSTD_DDict *ddict;
+#endif
+  uint32_t dict_id;
+};
+
+static void archive_reader_free(struct archive_reader *ar) {
+#if HAVE_ZSTD
+  ZSTD_freeDCtx(ar->dctx);
+  ZSTD_freeDDict(ar->ddict);
+#endif
+}
+
+/**
+ * Decompress an archive into raw, which holds h->raw_len bytes.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int archive_decode(struct archive_reader *ar,
+                          const struct archive_header *h, uint32_t len,
+                          uint8_t *raw) {
+#if HAVE_ZSTD
+  const uint8_t *z = (const uint8_t *)(h + 1);
+  size_t n;
+
+  if (h->dict_id && h->dict_id != ar->dict_id) {
+    fprintf(stderr, "kbstats: archive dictionary %u is missing\n",
+            h->dict_id);
+    return 1;
+  }
+  if (!ar->dctx && !(ar->dctx = ZSTD_createDCtx()))
+    return 1;
+  if (h->dict_id)
+    n = ZSTD_decompress_usingDDict(ar->dctx, raw, h->raw_len, z,
+                                   len - sizeof(*h), ar->ddict);
+  else
+    n = ZSTD_decompressDCtx(ar->dctx, raw, h->raw_len, z, len - sizeof(*h));
+  if (ZSTD_isError(n) || n != h->raw_len) {
+    fprintf(stderr, "kbstats: bad archive: %s\n",
+            ZSTD_isError(n) ? ZSTD_getErrorName(n) : "short");
+    return 1;
+  }
+  return 0;
+#else
+  fprintf(stderr, "kbstats: the history is archived, which needs zstd "
+                  "(rebuild with -DHAVE_ZSTD -lzstd)\n");
+  return 1;
+#endif
+}
+
+/**
+ * Take the dictionary of the archives that follow.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int archive_dict(struct archive_reader *ar, const void *payload,
+                        uint32_t len) {
+#if HAVE_ZSTD
+  ZSTD_freeDDict(ar->ddict);
+  ar->ddict = ZSTD_createDDict(payload, len);
+  ar->dict_id = ZSTD_getDictID_fromDict(payload, len);
+  return !ar->ddict;
+#else
+  return 0; /* only needed, and complained about, once an archive is read */
+#endif
+}
+
+/**
+ * Hand the blocks of an archive at or after offset to a history_read()
+ * callback, asking it first whether the archive is wanted at all.
+ *
+ * @return 0 on success or 1 on error.
+ */
+static int archive_read(struct archive_reader *ar, const void *payload,
+                        uint32_t len, long offset,
+                        int (*block)(uint32_t type, const void *payload,
+                                     uint32_t len, void *data),
+                        void *data) {
+  const struct archive_header *h = payload;
+  struct block_header bh;
+  struct block_check bc = {0};
+  uint8_t *raw;
+  void *p, *up = NULL;
+  uint32_t pos, size;
+  int rc;
+
+  if (len < sizeof(*h))
+    return 1;
+  if (h->to <= offset)
+    return 0;
+  rc = block(BLOCK_ARCHIVE, h, sizeof(*h), data);
+  if (rc)
+    return rc != HISTORY_SKIP;
+
+  raw = malloc(h->raw_len ? h->raw_len : 1);
+  if (!raw || archive_decode(ar, h, len, raw)) {
+    free(raw);
+    return 1;
+  }
+  for (pos = 0; pos + sizeof(bh) <= h->raw_len && !rc;
+       pos += sizeof(bh) + size) {
+    memcpy(&bh, raw + pos, sizeof(bh));
+    size = bh.len;
+    if (bh.len > h->raw_len - pos - sizeof(bh)) {
+      rc = 1;
+      break;
+    }
+    p = raw + pos + sizeof(bh);
+    if (block_corrupt(&bc, &bh, p))
+      fprintf(stderr,
+              "kbstats: archived block %u at offset %lld fails its "
+              "checksum, skipped\n",
+              bh.type, (long long)(h->from + pos));
+    else if (h->from + pos >= offset && !block_upgrade(&bh, &p, &up))
+      rc = block(bh.type, p, bh.len, data);
+  }
+  free(up);
+  free(raw);
+  return rc != 0;
+}
+
+/**
+ * Read the blocks of the history file from a given offset.
+ *
+ * @param path The history file.
+ * @param offset Where the previous read stopped, 0 for the start.
+ * @param block Called with the type, payload and length of each block; a
+ * non-zero return stops the read with an error. Ahead of the blocks of an
+ * archive it is called with BLOCK_ARCHIVE and the struct archive_header, and
+ * HISTORY_SKIP skips them without decompressing the archive. Blocks that
+ * fail their checksum are reported and skipped, the others are handed out
+ * in the latest layout of their type (see block_upgrade()).
+ * @param data Passed through to block.
+ * @return The offset after the last complete block, or -1 on error.
+ */
+static long history_read(const char *path, long offset,
+                         int (*block)(uint32_t type, const void *payload,
+                                      uint32_t len, void *data),
+                         void *data) {
+  struct archive_reader ar = {0};
+  struct stats_header hdr;
+  struct block_header bh;
+  struct block_check bc = {0};
+  void *payload = NULL, *up = NULL;
+  long pos = sizeof(hdr); /* offset of the next block, as appended */
+  int err = 0;
+  FILE *f;
+
+  f = fopen(path, "rb");
+  if (!f)
+    return errno == ENOENT ? offset : -1;
+
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, STATS_MAGIC, sizeof(hdr.magic)) != 0) {
+    fprintf(stderr, "kbstats: %s is not a history file\n", path);
+    fclose(f);
+    return -1;
+  }
+  if (offset < (long)sizeof(hdr))
+    offset = sizeof(hdr);
+
+  /* a block still being appended is left for the next read */
+  while (fread(&bh, sizeof(bh), 1, f) == 1) {
+    void *p;
+
+    /* past the archives offsets only differ by what they saved */
+    if (bh.type != BLOCK_ARCHIVE && bh.type != BLOCK_ARCHIVE_DICT &&
+        pos < offset) {
+      if (fseek(f, offset - pos - (long)sizeof(bh), SEEK_CUR))
+        break;
+      pos = offset;
+      bc.pending = 0;
+      continue;
+    }
+
+    p = realloc(payload, bh.len ? bh.len : 1);
+    if (!p) {
+      err = 1;
+      break;
+    }
+    payload = p;
+    if (fread(payload, 1, bh.len, f) != bh.len)
+      break;
+    if (block_corrupt(&bc, &bh, payload)) {
+      fprintf(stderr,
+              "kbstats: %s: block %u at offset %ld fails its checksum, "
+              "skipped\n",
+              path, bh.type, ftell(f) - (long)(sizeof(bh) + bh.len));
+      pos += sizeof(bh) + bh.len;
+    } else if (bh.type == BLOCK_ARCHIVE_DICT) {
+      err = archive_dict(&ar, payload, bh.len);
+    } else if (bh.type == BLOCK_ARCHIVE) {
+      err = archive_read(&ar, payload, bh.len, offset, block, data);
+      if (!err)
+        pos = ((struct archive_header *)payload)->to;
+    } else {
+      pos += sizeof(bh) + bh.len;
+      p = payload;
+      if (!block_upgrade(&bh, &p, &up))
+        err = block(bh.type, p, bh.len, data) != 0;
+    }
+    if (err)
+      break;
+  }
+
+  archive_reader_free(&ar);
+  free(up);
+  free(payload);
+  fclose(f);
+  if (err)
+    return -1;
+  return pos > offset ? pos : offset;
+}
+
+/**
+ * Load the rollups of a history or stats file block into a segment, whether
+ * it is a segment or the minute in progress.
+ *
+ * @return 1 if loaded, 0 if the block holds no rollups, or -1 if it is
+ * malformed.
+ */
+static int segment_load_block(struct segment *s, uint32_t type,
+                              const void *payload, uint32_t len) {
+  const struct rollup *r = payload;
+  uint32_t i, n = len / sizeof(*r);
+
+  if (type == BLOCK_SEGMENT)
+    return segment_decode(s, payload, len) ? -1 : 1;
+  if (type != BLOCK_MINUTE)
+    return 0;
+  if (segment_layout(s, n))
+    return -1;
+  for (i = 0; i < n; i++)
+    segment_append(s, &r[i]);
+  return 1;
+}
+
+/*
+ * Metrics queries: a small language over the per-minute rollups, e.g.
+ *
+ *   avg(wpm), max(wpm) where hour in 9..12 and weekday != sat group by month
+ *
+ * Each segment is decoded, the columns the query uses are materialised as
+ * float arrays, every condition turns into a filter bitmap with the
+ * range_bits kernel, and the aggregates fold runs of rows with the same group
+ * key through masked_agg. Time columns are in local time.
+ *
+ * Every aggregate can be updated a row at a time: ratio(a, b) is
+ * sum(a) / sum(b), and percentiles like p90(wpm) come from a histogram with
+ * unit buckets below HIST_LINEAR and HIST_SUB buckets per power of two above,
+ * so they are exact for small counts and within 1/HIST_SUB of the value
+ * otherwise.
+ */
+#define METRICS_AGGS 8
+#define METRICS_CONDS 8
+#define HIST_LINEAR 64
+#define HIST_SUB 16
+#define HIST_BUCKETS (HIST_LINEAR + HIST_SUB * 20) /* values up to 2^26 */
+
+enum metrics_col {
+  MC_KEYSTROKES,
+  MC_CHARS,
+  MC_BACKSPACES,
+  MC_WORDS,
+  MC_WPM, /* chars / 5 */
+  MC_HOUR,
+  MC_WEEKDAY, /* 0 for Sunday */
+  MC_DAY,
+  MC_MONTH,
+  MC_YEAR,
+  MC_DATE, /* days since the epoch */
+  N_METRICS_COLS,
+};
+
+static const char *const metrics_cols[N_METRICS_COLS] = {
+    "keystrokes", "chars", "backspaces", "words", "wpm",  "hour",
+    "weekday",    "day",   "month",      "year",  "date",
+};
+
+enum metrics_func {
+  MF_COUNT,
+  MF_SUM,
+  MF_AVG,
+  MF_MIN,
+  MF_MAX,
+  MF_RATIO,
+  N_METRICS_FUNCS,
+  MF_PCT = N_METRICS_FUNCS, /* pNN, not looked up by name */
+};
+
+static const char *const metrics_funcs[N_METRICS_FUNCS] = {
+    "count", "sum", "avg", "min", "max", "ratio"};
+
+enum metrics_op { OP_EQ, OP_NE, OP_LE, OP_GE, OP_LT, OP_GT, N_METRICS_OPS };
+
+static const char *const metrics_ops[N_METRICS_OPS] = {"=",  "!=", "<=",
+                                                       ">=", "<",  ">"};
+
+static const char *const weekdays[7] = {"sun", "mon", "tue", "wed",
+                                        "thu", "fri", "sat"};
+
+struct metrics_query {
+  int naggs;
+  struct {
+    enum metrics_func func;
+    enum metrics_col col;  /* MC_KEYSTROKES for count(*) */
+    enum metrics_col col2; /* denominator of a ratio */
+    int pct;               /* percentile of a pNN */
+    char label[40];        /* as written, e.g. avg(wpm) */
+  } agg[METRICS_AGGS];
+  int nconds;
+  struct {
+    enum metrics_col col;
+    float lo, hi; /* inclusive */
+    int negate;   /* rows outside [lo, hi] match */
+  } cond[METRICS_CONDS];
+  int group; /* a time column, or -1 */
+  unsigned int cols; /* bitmask of the columns to materialise */
+  char error[96];
+};
+
+struct metrics_group {
+  int64_t key;
+  struct agg agg[METRICS_AGGS];
+  struct agg den[METRICS_AGGS]; /* of ratios */
+  uint32_t *hist[METRICS_AGGS]; /* of percentiles, HIST_BUCKETS each */
+};
+
+struct metrics_result {
+  struct metrics_group *groups;
+  size_t ngroups;
+  size_t last;   /* group of the previous run */
+  uint64_t rows; /* minutes scanned */
+};
+
+/* execution state */
+struct metrics_run {
+  const struct metrics_query *q;
+  struct metrics_result *res;
+  int closed_only; /* skip the minute in progress */
+  struct segment seg;
+  float col[N_METRICS_COLS][SEGMENT_ROWS];
+  uint64_t sel[(SEGMENT_ROWS + 63) / 64], bits[(SEGMENT_ROWS + 63) / 64];
+  int64_t hour;   /* UTC hour gmtoff was looked up for, -1 if none */
+  long gmtoff;
+  int64_t date;   /* date y, m, d are for, -1 if none */
+  int y, m, d;
+};
+
+/* The lexer: identifiers, numbers, YYYY-MM-DD dates, .. and operators. */
+struct lexer {
+  const char *s;
+  const char *p;
+  char tok[16];
+  double num; /* value of a number or date */
+};
+
+/**
+ * Days since the epoch of a proleptic Gregorian date.
+ */
+static int64_t days_from_civil(int y, int m, int d) {
+  int era, yoe, doy;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  return (int64_t)era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static void civil_from_days(int64_t z, int *y, int *m, int *d) {
+  int64_t era;
+  int doe, yoe, doy, mp;
+
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+/**
+ * Read the next token into lx->tok, and its value into lx->num for numbers
+ * and dates.
+ *
+ * @return 0 on success, 1 on a character that starts no token.
+ */
+static int lex(struct lexer *lx) {
+  const char *p = lx->p;
+  int y, m, d, n = 0;
+  size_t len;
+
+  while (isspace((unsigned char)*p))
+    p++;
+  lx->tok[0] = '\0';
+  lx->p = p;
+  if (!*p)
+    return 0;
+
+  if (sscanf(p, "%4d-%2d-%2d%n", &y, &m, &d, &n) == 3 && n == 10) {
+    len = n;
+    lx->num = days_from_civil(y, m, d);
+  } else if (isdigit((unsigned char)*p) ||
+             (*p == '.' && isdigit((unsigned char)p[1]))) {
+    char *end;
+
+    lx->num = strtod(p, &end);
+    /* 9..12 is two numbers */
+    if (end > p && end[-1] == '.' && *end == '.')
+      end--;
+    len = end - p;
+  } else if (isalpha((unsigned char)*p) || *p == '_') {
+    for (len = 0; isalnum((unsigned char)p[len]) || p[len] == '_'; len++)
+      ;
+  } else if (strchr("<>!=.", *p) && p[1] == (*p == '.' ? '.' : '=')) {
+    len = 2;
+  } else if (strchr("(),*<>=", *p)) {
+    len = 1;
+  } else {
+    return 1;
+  }
+
+  if (len >= sizeof(lx->tok))
+    len = sizeof(lx->tok) - 1;
+  memcpy(lx->tok, p, len);
+  lx->tok[len] = '\0';
+  lx->p = p + len;
+  return 0;
+}
+
+static int metrics_error(struct metrics_query *q, struct lexer *lx,
+                         const char *what) {
+  snprintf(q->error, sizeof(q->error), "%s at offset %d", what,
+           (int)(lx->p - lx->s));
+  return 1;
+}
+
+static int accept_tok(struct lexer *lx, const char *tok) {
+  if (strcasecmp(lx->tok, tok) != 0)
+    return 0;
+  lex(lx);
+  return 1;
+}
+
+static int lookup(const char *const *names, int n, const char *name) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (strcasecmp(names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Parse a literal: a number, a date or a weekday name.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int parse_value(struct lexer *lx, float *value) {
+  int wd = lookup(weekdays, 7, lx->tok);
+
+  if (wd >= 0)
+    *value = wd;
+  else if (isdigit((unsigned char)lx->tok[0]) || lx->tok[0] == '.')
+    *value = lx->num;
+  else
+    return 1;
+  return lex(lx);
+}
+
+/**
+ * Compile a metrics query.
+ *
+ * @param text The query.
+ * @param q Filled in; on error q->error says why.
+ * @return 0 on success or 1 otherwise.
+ */
+static int metrics_parse(const char *text, struct metrics_query *q) {
+  struct lexer lx = {.s = text, .p = text};
+  int c, c2, f, n, pct, star;
+  char fname[16];
+
+  memset(q, 0, sizeof(*q));
+  q->group = -1;
+  if (lex(&lx))
+    return metrics_error(q, &lx, "unexpected character");
+
+  do {
+    if (q->naggs == METRICS_AGGS)
+      return metrics_error(q, &lx, "too many aggregates");
+    f = lookup(metrics_funcs, N_METRICS_FUNCS, lx.tok);
+    pct = 0;
+    if (f < 0 && sscanf(lx.tok, "p%2d%n", &pct, &n) == 1 && !lx.tok[n] &&
+        pct > 0 && pct < 100)
+      f = MF_PCT;
+    if (f < 0)
+      return metrics_error(q, &lx, "expected an aggregate like avg or p90");
+    snprintf(fname, sizeof(fname), "%s",
+             f == MF_PCT ? lx.tok : metrics_funcs[f]);
+    lex(&lx);
+    if (!accept_tok(&lx, "("))
+      return metrics_error(q, &lx, "expected (");
+    star = f == MF_COUNT && accept_tok(&lx, "*");
+    c = c2 = MC_KEYSTROKES;
+    if (!star) {
+      c = lookup(metrics_cols, N_METRICS_COLS, lx.tok);
+      if (c < 0)
+        return metrics_error(q, &lx, "unknown column");
+      lex(&lx);
+    }
+    if (f == MF_RATIO) {
+      if (!accept_tok(&lx, ",") ||
+          (c2 = lookup(metrics_cols, N_METRICS_COLS, lx.tok)) < 0)
+        return metrics_error(q, &lx, "expected , and a column");
+      lex(&lx);
+    }
+    if (!accept_tok(&lx, ")"))
+      return metrics_error(q, &lx, "expected )");
+    snprintf(q->agg[q->naggs].label, sizeof(q->agg[q->naggs].label),
+             f == MF_RATIO ? "%s(%s,%s)" : "%s(%s)", fname,
+             star ? "*" : metrics_cols[c], metrics_cols[c2]);
+    q->agg[q->naggs].func = f;
+    q->agg[q->naggs].col = c;
+    q->agg[q->naggs].col2 = c2;
+    q->agg[q->naggs++].pct = pct;
+    q->cols |= 1u << c | 1u << c2;
+  } while (accept_tok(&lx, ","));
+
+  if (accept_tok(&lx, "where")) {
+    do {
+      float lo, hi;
+      int negate = 0;
+
+      if (q->nconds == METRICS_CONDS)
+        return metrics_error(q, &lx, "too many conditions");
+      c = lookup(metrics_cols, N_METRICS_COLS, lx.tok);
+      if (c < 0)
+        return metrics_error(q, &lx, "unknown column");
+      lex(&lx);
+
+      if (accept_tok(&lx, "in")) {
+        if (parse_value(&lx, &lo) || !accept_tok(&lx, "..") ||
+            parse_value(&lx, &hi))
+          return metrics_error(q, &lx, "expected a range like 9..12");
+      } else {
+        int op = lookup(metrics_ops, N_METRICS_OPS, lx.tok);
+
+        if (op < 0)
+          return metrics_error(q, &lx, "expected in or an operator");
+        lex(&lx);
+        if (parse_value(&lx, &lo))
+          return metrics_error(q, &lx, "expected a value");
+        /* every condition is an inclusive range, or outside one */
+        hi = lo;
+        if (op == OP_LE || op == OP_GT)
+          lo = -INFINITY;
+        if (op == OP_GE || op == OP_LT)
+          hi = INFINITY;
+        negate = op == OP_NE || op == OP_LT || op == OP_GT;
+      }
+      q->cond[q->nconds].col = c;
+      q->cond[q->nconds].lo = lo;
+      q->cond[q->nconds].hi = hi;
+      q->cond[q->nconds++].negate = negate;
+      q->cols |= 1u << c;
+    } while (accept_tok(&lx, "and"));
+  }
+
+  if (accept_tok(&lx, "group")) {
+    if (!accept_tok(&lx, "by"))
+      return metrics_error(q, &lx, "expected by");
+    q->group = lookup(metrics_cols, N_METRICS_COLS, lx.tok);
+    if (q->group < MC_HOUR)
+      return metrics_error(q, &lx, "can only group by a time column");
+    lex(&lx);
+    q->cols |= 1u << q->group;
+  }
+
+  if (lx.tok[0] || *lx.p)
+    return metrics_error(q, &lx, "unexpected text");
+  return 0;
+}
+
+static struct metrics_group *metrics_group(struct metrics_result *r,
+                                           int64_t key) {
+  struct metrics_group *g;
+  size_t i;
+  int k;
+
+  if (r->ngroups && r->groups[r->last].key == key)
+    return &r->groups[r->last];
+  for (i = 0; i < r->ngroups; i++) {
+    if (r->groups[i].key == key)
+      return &r->groups[r->last = i];
+  }
+
+  /* grow by doubling */
+  if (!(r->ngroups & (r->ngroups - 1))) {
+    g = realloc(r->groups, (r->ngroups ? 2 * r->ngroups : 1) * sizeof(*g));
+    if (!g) {
+      perror("kbstats: realloc");
+      return NULL;
+    }
+    r->groups = g;
+  }
+  g = &r->groups[r->last = r->ngroups++];
+  g->key = key;
+  for (k = 0; k < METRICS_AGGS; k++) {
+    g->agg[k] = g->den[k] = (struct agg){0, 0, INFINITY, -INFINITY};
+    g->hist[k] = NULL;
+  }
+  return g;
+}
+
+static int hist_bucket(float v) {
+  uint32_t x = v < 1 ? 0 : v < 1 << 26 ? (uint32_t)v : (1 << 26) - 1;
+  int e;
+
+  if (x < HIST_LINEAR)
+    return x;
+  e = 31 - __builtin_clz(x);
+  return HIST_LINEAR + (e - 6) * HIST_SUB + (x >> (e - 4) & (HIST_SUB - 1));
+}
+
+/* The lowest value of a bucket. */
+static float hist_value(int b) {
+  if (b < HIST_LINEAR)
+    return b;
+  b -= HIST_LINEAR;
+  return (float)((HIST_SUB + b % HIST_SUB) << (b / HIST_SUB + 2));
+}
+
+/**
+ * Count the selected rows of [lo, hi) into the histogram of aggregate k.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int metrics_hist(struct metrics_group *g, int k, const float *v,
+                        const uint64_t *sel, uint32_t lo, uint32_t hi) {
+  uint32_t i;
+
+  if (!g->hist[k] && !(g->hist[k] = calloc(HIST_BUCKETS, sizeof(uint32_t)))) {
+    perror("kbstats: calloc");
+    return 1;
+  }
+  for (i = lo; i < hi; i++) {
+    if (sel[i / 64] >> i % 64 & 1)
+      g->hist[k][hist_bucket(v[i])]++;
+  }
+  return 0;
+}
+
+/**
+ * Materialise the time columns of rows [off, off + n) of the segment.
+ */
+static void metrics_time(struct metrics_run *r, uint32_t off, uint32_t n) {
+  const int64_t *minute = r->seg.minute + off;
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    int64_t local, date;
+
+    /* offsets change on the hour at the latest */
+    if (minute[i] / 3600 != r->hour) {
+      time_t t = minute[i];
+      struct tm tm;
+
+      localtime_r(&t, &tm);
+      r->gmtoff = tm.tm_gmtoff;
+      r->hour = minute[i] / 3600;
+    }
+    local = minute[i] + r->gmtoff;
+    date = (local - (local < 0 ? 86399 : 0)) / 86400;
+    if (date != r->date) {
+      civil_from_days(date, &r->y, &r->m, &r->d);
+      r->date = date;
+    }
+    r->col[MC_HOUR][i] = (local - date * 86400) / 3600;
+    r->col[MC_WEEKDAY][i] = ((date + 4) % 7 + 7) % 7;
+    r->col[MC_DAY][i] = r->d;
+    r->col[MC_MONTH][i] = r->m;
+    r->col[MC_YEAR][i] = r->y;
+    r->col[MC_DATE][i] = date;
+  }
+}
+
+/**
+ * Run the query over rows [off, off + n) of the segment, n at most
+ * SEGMENT_ROWS.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int metrics_rows(struct metrics_run *r, uint32_t off, uint32_t n) {
+  const struct metrics_query *q = r->q;
+  const struct segment *s = &r->seg;
+  uint32_t i, j, words = (n + 63) / 64;
+  uint64_t any = 0;
+  int c, k;
+
+  for (c = MC_KEYSTROKES; c <= MC_WORDS; c++) {
+    if (q->cols & 1u << c) {
+      for (i = 0; i < n; i++)
+        r->col[c][i] = s->count[c - MC_KEYSTROKES][off + i];
+    }
+  }
+  if (q->cols & 1u << MC_WPM) {
+    for (i = 0; i < n; i++)
+      r->col[MC_WPM][i] = s->count[COUNT_CHARS][off + i] / 5.0f;
+  }
+  if (q->cols >> MC_HOUR)
+    metrics_time(r, off, n);
+
+  memset(r->sel, 0xff, words * sizeof(*r->sel));
+  if (n % 64)
+    r->sel[words - 1] = (1ULL << n % 64) - 1;
+  for (k = 0; k < q->nconds; k++) {
+    simd->range_bits(r->col[q->cond[k].col], n, q->cond[k].lo, q->cond[k].hi,
+                     r->bits);
+    for (i = 0; i < words; i++)
+      r->sel[i] &= q->cond[k].negate ? ~r->bits[i] : r->bits[i];
+  }
+  for (i = 0; i < words; i++)
+    any |= r->sel[i];
+  r->res->rows += n;
+  if (!any)
+    return 0;
+
+  /* fold each run of rows with the same group key */
+  for (i = 0; i < n; i = j) {
+    const float *key = q->group >= 0 ? r->col[q->group] : NULL;
+    struct metrics_group *g;
+
+    for (j = i + 1; j < n && (!key || key[j] == key[i]); j++)
+      ;
+    g = metrics_group(r->res, key ? key[i] : 0);
+    if (!g)
+      return 1;
+    for (k = 0; k < q->naggs; k++) {
+      const float *v = r->col[q->agg[k].col];
+
+      simd->masked_agg(v, r->sel, i, j, &g->agg[k]);
+      if (q->agg[k].func == MF_RATIO)
+        simd->masked_agg(r->col[q->agg[k].col2], r->sel, i, j, &g->den[k]);
+      else if (q->agg[k].func == MF_PCT &&
+               metrics_hist(g, k, v, r->sel, i, j))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Whether the minutes of an archive can pass the date conditions of a query.
+ * Dates are local, so the archive's are widened by a day either way.
+ */
+static int metrics_wants(const struct metrics_query *q,
+                         const struct archive_header *h) {
+  int64_t first = (h->first_minute - (h->first_minute < 0 ? 86399 : 0)) / 86400;
+  int64_t last = (h->last_minute - (h->last_minute < 0 ? 86399 : 0)) / 86400;
+  int i;
+
+  for (i = 0; i < q->nconds; i++) {
+    if (q->cond[i].col == MC_DATE && !q->cond[i].negate &&
+        (q->cond[i].hi < first - 1 || q->cond[i].lo > last + 1))
+      return 0;
+  }
+  return 1;
+}
+
+static int metrics_block(uint32_t type, const void *payload, uint32_t len,
+                         void *data) {
+  struct metrics_run *r = data;
+  uint32_t off, n;
+  int loaded;
+
+  if (type == BLOCK_ARCHIVE)
+    return metrics_wants(r->q, payload) ? 0 : HISTORY_SKIP;
+  if (type == BLOCK_MINUTE && r->closed_only)
+    return 0;
+  loaded = segment_load_block(&r->seg, type, payload, len);
+  if (loaded <= 0)
+    return loaded < 0;
+  for (off = 0; off < r->seg.rows; off += n) {
+    n = r->seg.rows - off < SEGMENT_ROWS ? r->seg.rows - off : SEGMENT_ROWS;
+    if (metrics_rows(r, off, n))
+      return 1;
+  }
+  return 0;
+}
+
+static struct metrics_run *metrics_alloc(const struct metrics_query *q,
+                                         struct metrics_result *res) {
+  struct metrics_run *r = calloc(1, sizeof(*r));
+
+  if (!r) {
+    perror("kbstats: calloc");
+    return NULL;
+  }
+  r->q = q;
+  r->res = res;
+  r->hour = r->date = -1;
+  return r;
+}
+
+/**
+ * Free the groups of a result, leaving it empty.
+ */
+static void metrics_clear(struct metrics_result *res) {
+  size_t i;
+  int k;
+
+  for (i = 0; i < res->ngroups; i++) {
+    for (k = 0; k < METRICS_AGGS; k++)
+      free(res->groups[i].hist[k]);
+  }
+  free(res->groups);
+  memset(res, 0, sizeof(*res));
+}
+
+static void metrics_free(struct metrics_result *res) {
+  if (!res)
+    return;
+  metrics_clear(res);
+  free(res);
+}
+
+static int cmp_group(const void *a, const void *b) {
+  const struct metrics_group *x = a, *y = b;
+
+  return (x->key > y->key) - (x->key < y->key);
+}
+
+/**
+ * Run a compiled query over the sealed segments in the history file and
+ * today's in the stats file.
+ *
+ * @param closed_only Leave out the minute in progress.
+ * @return The result, to be freed with metrics_free(), or NULL on error.
+ */
+static struct metrics_result *metrics_run(const struct metrics_query *q,
+                                          const char *stats_path,
+                                          const char *history_path,
+                                          int closed_only) {
+  struct metrics_result *res = calloc(1, sizeof(*res));
+  struct metrics_run *r = res ? metrics_alloc(q, res) : NULL;
+  int err;
+
+  if (!r) {
+    free(res);
+    return NULL;
+  }
+  r->closed_only = closed_only;
+  err = history_read(history_path, 0, metrics_block, r) < 0 ||
+        history_read(stats_path, 0, metrics_block, r) < 0;
+  free(r->seg.body);
+  free(r);
+  if (err) {
+    metrics_free(res);
+    return NULL;
+  }
+  qsort(res->groups, res->ngroups, sizeof(*res->groups), cmp_group);
+
+  return res;
+}
+
+/**
+ * The value of aggregate k of a group, NAN if it has no rows.
+ */
+static double metrics_value(const struct metrics_query *q,
+                            const struct metrics_group *g, int k) {
+  const struct agg *a = &g->agg[k];
+  uint64_t rank, seen = 0;
+  int b;
+
+  if (q->agg[k].func == MF_COUNT)
+    return a->count;
+  if (q->agg[k].func == MF_SUM)
+    return a->sum;
+  if (!a->count)
+    return NAN;
+  if (q->agg[k].func == MF_AVG)
+    return a->sum / a->count;
+  if (q->agg[k].func == MF_RATIO)
+    return g->den[k].sum ? a->sum / g->den[k].sum : NAN;
+  if (q->agg[k].func == MF_PCT) {
+    /* nearest rank */
+    rank = (a->count * q->agg[k].pct + 99) / 100;
+    for (b = 0; b < HIST_BUCKETS - 1; b++) {
+      seen += g->hist[k][b];
+      if (seen >= rank)
+        break;
+    }
+    return hist_value(b);
+  }
+  return q->agg[k].func == MF_MIN ? a->min : a->max;
+}
+
+/**
+ * Print the result of a query as a table, or as JSON:
+ * {"columns": [...], "rows": [[...], ...], "minutes": rows scanned}.
+ */
+static void metrics_print(const struct metrics_query *q,
+                          const struct metrics_result *r, FILE *f, int json) {
+  int first = 1, k, w[METRICS_AGGS];
+  size_t i;
+
+  /* table columns are at least 16 wide, and wide enough for the label */
+  for (k = 0; k < q->naggs; k++) {
+    w[k] = strlen(q->agg[k].label) + 2;
+    w[k] = json ? 0 : w[k] < 16 ? 16 : w[k];
+  }
+
+  if (json)
+    fputs("{\"columns\":[", f);
+  if (q->group >= 0)
+    fprintf(f, json ? "\"%s\"," : "%-12s", metrics_cols[q->group]);
+  for (k = 0; k < q->naggs; k++)
+    fprintf(f, json ? "%s\"%*s\"" : "%s%*s", json && k ? "," : "", w[k],
+            q->agg[k].label);
+  fputs(json ? "],\"rows\":[" : "\n", f);
+
+  for (i = 0; i < r->ngroups; i++) {
+    const struct metrics_group *g = &r->groups[i];
+    int y, m, d;
+
+    if (!g->agg[0].count)
+      continue; /* no row passed the filter */
+    if (json)
+      fputs(first ? "[" : ",[", f);
+    first = 0;
+
+    if (q->group == MC_WEEKDAY) {
+      fprintf(f, json ? "\"%s\"," : "%-12s", weekdays[g->key]);
+    } else if (q->group == MC_DATE) {
+      civil_from_days(g->key, &y, &m, &d);
+      fprintf(f, json ? "\"%04d-%02d-%02d\"," : "%04d-%02d-%02d  ", y, m, d);
+    } else if (q->group >= 0) {
+      fprintf(f, json ? "%lld," : "%-12lld", (long long)g->key);
+    }
+
+    for (k = 0; k < q->naggs; k++) {
+      const char *sep = json && k ? "," : "";
+      double v = metrics_value(q, g, k);
+
+      if (isnan(v))
+        fprintf(f, "%s%*s", sep, w[k], json ? "null" : "-");
+      else if (fabs(v) < 1e15 && v == (double)(int64_t)v)
+        fprintf(f, "%s%*.0f", sep, w[k], v);
+      else
+        fprintf(f, "%s%*.2f", sep, w[k], v);
+    }
+    fputs(json ? "]" : "\n", f);
+  }
+
+  if (json)
+    fprintf(f, "],\"minutes\":%llu}\n", (unsigned long long)r->rows);
+}
+
+/*
+ * Views: metrics queries named in the config file, e.g.
+ *
+ *   view daily_p90 = p90(wpm) group by date
+ *   view fast_errors = ratio(backspaces, keystrokes) where wpm > 80
+ *
+ * kept up to date a minute at a time as the rollups close each minute,
+ * rather than run over the whole history when asked for. Any query the
+ * parser accepts can be maintained this way, since every aggregate has state
+ * that a row at a time updates. Their groups are saved in the stats file
+ * with the query they were computed for; a new view, or one whose query has
+ * changed, is computed from the history first.
+ */
+#define MAX_VIEWS 16
+#define VIEW_NAME_MAX 32
+#define VIEW_QUERY_MAX 256
+
+struct view {
+  char name[VIEW_NAME_MAX];
+  char text[VIEW_QUERY_MAX];
+  struct metrics_query q;
+  struct metrics_result res;
+  int loaded; /* res restored from the stats file */
+};
+
+struct views {
+  int n;
+  struct view view[MAX_VIEWS];
+  struct metrics_run *run; /* over one closed minute */
+};
+
+/*
+ * BLOCK_VIEW payload. Each of the ngroups groups follows as its key, naggs
+ * aggregates and naggs denominators, then the buckets of each percentile as
+ * varints.
+ */
+struct view_header {
+  char name[VIEW_NAME_MAX];
+  char text[VIEW_QUERY_MAX];
+  uint64_t rows;
+  uint32_t ngroups;
+  uint32_t naggs;
+};
+
+/**
+ * Register a view.
+ *
+ * @return NULL on success, or why the view was rejected.
+ */
+static const char *views_add(struct capture *cap, const char *name,
+                             const char *text) {
+  struct views *vs = cap->views;
+  struct view *v;
+  int i;
+
+  if (!*name || strlen(name) >= VIEW_NAME_MAX)
+    return "bad view name";
+  if (strlen(text) >= VIEW_QUERY_MAX)
+    return "query too long";
+  if (!vs) {
+    vs = cap->views = calloc(1, sizeof(*vs));
+    if (!vs || !(vs->run = metrics_alloc(NULL, NULL)) ||
+        segment_layout(&vs->run->seg, 1))
+      return strerror(errno);
+  }
+  for (i = 0; i < vs->n; i++) {
+    if (strcmp(vs->view[i].name, name) == 0)
+      return "view already defined";
+  }
+  if (vs->n == MAX_VIEWS)
+    return "too many views";
+
+  v = &vs->view[vs->n];
+  if (metrics_parse(text, &v->q))
+    return v->q.error;
+  snprintf(v->name, sizeof(v->name), "%s", name);
+  snprintf(v->text, sizeof(v->text), "%s", text);
+  vs->n++;
+  return NULL;
+}
+
+/**
+ * Fold a minute that has just closed into every view.
+ */
+static void views_minute(struct views *vs, const struct rollup *row) {
+  struct metrics_run *r = vs->run;
+  int i;
+
+  r->seg.rows = 0;
+  segment_append(&r->seg, row);
+  for (i = 0; i < vs->n; i++) {
+    r->q = &vs->view[i].q;
+    r->res = &vs->view[i].res;
+    metrics_rows(r, 0, 1);
+  }
+}
+
+/**
+ * Encode a view for the stats file.
+ *
+ * @param len Set to the encoded length.
+ * @return The payload, to be freed by the caller, or NULL on error.
+ */
+static uint8_t *view_encode(const struct view *v, size_t *len) {
+  const struct metrics_query *q = &v->q;
+  struct view_header h = {.rows = v->res.rows, .ngroups = v->res.ngroups,
+                          .naggs = q->naggs};
+  size_t i, group_max = sizeof(int64_t) + 2 * q->naggs * sizeof(struct agg);
+  uint8_t *out, *p;
+  int k, b;
+
+  for (k = 0; k < q->naggs; k++)
+    group_max += q->agg[k].func == MF_PCT ? HIST_BUCKETS * 5 : 0;
+  out = p = malloc(sizeof(h) + v->res.ngroups * group_max);
+  if (!out) {
+    perror("kbstats: malloc");
+    return NULL;
+  }
+  memcpy(h.name, v->name, sizeof(h.name));
+  memcpy(h.text, v->text, sizeof(h.text));
+  memcpy(p, &h, sizeof(h));
+  p += sizeof(h);
+
+  for (i = 0; i < v->res.ngroups; i++) {
+    const struct metrics_group *g = &v->res.groups[i];
+
+    memcpy(p, &g->key, sizeof(g->key));
+    p += sizeof(g->key);
+    memcpy(p, g->agg, q->naggs * sizeof(*g->agg));
+    p += q->naggs * sizeof(*g->agg);
+    memcpy(p, g->den, q->naggs * sizeof(*g->den));
+    p += q->naggs * sizeof(*g->den);
+    for (k = 0; k < q->naggs; k++) {
+      for (b = 0; q->agg[k].func == MF_PCT && b < HIST_BUCKETS; b++)
+        p = put_varint(p, g->hist[k] ? g->hist[k][b] : 0);
+    }
+  }
+
+  *len = p - out;
+  return out;
+}
+
+/**
+ * Restore a view saved in the stats file, if it is still registered with the
+ * same query.
+ *
+ * @return 0 on success or 1 if the payload is malformed.
+ */
+static int view_decode(struct views *vs, const void *payload, uint32_t len) {
+  const uint8_t *p = payload, *end = p + len;
+  struct view_header h;
+  struct metrics_group *g;
+  struct view *v = NULL;
+  uint64_t count;
+  uint32_t i;
+  int k, b;
+
+  if (len < sizeof(h))
+    return 1;
+  memcpy(&h, p, sizeof(h));
+  p += sizeof(h);
+  for (i = 0; vs && i < (uint32_t)vs->n; i++) {
+    if (strncmp(vs->view[i].name, h.name, sizeof(h.name)) == 0 &&
+        strncmp(vs->view[i].text, h.text, sizeof(h.text)) == 0)
+      v = &vs->view[i];
+  }
+  if (!v || v->loaded)
+    return 0;
+  if (h.naggs != (uint32_t)v->q.naggs)
+    return 1;
+
+  metrics_clear(&v->res);
+  v->res.rows = h.rows;
+  for (i = 0; i < h.ngroups; i++) {
+    int64_t key;
+
+    if ((size_t)(end - p) < sizeof(key) + 2 * h.naggs * sizeof(struct agg))
+      goto bad;
+    memcpy(&key, p, sizeof(key));
+    p += sizeof(key);
+    g = metrics_group(&v->res, key);
+    if (!g)
+      goto bad;
+    memcpy(g->agg, p, h.naggs * sizeof(*g->agg));
+    p += h.naggs * sizeof(*g->agg);
+    memcpy(g->den, p, h.naggs * sizeof(*g->den));
+    p += h.naggs * sizeof(*g->den);
+    for (k = 0; k < v->q.naggs; k++) {
+      if (v->q.agg[k].func != MF_PCT)
+        continue;
+      g->hist[k] = calloc(HIST_BUCKETS, sizeof(uint32_t));
+      if (!g->hist[k])
+        goto bad;
+      for (b = 0; b < HIST_BUCKETS; b++) {
+        if (get_varint(&p, end, &count))
+          goto bad;
+        g->hist[k][b] = count;
+      }
+    }
+  }
+  v->loaded = 1;
+  return 0;
+
+bad:
+  metrics_clear(&v->res);
+  return 1;
+}
+
+/**
+ * Compute the views that were not in the stats file from the closed minutes
+ * of the history and stats files.
+ */
+static void views_fill(struct capture *cap) {
+  struct metrics_result *res;
+  int i;
+
+  for (i = 0; cap->views && i < cap->views->n; i++) {
+    struct view *v = &cap->views->view[i];
+
+    if (v->loaded)
+      continue;
+    res = metrics_run(&v->q, cap->stats_path, cap->history_path, 1);
+    if (!res) {
+      fprintf(stderr, "kbstats: can't compute view %s\n", v->name);
+      continue;
+    }
+    metrics_clear(&v->res);
+    v->res = *res;
+    free(res);
+    v->loaded = 1;
+  }
+}
+
+/*
+ * Device groups. A split or composite keyboard shows up as several event
+ * devices, and the reader puts their batches in the ring in the order it
+ * reads them, so a key on one half can come after a later key on the other.
+ * The config file can name the devices of such a keyboard as a group,
+ *
+ *   group NAME = MATCH, MATCH, ...
+ *
+ * each MATCH a part of a device identity (see device_identity()), and the
+ * aggregator then merges the group's events by kernel timestamp before any
+ * stage sees them, so that bigrams, flight times and words run across the
+ * halves as on one keyboard. An event waits in the group's heap until one
+ * MERGE_WINDOW_US later has come from the group, or until it has waited that
+ * long, which bounds the delay the merge adds; one that comes too late to be
+ * put in order is passed on at once.
+ */
+#define MAX_GROUPS 4
+#define GROUP_MATCHES 8
+#define MERGE_WINDOW_US 20000
+#define MERGE_SLOTS 256 /* more waiting than this go on early */
+
+struct held {
+  struct key_record rec;
+  uint64_t since_ns; /* when it was put in the heap */
+};
+
+struct device_group {
+  char name[VIEW_NAME_MAX];
+  char match[GROUP_MATCHES][DEVICE_ID_MAX];
+  int nmatch;
+  struct held heap[MERGE_SLOTS]; /* by rec.time_us, earliest first */
+  int n;
+  uint64_t newest_us; /* latest event of the group */
+  uint64_t passed_us; /* latest event passed on */
+};
+
+struct device_groups {
+  int n;
+  struct device_group *group[MAX_GROUPS];
+  /* the group of each device in capture.fds, once looked up */
+  struct device_group *dev[MAX_DEVICES];
+  uint8_t looked_up[MAX_DEVICES];
+};
+
+/**
+ * Register a device group.
+ *
+ * @param list Comma-separated parts of device identities.
+ * @return NULL on success, or why the group was rejected.
+ */
+static const char *groups_add(struct capture *cap, const char *name,
+                              char *list) {
+  struct device_groups *gs = cap->groups;
+  struct device_group *g;
+  char *m, *end;
+  int i;
+
+  if (!*name || strlen(name) >= VIEW_NAME_MAX)
+    return "bad group name";
+  if (!gs && !(gs = cap->groups = calloc(1, sizeof(*gs))))
+    return strerror(errno);
+  for (i = 0; i < gs->n; i++) {
+    if (strcmp(gs->group[i]->name, name) == 0)
+      return "group already defined";
+  }
+  if (gs->n == MAX_GROUPS)
+    return "too many groups";
+  g = calloc(1, sizeof(*g));
+  if (!g)
+    return strerror(errno);
+
+  snprintf(g->name, sizeof(g->name), "%s", name);
+  for (m = strtok(list, ","); m; m = strtok(NULL, ",")) {
+    while (isspace((unsigned char)*m))
+      m++;
+    for (end = m + strlen(m); end > m && isspace((unsigned char)end[-1]);)
+      *--end = '\0';
+    if (!*m)
+      continue;
+    if (g->nmatch == GROUP_MATCHES || strlen(m) >= DEVICE_ID_MAX) {
+      free(g);
+      return "too many or too long devices";
+    }
+    snprintf(g->match[g->nmatch++], DEVICE_ID_MAX, "%s", m);
+  }
+  if (g->nmatch < 2) {
+    free(g);
+    return "a group needs at least two devices";
+  }
+  gs->group[gs->n++] = g;
+  return NULL;
+}
+
+/**
+ * The group a device belongs to, by its identity.
+ *
+ * @return The group, or NULL if it is in none.
+ */
+static struct device_group *group_of(struct device_groups *gs, int dev,
+                                     const char *id) {
+  int i, k;
+
+  if (!gs || dev >= MAX_DEVICES)
+    return NULL;
+  if (gs->looked_up[dev])
+    return gs->dev[dev];
+  gs->looked_up[dev] = 1;
+  for (i = 0; i < gs->n; i++) {
+    for (k = 0; k < gs->group[i]->nmatch; k++) {
+      if (strstr(id, gs->group[i]->match[k]))
+        return gs->dev[dev] = gs->group[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Work out where the current user's config file lives:
+ * $XDG_CONFIG_HOME/kbstats/config or ~/.config/kbstats/config.
+ *
+ * @return The path, to be freed by the caller, or NULL on error.
+ */
+static char *default_config_path(void) {
+  const char *config = getenv("XDG_CONFIG_HOME");
+  struct passwd *pw = getpwuid(getuid());
+  char *path = NULL;
+
+  if (config && *config)
+    asprintf(&path, "%s/kbstats/config", config);
+  else if (pw)
+    asprintf(&path, "%s/.config/kbstats/config", pw->pw_dir);
+  return path;
+}
+
+/**
+ * Read the config file. Each line is a setting, blank, or a comment starting
+ * with #. The settings are
+ *
+ *   view NAME = QUERY
+ *   group NAME = MATCH, MATCH, ...
+ *   memory_budget = SIZE
+ *
+ * where a --memory-budget option wins over memory_budget. Bad lines are
+ * reported and skipped. A missing file is not an error.
+ *
+ * @return 0 on success or 1 if the file can't be read.
+ */
+static int config_load(const char *path, struct capture *cap) {
+  char line[VIEW_NAME_MAX + VIEW_QUERY_MAX + 16];
+  const char *err;
+  int lineno = 0;
+  FILE *f;
+
+  f = fopen(path, "r");
+  if (!f) {
+    if (errno == ENOENT)
+      return 0;
+    fprintf(stderr, "kbstats: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line, *name, *end;
+    uint64_t budget;
+
+    lineno++;
+    line[strcspn(line, "#\n")] = '\0';
+    while (isspace((unsigned char)*p))
+      p++;
+    if (!*p)
+      continue;
+
+    err = "expected view NAME = QUERY, group NAME = DEVICES or "
+          "memory_budget = SIZE";
+    if (strncmp(p, "memory_budget", 13) == 0) {
+      for (p += 13; isspace((unsigned char)*p); p++)
+        ;
+      if (*p == '=' && parse_size(p + 1, &budget) == 0) {
+        if (!memory_budget)
+          cap->memory_budget = budget;
+        err = NULL;
+      }
+    } else if (strncmp(p, "view", 4) == 0 && isspace((unsigned char)p[4])) {
+      for (p += 4; isspace((unsigned char)*p); p++)
+        ;
+      for (name = p; isalnum((unsigned char)*p) || *p == '_'; p++)
+        ;
+      for (end = p; isspace((unsigned char)*p); p++)
+        ;
+      if (*p == '=') {
+        *end = '\0';
+        for (p++; isspace((unsigned char)*p); p++)
+          ;
+        for (end = p + strlen(p); end > p && isspace((unsigned char)end[-1]);)
+          *--end = '\0';
+        err = views_add(cap, name, p);
+      }
+    } else if (strncmp(p, "group", 5) == 0 && isspace((unsigned char)p[5])) {
+      for (p += 5; isspace((unsigned char)*p); p++)
+        ;
+      for (name = p; isalnum((unsigned char)*p) || *p == '_'; p++)
+        ;
+      for (end = p; isspace((unsigned char)*p); p++)
+        ;
+      if (*p == '=') {
+        *end = '\0';
+        err = groups_add(cap, name, p + 1);
+      }
+    }
+    if (err)
+      fprintf(stderr, "kbstats: %s:%d: %s\n", path, lineno, err);
+  }
+
+  fclose(f);
+  return 0;
+}
+
+/**
+ * Pack the sealed segments and closed sessions, each behind its checksum, to
+ * be appended to the history file as they are, after the packed blocks that
+ * are still to be appended. They are let go of once packed.
+ *
+ * @param blocks The packed blocks not appended yet, NULL if none; grown.
+ * @param len Their length, updated.
+ * @return 0 on success or 1 on error, when they are kept for the next flush.
+ */
+static int history_pack(struct rollups *r, uint8_t **blocks, size_t *len) {
+  struct block_header bh[PENDING_SEGMENTS + 1];
+  struct block_header ckh = {BLOCK_CHECKSUM, sizeof(struct block_checksum)};
+  struct block_checksum ck;
+  void *data[PENDING_SEGMENTS + 1];
+  uint8_t *out, *p;
+  size_t add = 0;
+  int i, nb = 0;
+
+  for (i = 0; i < r->nsealed; i++) {
+    bh[nb] = (struct block_header){block_tag(BLOCK_SEGMENT), r->sealed[i].len};
+    data[nb++] = r->sealed[i].data;
+  }
+  if (r->ndone) {
+    bh[nb] = (struct block_header){block_tag(BLOCK_SESSIONS),
+                                   r->ndone * sizeof(struct session)};
+    data[nb++] = r->done;
+  }
+  if (!nb)
+    return 0;
+  for (i = 0; i < nb; i++)
+    add += sizeof(ckh) + sizeof(ck) + sizeof(bh[i]) + bh[i].len;
+  out = realloc(*blocks, *len + add);
+  if (!out) {
+    perror("kbstats: history");
+    return 1;
+  }
+
+  for (i = 0, p = out + *len; i < nb; i++) {
+    ck.crc = block_crc(&bh[i], data[i]);
+    memcpy(p, &ckh, sizeof(ckh));
+    memcpy(p += sizeof(ckh), &ck, sizeof(ck));
+    memcpy(p += sizeof(ck), &bh[i], sizeof(bh[i]));
+    memcpy(p += sizeof(bh[i]), data[i], bh[i].len);
+    p += bh[i].len;
+  }
+  for (i = 0; i < r->nsealed; i++)
+    free(r->sealed[i].data);
+  r->nsealed = r->ndone = 0;
+  *blocks = out;
+  *len += add;
+  return 0;
+}
+
+/* held while appending to the history file, or swapping it for a copy */
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Append packed blocks to the history file. The history file has the same
+ * header and block framing as the stats file but is only ever appended to,
+ * so readers like --export-sqlite can follow it by offset. An append that
+ * fails is cut off again, so the same blocks can be appended whole later
+ * without being framed wrong or counted twice.
+ *
+ * @param sync Whether to wait for them to reach the disk.
+ * @return 0 on success or 1 otherwise, when the file is as it was.
+ */
+static int history_write(const char *path, const uint8_t *blocks, size_t len,
+                         int sync) {
+  struct stats_header hdr = {.magic = STATS_MAGIC, .version = STATS_VERSION};
+  struct iovec iov[2];
+  ssize_t want = len, done = -1;
+  off_t end;
+  int n = 0, fd, err;
+
+  pthread_mutex_lock(&history_lock);
+  fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    pthread_mutex_unlock(&history_lock);
+    perror("kbstats: history");
+    return 1;
+  }
+
+  end = lseek(fd, 0, SEEK_END);
+  if (end == 0) {
+    iov[n++] = (struct iovec){&hdr, sizeof(hdr)};
+    want += sizeof(hdr);
+  }
+  iov[n++] = (struct iovec){(void *)blocks, len};
+
+  err = end < 0 || (done = writev(fd, iov, n)) != want ||
+        (sync && fdatasync(fd));
+  if (err) {
+    perror("kbstats: history");
+    if (end >= 0 && ftruncate(fd, end)) {
+      perror("kbstats: history");
+      /* whole but maybe not durable; appending them again would count twice */
+      err = done != want;
+    }
+  }
+  close(fd);
+  pthread_mutex_unlock(&history_lock);
+  return err;
+}
+
+/* Write a block without a checksum, see write_block(). */
+static int write_bare_block(FILE *f, uint32_t type, const void *data,
+                            uint32_t len) {
+  struct block_header bh = {.type = type, .len = len};
+
+  return fwrite(&bh, sizeof(bh), 1, f) != 1 || fwrite(data, len, 1, f) != 1;
+}
+
+/*
+ * Write a block tagged with the latest version of its layout, with its
+ * BLOCK_CHECKSUM ahead of it.
+ */
+static int write_block(FILE *f, uint32_t type, const void *data, uint32_t len) {
+  struct block_header bh = {.type = block_tag(type), .len = len};
+  struct block_checksum ck = {block_crc(&bh, data)};
+
+  return write_bare_block(f, BLOCK_CHECKSUM, &ck, sizeof(ck)) ||
+         write_bare_block(f, bh.type, data, len);
+}
+
+/**
+ * Pack the persistent aggregates as the stats file they are saved as.
+ *
+ * @param len Set to the length of the file.
+ * @return The file, or NULL on error.
+ */
+static char *stats_pack(struct capture *cap, size_t *len) {
+  struct stats_header hdr = {.magic = STATS_MAGIC, .version = STATS_VERSION};
+  struct kb_stats keys;
+  char *image = NULL;
+  uint8_t *seg;
+  size_t n;
+  FILE *f;
+  int i, err;
+
+  seg = malloc(SEGMENT_MAX_LEN(SEGMENT_ROWS));
+  f = open_memstream(&image, len);
+  if (!seg || !f) {
+    free(seg);
+    if (f)
+      fclose(f);
+    free(image);
+    return NULL;
+  }
+
+  err = fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+  err |= write_block(f, BLOCK_RECORDS, cap->records.best,
+                     sizeof(cap->records.best));
+  err |= write_block(f, BLOCK_WORDS, cap->words.info,
+                     sizeof(*cap->words.info) +
+                         cap->words.nslow * sizeof(struct slow_word));
+  err |= write_block(f, BLOCK_SKETCH_TODAY, cap->words.today.count,
+                     SKETCH_LEN(cap->words.width));
+  err |= write_block(f, BLOCK_SKETCH_TOTAL, cap->words.total.count,
+                     SKETCH_LEN(cap->words.width));
+  /* merged, for older binaries and the exports */
+  kb_merge(&cap->shards, &keys);
+  err |= write_block(f, BLOCK_KEYS, &keys, sizeof(keys));
+  for (i = 0; i < cap->shards.nknown; i++)
+    err |= write_block(f, BLOCK_DEVICE_KEYS, cap->shards.known[i],
+                       sizeof(struct kb_shard));
+  err |= write_block(f, BLOCK_BIGRAMS, cap->bigrams.table,
+                     sizeof(*cap->bigrams.table));
+  err |= write_block(f, BLOCK_SEGMENT, seg,
+                     segment_encode(&cap->rollups.seg, seg));
+  if (cap->rollups.cur.minute)
+    err |= write_block(f, BLOCK_MINUTE, &cap->rollups.cur,
+                       sizeof(cap->rollups.cur));
+  for (i = 0; i < cap->debounce.nknown; i++)
+    err |= write_block(f, BLOCK_DEBOUNCE, cap->debounce.known[i],
+                       DEBOUNCE_SAVED);
+  err |= write_block(f, BLOCK_LAYOUT, &cap->layout, LAYOUT_SAVED);
+  for (i = 0; cap->views && i < cap->views->n; i++) {
+    uint8_t *view = view_encode(&cap->views->view[i], &n);
+
+    err |= !view || write_block(f, BLOCK_VIEW, view, n);
+    free(view);
+  }
+  err |= fclose(f);
+  free(seg);
+
+  if (err) {
+    free(image);
+    return NULL;
+  }
+  return image;
+}
+
+/**
+ * Replace the stats file with a new one, atomically.
+ *
+ * @param sync Whether to wait for it to reach the disk.
+ * @return 0 on success or 1 otherwise.
+ */
+static int stats_write(const char *path, const char *image, size_t len,
+                       int sync) {
+  char tmp[PATH_MAX];
+  int fd, err;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    perror("kbstats: saving stats");
+    return 1;
+  }
+  err = pwrite(fd, image, len, 0) != (ssize_t)len || (sync && fdatasync(fd));
+  err |= close(fd);
+
+  if (err || rename(tmp, path)) {
+    perror("kbstats: saving stats");
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+/* The writer of flushes, see "Persistence" above. */
+static void flush_free(struct flush *fl) {
+  free(fl->stats);
+  free(fl->history);
+  free(fl);
+}
+
+/**
+ * Write a flush, the history first as the stats file takes over from it:
+ * the new stats file no longer has the days appended, so it is only written
+ * once they are in the history.
+ *
+ * @return 0 on success, 1 if the stats file could not be replaced, or 2 if
+ * the history could not be appended to, when the stats file is left as it is
+ * and the flush is to be written again.
+ */
+static int flush_write(const char *stats_path, const char *history_path,
+                       const struct flush *fl) {
+  int err = 0;
+
+  PROBE(flush_start);
+  if (fl->history_len &&
+      history_write(history_path, fl->history, fl->history_len, fl->sync))
+    err = 2;
+  else if (fl->stats)
+    err = stats_write(stats_path, fl->stats, fl->stats_len, fl->sync);
+  PROBE(flush_done, err);
+  return err;
+}
+
+static void *persist_loop(void *arg) {
+  struct persister *p = arg;
+  struct flush *fl;
+  uint64_t ns;
+  int err;
+
+  /* only use what disk the rest of the system leaves */
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+          IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while ((!p->waiting || p->stalled) && !p->stopping)
+      pthread_cond_wait(&p->cond, &p->lock);
+    fl = p->waiting;
+    if (!fl)
+      break;
+    p->waiting = fl->next;
+    pthread_mutex_unlock(&p->lock);
+
+    err = flush_write(p->stats_path, p->history_path, fl);
+    ns = now_ns() - fl->queued_ns;
+    __atomic_store_n(&p->last_ns, ns, __ATOMIC_RELAXED);
+    if (ns > p->max_ns)
+      __atomic_store_n(&p->max_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->flushes, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->failed, !!err, __ATOMIC_RELAXED);
+    if (err)
+      __atomic_store_n(&p->retry, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&p->lock);
+    if (err == 2) {
+      /* the history stays first, to be tried again with the next flush */
+      fl->next = p->waiting;
+      p->waiting = fl;
+      p->stalled = 1;
+      if (p->stopping)
+        break; /* see persister_stop() */
+      continue;
+    }
+    flush_free(fl);
+    __atomic_sub_fetch(&p->queue, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/**
+ * Start writing the flushes of a capture on a thread of their own.
+ *
+ * @return The running persister, or NULL if nothing is saved or on error.
+ */
+static struct persister *persister_start(const struct capture *cap) {
+  struct persister *p;
+
+  if (!cap->stats_path)
+    return NULL;
+  p = calloc(1, sizeof(*p));
+  if (!p) {
+    perror("kbstats: calloc");
+    return NULL;
+  }
+  p->stats_path = cap->stats_path;
+  p->history_path = cap->history_path;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  if (pthread_create(&p->thread, NULL, persist_loop, p)) {
+    perror("kbstats: persister");
+    free(p);
+    return NULL;
+  }
+  return p;
+}
+
+/**
+ * Hand a flush to the writer. Never waits for the disk.
+ */
+static void persister_submit(struct persister *p, struct flush *fl) {
+  struct flush **w;
+
+  fl->queued_ns = now_ns();
+  __atomic_add_fetch(&p->queue, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&p->lock);
+  p->stalled = 0;
+  /* the newer image leaves the waiting ones only their history, if any */
+  for (w = &p->waiting; *w;) {
+    struct flush *old = *w;
+
+    free(old->stats);
+    old->stats = NULL;
+    fl->sync |= old->sync;
+    if (old->history) {
+      w = &old->next;
+      continue;
+    }
+    *w = old->next;
+    if (old->queued_ns < fl->queued_ns)
+      fl->queued_ns = old->queued_ns;
+    free(old);
+    __atomic_sub_fetch(&p->queue, 1, __ATOMIC_RELAXED);
+  }
+  *w = fl;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  PROBE(flush_queued, __atomic_load_n(&p->queue, __ATOMIC_RELAXED));
+}
+
+/*
+ * Write the flushes still waiting and stop the writer of a capture. History
+ * the writer couldn't append goes back to the capture, for the last save to
+ * try again on the spot.
+ */
+static void persister_stop(struct capture *cap) {
+  struct persister *p = cap->persister;
+  struct flush *fl;
+
+  if (!p)
+    return;
+  pthread_mutex_lock(&p->lock);
+  p->stopping = 1;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->thread, NULL);
+  while ((fl = p->waiting)) {
+    uint8_t *h = realloc(cap->unwritten, cap->unwritten_len + fl->history_len);
+
+    if (h) {
+      memcpy(h + cap->unwritten_len, fl->history, fl->history_len);
+      cap->unwritten = h;
+      cap->unwritten_len += fl->history_len;
+    } else {
+      perror("kbstats: history");
+    }
+    p->waiting = fl->next;
+    flush_free(fl);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+  free(p);
+  cap->persister = NULL;
+}
+
+/**
+ * Save the persistent aggregates: append what is due to the history file
+ * and replace the stats file. With a persister running they are only packed
+ * and handed over, see "Persistence"; if the writer fails, drain_ring()
+ * makes the save due again.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int stats_save(struct capture *cap) {
+  struct flush *fl;
+  int day = cap->rollups.nsealed, err;
+
+  if (!cap->stats_path)
+    return 0;
+
+  fl = calloc(1, sizeof(*fl));
+  if (fl)
+    fl->stats = stats_pack(cap, &fl->stats_len);
+  if (!fl || !fl->stats) {
+    perror("kbstats: saving stats");
+    free(fl);
+    return 1;
+  }
+  if (cap->history_path)
+    history_pack(&cap->rollups, &cap->unwritten, &cap->unwritten_len);
+  fl->history = cap->unwritten;
+  fl->history_len = cap->unwritten_len;
+  cap->unwritten = NULL;
+  cap->unwritten_len = 0;
+
+  if (cap->persister) {
+    fl->sync = sync_point == SYNC_FLUSH || (sync_point == SYNC_DAY && day);
+    persister_submit(cap->persister, fl);
+    err = 0;
+  } else {
+    fl->sync = 1;
+    err = flush_write(cap->stats_path, cap->history_path, fl);
+    if (err == 2) {
+      /* kept for the next save */
+      cap->unwritten = fl->history;
+      cap->unwritten_len = fl->history_len;
+      fl->history = NULL;
+    }
+    flush_free(fl);
+  }
+  if (err)
+    return 1;
+
+  cap->dirty = 0;
+  cap->flushed_ns = now_ns();
+  return 0;
+}
+
+/**
+ * Whether a quarantine file already holds a block, as left by an earlier
+ * load of the same stats file.
+ */
+static int quarantine_has(FILE *f, const struct block_header *bh,
+                          const void *payload) {
+  struct block_header qh;
+  uint8_t *buf = NULL;
+  int found = 0;
+
+  if (fseek(f, sizeof(struct stats_header), SEEK_SET))
+    return 0;
+  while (!found && fread(&qh, sizeof(qh), 1, f) == 1) {
+    if (qh.type != bh->type || qh.len != bh->len) {
+      if (fseek(f, qh.len, SEEK_CUR))
+        break;
+      continue;
+    }
+    buf = buf ? buf : malloc(bh->len ? bh->len : 1);
+    if (!buf || (bh->len && fread(buf, bh->len, 1, f) != 1))
+      break;
+    found = memcmp(buf, payload, bh->len) == 0;
+  }
+  free(buf);
+  return found;
+}
+
+/**
+ * Set aside a block of a stats file that failed its checksum, in
+ * PATH.quarantine after any set aside before, with the checksum it failed.
+ */
+static void block_quarantine(const char *path, long offset,
+                             const struct block_header *bh,
+                             const void *payload, uint32_t crc) {
+  struct stats_header hdr = {.magic = STATS_MAGIC, .version = STATS_VERSION};
+  struct block_checksum ck = {crc};
+  char *qpath = NULL;
+  FILE *f = NULL;
+  int err;
+
+  if (asprintf(&qpath, "%s.quarantine", path) >= 0)
+    f = fopen(qpath, "a+b");
+  fprintf(stderr,
+          "kbstats: %s: block %u at offset %ld fails its checksum, set "
+          "aside in %s\n",
+          path, bh->type, offset, qpath ? qpath : "nothing");
+  if (!f) {
+    perror("kbstats: quarantine");
+    free(qpath);
+    return;
+  }
+  if (quarantine_has(f, bh, payload)) {
+    fclose(f);
+    free(qpath);
+    return;
+  }
+  err = fseek(f, 0, SEEK_END) ||
+        (ftell(f) == 0 && fwrite(&hdr, sizeof(hdr), 1, f) != 1) ||
+        write_bare_block(f, BLOCK_CHECKSUM, &ck, sizeof(ck)) ||
+        write_bare_block(f, bh->type, payload, bh->len);
+  if (fclose(f) || err)
+    perror("kbstats: quarantine");
+  free(qpath);
+}
+
+/**
+ * Load the persistent aggregates from a stats file. A missing file is not an
+ * error.
+ *
+ * @param path The stats file.
+ * @param cap The capture state to load into.
+ * @return 0 on success or 1 if the file exists but is not a stats file.
+ */
+static int stats_load(const char *path, struct capture *cap) {
+  struct stats_header hdr;
+  struct block_header bh;
+  struct block_check bc = {0};
+  FILE *f;
+
+  f = fopen(path, "rb");
+  if (!f)
+    return errno != ENOENT;
+
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, STATS_MAGIC, sizeof(hdr.magic)) != 0) {
+    fprintf(stderr, "kbstats: %s is not a stats file\n", path);
+    fclose(f);
+    return 1;
+  }
+
+  while (fread(&bh, sizeof(bh), 1, f) == 1) {
+    void *block = malloc(bh.len ? bh.len : 1), *payload = block, *dst = NULL;
+
+    if (!block || (bh.len && fread(block, bh.len, 1, f) != 1)) {
+      free(block);
+      break;
+    }
+    if (block_corrupt(&bc, &bh, block)) {
+      block_quarantine(path, ftell(f) - (long)(sizeof(bh) + bh.len), &bh,
+                       block, bc.crc);
+      free(block);
+      continue;
+    }
+    if (block_upgrade(&bh, &payload, &block)) {
+      free(block);
+      continue;
+    }
+
+    if (bh.type == BLOCK_WORDS &&
+        words_load_info(&cap->words, payload, bh.len))
+      fprintf(stderr, "kbstats: %s: bad word list\n", path);
+    if (bh.type == BLOCK_SKETCH_TODAY &&
+        words_load_sketch(&cap->words, &cap->words.today, payload, bh.len))
+      fprintf(stderr, "kbstats: %s: bad word sketch\n", path);
+    if (bh.type == BLOCK_SKETCH_TOTAL &&
+        words_load_sketch(&cap->words, &cap->words.total, payload, bh.len))
+      fprintf(stderr, "kbstats: %s: bad word sketch\n", path);
+    if (bh.type == BLOCK_SEGMENT &&
+        rollups_load(&cap->rollups, payload, bh.len))
+      fprintf(stderr, "kbstats: %s: bad rollup segment\n", path);
+    if (bh.type == BLOCK_VIEW && view_decode(cap->views, payload, bh.len))
+      fprintf(stderr, "kbstats: %s: bad view\n", path);
+    if (bh.type == BLOCK_DEBOUNCE &&
+        debounce_load(&cap->debounce, payload, bh.len))
+      fprintf(stderr, "kbstats: %s: bad debounce block\n", path);
+    if (bh.type == BLOCK_DEVICE_KEYS &&
+        kb_shard_load(&cap->shards, payload, bh.len))
+      fprintf(stderr, "kbstats: %s: bad device counts\n", path);
+    if (bh.type == BLOCK_LAYOUT && layout_load(&cap->layout, payload, bh.len))
+      fprintf(stderr, "kbstats: %s: bad layout block\n", path);
+
+    if (bh.type == BLOCK_RECORDS && bh.len == sizeof(cap->records.best))
+      dst = cap->records.best;
+    else if (bh.type == BLOCK_KEYS && bh.len == sizeof(cap->shards.base))
+      dst = &cap->shards.base;
+    else if (bh.type == BLOCK_BIGRAMS &&
+             bh.len == sizeof(struct bigram_table))
+      dst = cap->bigrams.table;
+    else if (bh.type == BLOCK_MINUTE && bh.len == sizeof(cap->rollups.cur))
+      dst = &cap->rollups.cur;
+    if (dst)
+      memcpy(dst, payload, bh.len);
+    free(block);
+  }
+
+  fclose(f);
+  kb_unmerge(&cap->shards);
+  return 0;
+}
+
+/**
+ * Prepare the aggregator half of a capture: allocate its state and, if
+ * persist is set, load the config and stats files.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int aggregator_init(struct capture *cap, int persist) {
+  uint32_t width, nslow;
+  char *config;
+  int err = 0;
+
+  cap->stages = stage_mask;
+  cap->memory_budget = memory_budget;
+  layout_init(&cap->layout, layout_keymap);
+  if (persist)
+    cap->stats_path = stats_file ? strdup(stats_file) : default_stats_path();
+  if (cap->stats_path) {
+    config = config_file ? strdup(config_file) : default_config_path();
+    err = config && config_load(config, cap);
+    free(config);
+  }
+
+  memory_plan(cap->memory_budget, &width, &nslow);
+  if (err || records_init(&cap->records) ||
+      words_init(&cap->words, width, nslow) || rollups_init(&cap->rollups) ||
+      bigrams_init(&cap->bigrams))
+    return 1;
+  if (!cap->stats_path)
+    return 0;
+
+  if (stats_load(cap->stats_path, cap))
+    return 1;
+  asprintf(&cap->history_path, "%s.history", cap->stats_path);
+  if (cap->history_path)
+    views_fill(cap);
+  cap->flushed_ns = now_ns();
+
+  return 0;
+}
+
+/**
+ * Close the session in progress and save everything. Called when the
+ * aggregator stops. The minute in progress is saved as it is and carries on
+ * if the next key press falls in it.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int aggregator_finish(struct capture *cap) {
+  rollups_close_session(&cap->rollups);
+  return stats_save(cap);
+}
+
+/*
+ * History compaction. In capture mode a thread running at idle CPU and I/O
+ * priority looks at the history file ARCHIVE_DELAY_SEC after start and every
+ * ARCHIVE_INTERVAL_SEC after that. It rewrites the blocks in an old layout
+ * in the latest one (see history_migrate()), then, once ARCHIVE_MIN_BLOCKS
+ * blocks have fallen behind the retention horizon, rewrites them as archives
+ * (see "Archived history" above). --archive does the same on demand.
+ */
+#define ARCHIVE_DELAY_SEC 60
+#define ARCHIVE_INTERVAL_SEC (6 * 3600)
+#define ARCHIVE_MIN_BLOCKS 64
+
+struct archiver {
+  pthread_t thread;
+  int wakefd; /* written to stop the thread */
+  const char *path;
+};
+
+/**
+ * Copy from the current position of one file to another, len bytes or up to
+ * the end if len is -1.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int copy_bytes(FILE *from, FILE *to, long len) {
+  char buf[65536];
+  size_t n, want;
+
+  while (len) {
+    want = len < 0 || len > (long)sizeof(buf) ? sizeof(buf) : (size_t)len;
+    n = fread(buf, 1, want, from);
+    if (n && fwrite(buf, 1, n, to) != n)
+      return 1;
+    if (n < want)
+      return len > 0 || ferror(from);
+    if (len > 0)
+      len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Rewrite the blocks of the history file that are in an old layout in the
+ * latest one (see "Block schemas"), each with a checksum and padded with a
+ * BLOCK_PAD to take up exactly the bytes it and its checksum did, so no
+ * offset moves. Blocks that would grow, fail their checksum or sit in
+ * archives are left for block_upgrade() to bring up to date as they are
+ * read. Like history_compact(), the new file is written next to the old one
+ * and swapped in under history_lock.
+ *
+ * @param path The history file.
+ * @param migrated Set to the number of blocks rewritten.
+ * @return 0 on success or 1 otherwise.
+ */
+static int history_migrate(const char *path, uint32_t *migrated) {
+  struct stats_header hdr;
+  struct block_header bh, nb;
+  struct block_check bc = {0};
+  struct block_checksum ck;
+  uint8_t *payload = NULL, *p;
+  void *pl, *up = NULL;
+  long start = 0, lead = 0, keep, space, need;
+  char *tmp = NULL;
+  FILE *f, *out = NULL;
+  int err = 0, held = 0, corrupt;
+
+  *migrated = 0;
+  f = fopen(path, "rb");
+  if (!f)
+    return errno != ENOENT;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, STATS_MAGIC, sizeof(hdr.magic)) != 0) {
+    fprintf(stderr, "kbstats: %s is not a history file\n", path);
+    fclose(f);
+    return 1;
+  }
+
+  /* usually there is nothing to do, as the headers alone tell */
+  while (!start && fread(&bh, sizeof(bh), 1, f) == 1) {
+    if (block_shim(bh.type))
+      start = ftell(f) - (long)sizeof(bh) - lead;
+    lead = bh.type == BLOCK_CHECKSUM ? (long)sizeof(bh) + bh.len : 0;
+    if (fseek(f, bh.len, SEEK_CUR))
+      break;
+  }
+  if (!start) {
+    fclose(f);
+    return 0;
+  }
+
+  asprintf(&tmp, "%s.tmp", path);
+  out = tmp ? fopen(tmp, "wb") : NULL;
+  err = !out || fseek(f, 0, SEEK_SET) || copy_bytes(f, out, start);
+  keep = start;
+  while (!err && fread(&bh, sizeof(bh), 1, f) == 1) {
+    p = realloc(payload, bh.len ? bh.len : 1);
+    if (!p) {
+      err = 1;
+      break;
+    }
+    payload = p;
+    if (fread(payload, 1, bh.len, f) != bh.len)
+      break;
+
+    corrupt = block_corrupt(&bc, &bh, payload);
+    if (bh.type == BLOCK_CHECKSUM && bh.len == sizeof(ck)) {
+      /* written with the block after it, or replaced */
+      err = held && write_bare_block(out, BLOCK_CHECKSUM, &ck, sizeof(ck));
+      memcpy(&ck, payload, sizeof(ck));
+      held = 1;
+      continue;
+    }
+
+    space = (held ? sizeof(bh) + sizeof(ck) : 0) + sizeof(bh) + bh.len;
+    need = space + 1;
+    nb = bh;
+    pl = payload;
+    if (!corrupt && block_shim(bh.type) && !block_upgrade(&nb, &pl, &up))
+      need = sizeof(bh) + sizeof(ck) + sizeof(nb) + nb.len;
+    if (need == space || need + (long)sizeof(bh) <= space) {
+      err = write_block(out, nb.type, pl, nb.len);
+      if (!err && need < space) {
+        struct block_header pad = {BLOCK_PAD, space - need - sizeof(pad)};
+
+        err = fwrite(&pad, sizeof(pad), 1, out) != 1;
+        while (!err && pad.len--)
+          err = putc(0, out) == EOF;
+      }
+      (*migrated)++;
+    } else {
+      err = (held && write_bare_block(out, BLOCK_CHECKSUM, &ck, sizeof(ck))) ||
+            write_bare_block(out, bh.type, payload, bh.len);
+    }
+    held = 0;
+    keep = ftell(f);
+  }
+
+  /* only blocks that can't be rewritten, as found last time too */
+  if (!err && !*migrated) {
+    fclose(out);
+    out = NULL;
+    unlink(tmp);
+  }
+  /* catch up with appends and swap the files before any more come */
+  if (!err && out) {
+    pthread_mutex_lock(&history_lock);
+    err = fseek(f, keep, SEEK_SET) || copy_bytes(f, out, -1) ||
+          fflush(out) || fsync(fileno(out));
+    err |= fclose(out);
+    out = NULL;
+    if (!err && rename(tmp, path))
+      err = 1;
+    pthread_mutex_unlock(&history_lock);
+  }
+  if (err) {
+    perror("kbstats: migrating the history");
+    *migrated = 0;
+    if (out)
+      fclose(out);
+    if (tmp)
+      unlink(tmp);
+  }
+  fclose(f);
+  free(tmp);
+  free(up);
+  free(payload);
+  return err;
+}
+
+#if HAVE_ZSTD
+struct archive_stats {
+  uint32_t blocks;        /* archived by this compaction */
+  uint64_t before, after; /* bytes they took up, and take up now */
+  uint64_t decoded;       /* bytes decompressed to check the archives */
+  uint64_t decode_ns;
+};
+
+static void archive_report(FILE *f, const char *path,
+                           const struct archive_stats *st) {
+  fprintf(f,
+          "kbstats: archived %u blocks of %s: %llu -> %llu bytes "
+          "(%.0f%% saved), decoding at %.0f MB/s\n",
+          st->blocks, path, (unsigned long long)st->before,
+          (unsigned long long)st->after,
+          st->before ? 100.0 - 100.0 * st->after / st->before : 0.0,
+          st->decode_ns ? st->decoded * 1e3 / st->decode_ns : 0.0);
+}
+
+/**
+ * Find the first and last minute a history block covers, in seconds since
+ * the epoch. A block this binary can't read covers none.
+ *
+ * @param seg Scratch space for decoding segments.
+ * @return 0 on success or 1 if the block is malformed.
+ */
+static int history_span(struct segment *seg, struct block_header bh,
+                        void *payload, int64_t *first, int64_t *last) {
+  const struct session *sess;
+  void *up = NULL;
+  uint32_t n;
+  int err = 0;
+
+  *first = INT64_MAX;
+  *last = INT64_MIN;
+  if (block_upgrade(&bh, &payload, &up)) {
+    free(up);
+    return 0;
+  }
+  sess = payload;
+  n = bh.len / sizeof(*sess);
+  if (bh.type == BLOCK_SESSIONS) {
+    if (n) {
+      *first = sess[0].start;
+      *last = sess[n - 1].end;
+    }
+  } else {
+    switch (segment_load_block(seg, bh.type, payload, bh.len)) {
+    case -1:
+      err = 1;
+      break;
+    case 1:
+      if (seg->rows) {
+        *first = seg->minute[0];
+        *last = seg->minute[seg->rows - 1];
+      }
+    }
+  }
+  free(up);
+  return err;
+}
+
+/**
+ * Compress one archive of the blocks in raw and append it to f, after
+ * checking that it decompresses back to them.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int archive_write(FILE *f, struct archive_header *h, const uint8_t *raw,
+                         ZSTD_CCtx *cctx, const ZSTD_CDict *cdict,
+                         struct archive_reader *ar, struct archive_stats *st) {
+  size_t bound = ZSTD_compressBound(h->raw_len), n;
+  uint8_t *out = malloc(sizeof(*h) + bound), *check = malloc(h->raw_len + 1);
+  uint64_t t;
+  int err = 1;
+
+  if (!out || !check)
+    goto out;
+  if (cdict)
+    n = ZSTD_compress_usingCDict(cctx, out + sizeof(*h), bound, raw,
+                                 h->raw_len, cdict);
+  else
+    n = ZSTD_compressCCtx(cctx, out + sizeof(*h), bound, raw, h->raw_len,
+                          ARCHIVE_LEVEL);
+  if (ZSTD_isError(n)) {
+    fprintf(stderr, "kbstats: archive: %s\n", ZSTD_getErrorName(n));
+    goto out;
+  }
+  memcpy(out, h, sizeof(*h));
+
+  t = now_ns();
+  if (archive_decode(ar, (struct archive_header *)out, sizeof(*h) + n, check) ||
+      memcmp(check, raw, h->raw_len) != 0)
+    goto out;
+  st->decode_ns += now_ns() - t;
+  st->decoded += h->raw_len;
+
+  /* checked by the checksums of the blocks in it */
+  err = write_bare_block(f, BLOCK_ARCHIVE, out, sizeof(*h) + n);
+  st->after += sizeof(struct block_header) + sizeof(*h) + n;
+out:
+  free(out);
+  free(check);
+  return err;
+}
+
+/**
+ * Rewrite the blocks of the history file older than ARCHIVE_AFTER_DAYS as
+ * archives, if there are at least ARCHIVE_MIN_BLOCKS of them. The new file
+ * is written next to the old one, and swapped in under history_lock once it
+ * has caught up with what was appended meanwhile.
+ *
+ * @param path The history file.
+ * @param st Set to what was archived.
+ * @return 0 on success or 1 otherwise.
+ */
+static int history_compact(const char *path, struct archive_stats *st) {
+  int64_t horizon = time(NULL) - ARCHIVE_AFTER_DAYS * 86400LL;
+  struct archive_reader ar = {0};
+  struct stats_header hdr;
+  struct block_header bh;
+  struct segment seg = {0};
+  struct archive_header h;
+  ZSTD_CCtx *cctx = NULL;
+  ZSTD_CDict *cdict = NULL;
+  uint8_t *raw = NULL, *payload = NULL, *dict = NULL, *p;
+  size_t raw_len = 0, raw_cap = 0, dict_len = 0, *sizes = NULL;
+  size_t i, j, off, len, lead = 0;
+  int64_t (*span)[2] = NULL, first = 0, last = 0;
+  long keep = sizeof(hdr), from = sizeof(hdr);
+  char *tmp = NULL;
+  FILE *f, *out = NULL;
+  uint32_t n = 0;
+  int err = 1, new_dict = 0;
+
+  memset(st, 0, sizeof(*st));
+  f = fopen(path, "rb");
+  if (!f)
+    return errno != ENOENT;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, STATS_MAGIC, sizeof(hdr.magic)) != 0) {
+    fprintf(stderr, "kbstats: %s is not a history file\n", path);
+    goto out;
+  }
+
+  /* the archives so far, then the blocks old enough to join them */
+  while (fread(&bh, sizeof(bh), 1, f) == 1) {
+    p = realloc(payload, bh.len ? bh.len : 1);
+    if (!p)
+      goto out;
+    payload = p;
+    if (fread(payload, 1, bh.len, f) != bh.len)
+      break;
+
+    if (bh.type == BLOCK_ARCHIVE_DICT || bh.type == BLOCK_ARCHIVE) {
+      if (n)
+        break; /* not written by history_compact() */
+      if (bh.type == BLOCK_ARCHIVE_DICT) {
+        free(dict);
+        dict = payload;
+        dict_len = bh.len;
+        payload = NULL;
+        if (archive_dict(&ar, dict, dict_len))
+          goto out;
+      } else if (bh.len >= sizeof(h)) {
+        from = ((struct archive_header *)payload)->to;
+      }
+      keep = ftell(f);
+      continue;
+    }
+
+    /* a checksum goes with the block after it */
+    if (bh.type == BLOCK_CHECKSUM)
+      lead += sizeof(bh) + bh.len;
+    else if (history_span(&seg, bh, payload, &first, &last) ||
+             last >= horizon)
+      break;
+    if (raw_len + sizeof(bh) + bh.len > raw_cap) {
+      raw_cap = 2 * (raw_len + sizeof(bh) + bh.len);
+      p = realloc(raw, raw_cap);
+      if (!p)
+        goto out;
+      raw = p;
+    }
+    if (!(n & (n - 1))) {
+      void *s = realloc(sizes, 2 * (n + 1) * sizeof(*sizes));
+      void *t = realloc(span, 2 * (n + 1) * sizeof(*span));
+
+      if (s)
+        sizes = s;
+      if (t)
+        span = t;
+      if (!s || !t)
+        goto out;
+    }
+    memcpy(raw + raw_len, &bh, sizeof(bh));
+    memcpy(raw + raw_len + sizeof(bh), payload, bh.len);
+    raw_len += sizeof(bh) + bh.len;
+    if (bh.type == BLOCK_CHECKSUM)
+      continue;
+    sizes[n] = lead + sizeof(bh) + bh.len;
+    lead = 0;
+    span[n][0] = first;
+    span[n][1] = last;
+    n++;
+  }
+  raw_len -= lead; /* left with its block */
+  if (n < ARCHIVE_MIN_BLOCKS) {
+    err = 0;
+    goto out;
+  }
+
+  /* the first archives train the dictionary the later ones share */
+  if (!dict) {
+    dict = malloc(ARCHIVE_DICT_MAX);
+    if (!dict)
+      goto out;
+    dict_len = ZDICT_trainFromBuffer(dict, ARCHIVE_DICT_MAX, raw, sizes, n);
+    if (ZDICT_isError(dict_len) || archive_dict(&ar, dict, dict_len)) {
+      free(dict);
+      dict = NULL;
+    } else {
+      new_dict = 1;
+    }
+  }
+  cctx = ZSTD_createCCtx();
+  if (dict)
+    cdict = ZSTD_createCDict(dict, dict_len, ARCHIVE_LEVEL);
+  if (!cctx || (dict && !cdict))
+    goto out;
+
+  asprintf(&tmp, "%s.tmp", path);
+  out = tmp ? fopen(tmp, "wb") : NULL;
+  if (!out || fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+      fseek(f, sizeof(hdr), SEEK_SET) ||
+      copy_bytes(f, out, keep - sizeof(hdr)))
+    goto out;
+  if (new_dict) {
+    if (write_bare_block(out, BLOCK_ARCHIVE_DICT, dict, dict_len))
+      goto out;
+    st->after += sizeof(bh) + dict_len;
+  }
+
+  for (i = 0, off = 0; i < n; i = j, off += len) {
+    len = sizes[i];
+    h = (struct archive_header){.from = from + off,
+                                .first_minute = span[i][0],
+                                .last_minute = span[i][1],
+                                .dict_id = ar.dict_id};
+    for (j = i + 1; j < n && len + sizes[j] <= ARCHIVE_BLOCK_RAW; j++) {
+      len += sizes[j];
+      if (span[j][0] < h.first_minute)
+        h.first_minute = span[j][0];
+      if (span[j][1] > h.last_minute)
+        h.last_minute = span[j][1];
+    }
+    h.to = h.from + len;
+    h.raw_len = len;
+    if (archive_write(out, &h, raw + off, cctx, cdict, &ar, st))
+      goto out;
+  }
+  st->blocks = n;
+  st->before = raw_len;
+
+  /* catch up with appends and swap the files before any more come */
+  pthread_mutex_lock(&history_lock);
+  err = fseek(f, keep + raw_len, SEEK_SET) ||
+        copy_bytes(f, out, -1) || fflush(out) ||
+        fsync(fileno(out));
+  err |= fclose(out);
+  out = NULL;
+  if (!err && rename(tmp, path))
+    err = 1;
+  pthread_mutex_unlock(&history_lock);
+  if (err)
+    perror("kbstats: compacting the history");
+
+out:
+  if (out)
+    fclose(out);
+  if (err && tmp)
+    unlink(tmp);
+  if (err)
+    st->blocks = 0;
+  fclose(f);
+  ZSTD_freeCCtx(cctx);
+  ZSTD_freeCDict(cdict);
+  archive_reader_free(&ar);
+  free(seg.body);
+  free(tmp);
+  free(dict);
+  free(payload);
+  free(raw);
+  free(sizes);
+  free(span);
+  return err;
+}
+#endif
+
+static void *archive_loop(void *arg) {
+  struct archiver *a = arg;
+  struct pollfd pfd = {.fd = a->wakefd, .events = POLLIN};
+  struct sched_param sp = {0};
+#if HAVE_ZSTD
+  struct archive_stats st;
+#endif
+  uint32_t migrated;
+  int n, timeout = ARCHIVE_DELAY_SEC * 1000;
+
+  /* only use what CPU and disk the rest of the system leaves */
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+          IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+  for (;;) {
+    n = poll(&pfd, 1, timeout);
+    if (n > 0 || (n < 0 && errno != EINTR))
+      break;
+    if (n == 0) {
+      if (history_migrate(a->path, &migrated) == 0 && migrated)
+        fprintf(stderr, "kbstats: migrated %u blocks of %s\n", migrated,
+                a->path);
+#if HAVE_ZSTD
+      if (history_compact(a->path, &st) == 0 && st.blocks)
+        archive_report(stderr, a->path, &st);
+#endif
+      timeout = ARCHIVE_INTERVAL_SEC * 1000;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Start migrating and compacting the history of a capture in the background.
+ *
+ * @return The running archiver, or NULL if there is no history or on error.
+ */
+static struct archiver *archiver_start(const struct capture *cap) {
+  struct archiver *a;
+
+  if (!cap->history_path)
+    return NULL;
+  a = calloc(1, sizeof(*a));
+  if (!a) {
+    perror("kbstats: calloc");
+    return NULL;
+  }
+  a->path = cap->history_path;
+  a->wakefd = eventfd(0, EFD_CLOEXEC);
+  if (a->wakefd < 0 || pthread_create(&a->thread, NULL, archive_loop, a)) {
+    perror("kbstats: archiver");
+    if (a->wakefd >= 0)
+      close(a->wakefd);
+    free(a);
+    return NULL;
+  }
+  return a;
+}
+
+static void archiver_stop(struct archiver *a) {
+  if (!a)
+    return;
+  write(a->wakefd, &(uint64_t){1}, sizeof(uint64_t));
+  pthread_join(a->thread, NULL);
+  close(a->wakefd);
+  free(a);
+}
+
+/*
+ * Live event stream. With --serve, a thread of the aggregator answers
+ * GET /events on 127.0.0.1 with a text/event-stream of the published
+ * aggregates. Each update is formatted once and the same bytes are sent to
+ * every subscriber without blocking; a client whose socket can't take a whole
+ * update is dropped rather than buffered for. Only aggregates go out, never
+ * keys. GET /metrics?q=QUERY answers a metrics query as JSON,
+ * GET /memory the memory accounting (see memory_update()), GET /flush
+ * how the writer of the stats is keeping up (see "Persistence") and
+ * GET /layout the keyboard layout in use (see "Layout inference").
+ * These answers are queued and sent as the socket takes them, and a query,
+ * which reads the history, runs on a thread of its own, so neither holds up
+ * the updates.
+ */
+#define SERVE_CLIENTS 16
+#define SERVE_INTERVAL_MSEC 1000
+#define SERVE_REQUEST_MAX 1024
+#define SERVE_REPLY_MSEC 1000 /* for a client to take an answer */
+
+enum client_query {
+  QUERY_NONE,
+  QUERY_RUNNING,
+  QUERY_DONE, /* answer queued, the thread is to be joined */
+};
+
+struct client {
+  int fd;         /* -1 if the slot is free */
+  int subscribed; /* request answered, receiving events */
+  size_t len;
+  char request[SERVE_REQUEST_MAX];
+  char *reply; /* queued answer, the connection closes once it is sent */
+  size_t reply_len, sent;
+  uint64_t reply_by_ns;
+  pthread_t worker;
+  int query; /* enum client_query, atomic */
+};
+
+struct server {
+  int fd;
+  int wakefd;  /* written to stop the thread */
+  int readyfd; /* written by a query thread once its answer is queued */
+  pthread_t thread;
+  const struct kb_snapshot *snapshot;
+  const char *stats_path; /* for metrics queries */
+  const char *history_path;
+  struct client clients[SERVE_CLIENTS];
+  char event[1024]; /* the latest update */
+  int event_len;
+  uint64_t last_keystrokes;
+  uint64_t last_ns;
+};
+
+/**
+ * Copy a consistent view of a snapshot another thread or process may be
+ * publishing to.
+ */
+static void snapshot_read(const struct kb_snapshot *s,
+                          struct kb_snapshot *out) {
+  uint32_t seq;
+
+  do {
+    seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, s, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&s->seq, __ATOMIC_RELAXED));
+}
+
+static void client_close(struct client *c) {
+  close(c->fd);
+  c->fd = -1;
+  free(c->reply);
+  c->reply = NULL;
+}
+
+static void server_accept(struct server *srv) {
+  int i, fd;
+
+  fd = accept4(srv->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+  for (i = 0; i < SERVE_CLIENTS; i++) {
+    if (srv->clients[i].fd < 0) {
+      srv->clients[i] = (struct client){.fd = fd};
+      return;
+    }
+  }
+  close(fd); /* full */
+}
+
+/**
+ * Copy the value of parameter name in the query string of a request line,
+ * URL-decoded, into out.
+ */
+static void url_param(const char *query, const char *name, char *out,
+                      size_t size) {
+  size_t len = strlen(name), n = 0;
+  const char *p = query;
+  unsigned int c;
+
+  while (strncmp(p, name, len) != 0 || p[len] != '=') {
+    p += strcspn(p, "& ");
+    if (*p != '&') {
+      *out = '\0';
+      return;
+    }
+    p++;
+  }
+
+  for (p += len + 1; *p && *p != '&' && *p != ' ' && n + 1 < size; p++) {
+    if (*p == '%' && sscanf(p + 1, "%2x", &c) == 1) {
+      out[n++] = c;
+      p += 2;
+    } else {
+      out[n++] = *p == '+' ? ' ' : *p;
+    }
+  }
+  out[n] = '\0';
+}
+
+/**
+ * Queue a JSON response, for serve() to send as the socket takes it and then
+ * let the connection go. A client that doesn't take it within
+ * SERVE_REPLY_MSEC is dropped. Left unqueued if out of memory.
+ */
+static void server_reply(struct client *c, const char *status,
+                         const char *body, size_t len) {
+  char header[160];
+  int n;
+
+  n = snprintf(header, sizeof(header),
+               "HTTP/1.1 %s\r\n"
+               "Content-Type: application/json\r\n"
+               "Content-Length: %zu\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               status, len);
+  c->reply = malloc(n + len);
+  if (!c->reply)
+    return;
+  memcpy(c->reply, header, n);
+  memcpy(c->reply + n, body, len);
+  c->reply_len = n + len;
+  c->sent = 0;
+  c->reply_by_ns = now_ns() + SERVE_REPLY_MSEC * 1000000ULL;
+}
+
+/* Send what the socket takes of a queued answer, closing once it is sent. */
+static void client_write(struct client *c) {
+  ssize_t n;
+
+  n = send(c->fd, c->reply + c->sent, c->reply_len - c->sent,
+           MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n > 0 && (c->sent += n) < c->reply_len)
+    return;
+  client_close(c);
+}
+
+struct query_job {
+  struct server *srv;
+  struct client *c;
+};
+
+/**
+ * Answer GET /metrics?q=QUERY, on a thread of its own: serve() leaves the
+ * client alone until it is done.
+ */
+static void *server_metrics(void *arg) {
+  struct query_job *job = arg;
+  struct server *srv = job->srv;
+  struct client *c = job->c;
+  struct metrics_query q;
+  struct metrics_result *r = NULL;
+  const char *status = "200 OK";
+  char text[SERVE_REQUEST_MAX], *body = NULL;
+  size_t len = 0;
+  FILE *f;
+
+  free(job);
+  url_param(c->request + strlen("GET /metrics?"), "q", text, sizeof(text));
+  f = open_memstream(&body, &len);
+  if (!f) {
+    /* nothing to answer with */
+  } else if (metrics_parse(text, &q)) {
+    status = "400 Bad Request";
+    fprintf(f, "{\"error\":\"%s\"}\n", q.error);
+  } else if (!srv->history_path ||
+             !(r = metrics_run(&q, srv->stats_path, srv->history_path, 0))) {
+    status = "500 Internal Server Error";
+    fprintf(f, "{\"error\":\"can't read the history\"}\n");
+  } else {
+    metrics_print(&q, r, f, 1);
+  }
+  metrics_free(r);
+  if (f && !fclose(f))
+    server_reply(c, status, body, len);
+  free(body);
+
+  __atomic_store_n(&c->query, QUERY_DONE, __ATOMIC_RELEASE);
+  write(srv->readyfd, &(uint64_t){1}, sizeof(uint64_t));
+  return NULL;
+}
+
+/* Start answering a metrics query; the connection is closed if it can't. */
+static void server_query(struct server *srv, struct client *c) {
+  struct query_job *job = malloc(sizeof(*job));
+
+  if (job) {
+    *job = (struct query_job){srv, c};
+    c->query = QUERY_RUNNING;
+    if (!pthread_create(&c->worker, NULL, server_metrics, job))
+      return;
+    c->query = QUERY_NONE;
+    free(job);
+  }
+  perror("kbstats: metrics query");
+  client_close(c);
+}
+
+/* Join the query threads that are done, for their answers to be sent. */
+static void server_reap(struct server *srv) {
+  uint64_t n;
+  int i;
+
+  read(srv->readyfd, &n, sizeof(n));
+  for (i = 0; i < SERVE_CLIENTS; i++) {
+    struct client *c = &srv->clients[i];
+
+    if (__atomic_load_n(&c->query, __ATOMIC_ACQUIRE) != QUERY_DONE)
+      continue;
+    pthread_join(c->worker, NULL);
+    c->query = QUERY_NONE;
+    if (!c->reply)
+      client_close(c);
+  }
+}
+
+/**
+ * Answer GET /memory with the memory accounting in the snapshot, as JSON.
+ */
+static void server_memory(struct server *srv, struct client *c) {
+  struct kb_snapshot s;
+  char *body = NULL;
+  size_t len = 0;
+  FILE *f;
+  int i;
+
+  snapshot_read(srv->snapshot, &s);
+  f = open_memstream(&body, &len);
+  if (!f)
+    return;
+  fprintf(f, "{\"rss\":%llu,\"rss_high\":%llu,\"budget\":%llu,\"subsystems\":{",
+          (unsigned long long)s.rss, (unsigned long long)s.rss_high,
+          (unsigned long long)s.memory_budget);
+  for (i = 0; i < N_MEM; i++)
+    fprintf(f, "%s\"%s\":{\"reserved\":%llu,\"used\":%llu,\"high\":%llu}",
+            i ? "," : "", mem_names[i], (unsigned long long)s.mem[i].reserved,
+            (unsigned long long)s.mem[i].used,
+            (unsigned long long)s.mem[i].high);
+  fprintf(f, "}}\n");
+  if (!fclose(f))
+    server_reply(c, "200 OK", body, len);
+  free(body);
+}
+
+/**
+ * Answer GET /flush with the state of the writer in the snapshot, as JSON.
+ */
+static void server_flush(struct server *srv, struct client *c) {
+  struct kb_snapshot s;
+  char body[256];
+  int len;
+
+  snapshot_read(srv->snapshot, &s);
+  len = snprintf(body, sizeof(body),
+                 "{\"queue\":%u,\"flushes\":%llu,\"failed\":%llu,"
+                 "\"last_ms\":%.3f,\"max_ms\":%.3f,\"sync\":\"%s\"}\n",
+                 s.flush_queue, (unsigned long long)s.flushes,
+                 (unsigned long long)s.flushes_failed, s.flush_ns / 1e6,
+                 s.flush_max_ns / 1e6, sync_names[sync_point]);
+  server_reply(c, "200 OK", body, len);
+}
+
+/**
+ * Answer GET /layout with the keymap in use and how each one scored at the
+ * last check, as JSON. A score is minus the bits a bigram costs.
+ */
+static void server_layout(struct server *srv, struct client *c) {
+  struct kb_snapshot s;
+  char *body = NULL;
+  size_t len = 0;
+  FILE *f;
+  int k;
+
+  snapshot_read(srv->snapshot, &s);
+  f = open_memstream(&body, &len);
+  if (!f)
+    return;
+  fprintf(f, "{\"layout\":\"%s\",\"fixed\":%s,\"guess\":",
+          keymaps[s.layout < N_KEYMAPS ? s.layout : 0].name,
+          s.layout_fixed ? "true" : "false");
+  if (s.layout_guess >= 0 && s.layout_guess < N_KEYMAPS)
+    fprintf(f, "\"%s\"", keymaps[s.layout_guess].name);
+  else
+    fprintf(f, "null");
+  fprintf(f, ",\"bigrams\":%.0f,\"scores\":{", s.layout_bigrams);
+  for (k = 0; s.layout_guess >= 0 && k < N_KEYMAPS; k++)
+    fprintf(f, "%s\"%s\":%.2f", k ? "," : "", keymaps[k].name,
+            s.layout_score[k] / 10);
+  fprintf(f, "}}\n");
+  if (!fclose(f))
+    server_reply(c, "200 OK", body, len);
+  free(body);
+}
+
+/**
+ * Read from a client: the request until it is complete, then only to notice
+ * the client going away.
+ */
+static void client_read(struct server *srv, struct client *c) {
+  static const char ok[] = "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/event-stream\r\n"
+                           "Cache-Control: no-cache\r\n"
+                           "\r\n";
+  static const char not_found[] = "HTTP/1.1 404 Not Found\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "Connection: close\r\n"
+                                  "\r\n";
+  char discard[256];
+  ssize_t n;
+
+  if (c->subscribed) {
+    n = recv(c->fd, discard, sizeof(discard), 0);
+  } else {
+    n = recv(c->fd, c->request + c->len, sizeof(c->request) - 1 - c->len, 0);
+    if (n > 0) {
+      c->len += n;
+      c->request[c->len] = '\0';
+    }
+  }
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    client_close(c);
+    return;
+  }
+  if (c->subscribed || !strstr(c->request, "\r\n\r\n")) {
+    if (c->len == sizeof(c->request) - 1)
+      client_close(c);
+    return;
+  }
+
+  if (strncmp(c->request, "GET /metrics?", 13) == 0) {
+    server_query(srv, c);
+    return;
+  }
+  if (strncmp(c->request, "GET /memory ", 12) == 0) {
+    server_memory(srv, c);
+    if (!c->reply)
+      client_close(c);
+    return;
+  }
+  if (strncmp(c->request, "GET /flush ", 11) == 0) {
+    server_flush(srv, c);
+    if (!c->reply)
+      client_close(c);
+    return;
+  }
+  if (strncmp(c->request, "GET /layout ", 12) == 0) {
+    server_layout(srv, c);
+    if (!c->reply)
+      client_close(c);
+    return;
+  }
+  if (strncmp(c->request, "GET /events ", 12) != 0) {
+    send(c->fd, not_found, sizeof(not_found) - 1, MSG_NOSIGNAL);
+    client_close(c);
+    return;
+  }
+  if (send(c->fd, ok, sizeof(ok) - 1, MSG_NOSIGNAL) != sizeof(ok) - 1 ||
+      (srv->event_len && send(c->fd, srv->event, srv->event_len,
+                              MSG_NOSIGNAL) != srv->event_len)) {
+    client_close(c);
+    return;
+  }
+  c->subscribed = 1;
+}
+
+/**
+ * Format the current aggregates as an event and send it to every subscriber.
+ */
+static void server_broadcast(struct server *srv) {
+  struct kb_snapshot s;
+  char session[128] = "null";
+  uint64_t now = now_ns();
+  double rate = 0;
+  int i;
+
+  snapshot_read(srv->snapshot, &s);
+  if (srv->last_ns && s.keystrokes >= srv->last_keystrokes)
+    rate = (s.keystrokes - srv->last_keystrokes) * 1e9 / (now - srv->last_ns);
+  srv->last_keystrokes = s.keystrokes;
+  srv->last_ns = now;
+
+  if (s.session_start)
+    snprintf(session, sizeof(session),
+             "{\"start\":%lld,\"end\":%lld,\"keystrokes\":%llu}",
+             (long long)s.session_start, (long long)s.session_end,
+             (unsigned long long)s.session_keystrokes);
+  srv->event_len = snprintf(
+      srv->event, sizeof(srv->event),
+      "data: {\"time\":%lld,\"keystrokes\":%llu,\"keys_per_sec\":%.1f,"
+      "\"wpm\":{\"15s\":%.1f,\"60s\":%.1f,\"5min\":%.1f},"
+      "\"best_wpm\":{\"15s\":%.1f,\"60s\":%.1f,\"5min\":%.1f},"
+      "\"streak\":%llu,\"session\":%s}\n\n",
+      (long long)time(NULL), (unsigned long long)s.keystrokes, rate, s.wpm[0],
+      s.wpm[1], s.wpm[2], s.best_wpm[0], s.best_wpm[1], s.best_wpm[2],
+      (unsigned long long)s.streak, session);
+
+  for (i = 0; i < SERVE_CLIENTS; i++) {
+    struct client *c = &srv->clients[i];
+
+    if (c->fd >= 0 && c->subscribed &&
+        send(c->fd, srv->event, srv->event_len, MSG_DONTWAIT | MSG_NOSIGNAL) !=
+            srv->event_len)
+      client_close(c);
+  }
+}
+
+static void *serve(void *arg) {
+  struct server *srv = arg;
+  struct pollfd pfd[3 + SERVE_CLIENTS];
+  int idx[SERVE_CLIENTS];
+  uint64_t next = now_ns();
+  int i, n, timeout;
+
+  for (;;) {
+    pfd[0] = (struct pollfd){.fd = srv->wakefd, .events = POLLIN};
+    pfd[1] = (struct pollfd){.fd = srv->fd, .events = POLLIN};
+    pfd[2] = (struct pollfd){.fd = srv->readyfd, .events = POLLIN};
+    for (i = 0, n = 3; i < SERVE_CLIENTS; i++) {
+      struct client *c = &srv->clients[i];
+
+      if (c->fd < 0 ||
+          __atomic_load_n(&c->query, __ATOMIC_RELAXED) != QUERY_NONE)
+        continue;
+      if (c->reply && now_ns() > c->reply_by_ns) {
+        client_close(c); /* too slow to take its answer */
+        continue;
+      }
+      idx[n - 3] = i;
+      pfd[n++] = (struct pollfd){.fd = c->fd,
+                                 .events = c->reply ? POLLOUT : POLLIN};
+    }
+
+    timeout = next > now_ns() ? (next - now_ns()) / 1000000 + 1 : 0;
+    if (poll(pfd, n, timeout) < 0 && errno != EINTR)
+      break;
+    if (pfd[0].revents)
+      break;
+    if (pfd[1].revents & POLLIN)
+      server_accept(srv);
+    if (pfd[2].revents & POLLIN)
+      server_reap(srv);
+    for (i = 3; i < n; i++) {
+      struct client *c = &srv->clients[idx[i - 3]];
+
+      if (!pfd[i].revents || c->fd < 0)
+        continue;
+      if (c->reply)
+        client_write(c);
+      else
+        client_read(srv, c);
+    }
+
+    if (now_ns() >= next) {
+      server_broadcast(srv);
+      next = now_ns() + SERVE_INTERVAL_MSEC * 1000000ULL;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Start serving the aggregates of a capture.
+ *
+ * @param cap The capture, with its snapshot and stats paths set.
+ * @param port The TCP port to listen on at 127.0.0.1.
+ * @return The running server, or NULL on error.
+ */
+static struct server *server_start(const struct capture *cap, int port) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  struct server *srv;
+  int i, one = 1;
+
+  if (!cap->snapshot) {
+    fprintf(stderr, "kbstats: nothing to serve without the snapshot\n");
+    return NULL;
+  }
+  srv = calloc(1, sizeof(*srv));
+  if (!srv) {
+    perror("kbstats: calloc");
+    return NULL;
+  }
+  srv->snapshot = cap->snapshot;
+  srv->stats_path = cap->stats_path;
+  srv->history_path = cap->history_path;
+  for (i = 0; i < SERVE_CLIENTS; i++)
+    srv->clients[i].fd = -1;
+
+  srv->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  srv->wakefd = eventfd(0, EFD_CLOEXEC);
+  srv->readyfd = eventfd(0, EFD_CLOEXEC);
+  if (srv->fd < 0 || srv->wakefd < 0 || srv->readyfd < 0 ||
+      setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+      bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(srv->fd, SERVE_CLIENTS)) {
+    fprintf(stderr, "kbstats: can't serve on 127.0.0.1:%d: %s\n", port,
+            strerror(errno));
+    goto error;
+  }
+  if (pthread_create(&srv->thread, NULL, serve, srv)) {
+    perror("kbstats: pthread_create");
+    goto error;
+  }
+
+  return srv;
+
+error:
+  if (srv->fd >= 0)
+    close(srv->fd);
+  if (srv->wakefd >= 0)
+    close(srv->wakefd);
+  if (srv->readyfd >= 0)
+    close(srv->readyfd);
+  free(srv);
+  return NULL;
+}
+
+static void server_stop(struct server *srv) {
+  int i;
+
+  if (!srv)
+    return;
+  write(srv->wakefd, &(uint64_t){1}, sizeof(uint64_t));
+  pthread_join(srv->thread, NULL);
+  for (i = 0; i < SERVE_CLIENTS; i++) {
+    struct client *c = &srv->clients[i];
+
+    if (__atomic_load_n(&c->query, __ATOMIC_RELAXED) != QUERY_NONE)
+      pthread_join(c->worker, NULL);
+    if (c->fd >= 0)
+      client_close(c);
+  }
+  close(srv->fd);
+  close(srv->wakefd);
+  close(srv->readyfd);
+  free(srv);
+}
+
+/**
+ * Refresh the memory accounting of a capture, and its RSS at most once a
+ * second. Cheap enough to run with every snapshot: the sizes are kept by the
+ * subsystems and only the lists of groups and slow words are walked.
+ */
+static void memory_update(struct capture *cap) {
+  struct mem_usage now[N_MEM] = {{0}};
+  const struct words *ws = &cap->words;
+  const struct rollups *r = &cap->rollups;
+  unsigned long long size, resident;
+  uint64_t head, ns = now_ns();
+  size_t g, n;
+  int i, k;
+  FILE *f;
+
+  if (cap->ring) {
+    head = __atomic_load_n(&cap->ring->head, __ATOMIC_RELAXED);
+    now[MEM_RING].reserved = sizeof(struct ring);
+    now[MEM_RING].used = offsetof(struct ring, slot) +
+                         (head - cap->ring->tail) * sizeof(*cap->ring->slot);
+  }
+  now[MEM_COUNTS].reserved = now[MEM_COUNTS].used =
+      sizeof(cap->shards.base) +
+      cap->shards.nknown * sizeof(struct kb_shard);
+  now[MEM_RECORDS].reserved = now[MEM_RECORDS].used =
+      N_WPM_WINDOWS * sizeof(struct max_deque);
+
+  if (ws->info) {
+    now[MEM_WORDS].reserved = 2 * SKETCH_LEN(ws->width) + sizeof(*ws->info) +
+                              ws->nslow * sizeof(struct slow_word);
+    now[MEM_WORDS].used = 2 * SKETCH_LEN(ws->width) + sizeof(*ws->info);
+    for (i = 0; i < (int)ws->nslow; i++) {
+      if (ws->info->slow[i].hash)
+        now[MEM_WORDS].used += sizeof(struct slow_word);
+    }
+  }
+
+  now[MEM_ROLLUPS].reserved = r->seg.alloc_len;
+  now[MEM_ROLLUPS].used =
+      r->seg.rows * (sizeof(int64_t) + ROLLUP_COUNTS * sizeof(uint32_t));
+  for (i = 0; i < r->nsealed; i++) {
+    now[MEM_ROLLUPS].reserved += r->sealed[i].len;
+    now[MEM_ROLLUPS].used += r->sealed[i].len;
+  }
+
+  if (cap->bigrams.table)
+    now[MEM_BIGRAMS].reserved = now[MEM_BIGRAMS].used =
+        sizeof(struct bigram_table);
+  now[MEM_DEBOUNCE].reserved = now[MEM_DEBOUNCE].used =
+      cap->debounce.nknown * sizeof(struct debounce_dev);
+
+  if (cap->groups)
+    now[MEM_GROUPS].reserved = now[MEM_GROUPS].used =
+        sizeof(*cap->groups) +
+        cap->groups->n * sizeof(struct device_group);
+
+  for (i = 0; cap->views && i < cap->views->n; i++) {
+    const struct metrics_result *res = &cap->views->view[i].res;
+
+    /* groups grow by doubling */
+    for (n = 1; n < res->ngroups; n *= 2)
+      ;
+    now[MEM_VIEWS].reserved += res->ngroups ? n * sizeof(*res->groups) : 0;
+    now[MEM_VIEWS].used += res->ngroups * sizeof(*res->groups);
+    for (g = 0; g < res->ngroups; g++) {
+      for (k = 0; k < METRICS_AGGS; k++) {
+        if (res->groups[g].hist[k]) {
+          now[MEM_VIEWS].reserved += HIST_BUCKETS * sizeof(uint32_t);
+          now[MEM_VIEWS].used += HIST_BUCKETS * sizeof(uint32_t);
+        }
+      }
+    }
+  }
+  if (cap->views) {
+    now[MEM_VIEWS].reserved += sizeof(struct views);
+    now[MEM_VIEWS].used += sizeof(struct views);
+  }
+
+  if (cap->server)
+    now[MEM_SERVER].reserved = now[MEM_SERVER].used = sizeof(struct server);
+
+  for (i = 0; i < N_MEM; i++) {
+    now[i].high = cap->mem[i].high > now[i].used ? cap->mem[i].high
+                                                 : now[i].used;
+    cap->mem[i] = now[i];
+  }
+
+  if (cap->rss_ns && ns - cap->rss_ns < 1000000000ULL)
+    return;
+  cap->rss_ns = ns;
+  f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return;
+  if (fscanf(f, "%llu %llu", &size, &resident) == 2) {
+    cap->rss = resident * sysconf(_SC_PAGESIZE);
+    if (cap->rss > cap->rss_high)
+      cap->rss_high = cap->rss;
+  }
+  fclose(f);
+}
+
+/**
+ * Print the memory accounting of a capture as a table.
+ */
+static void memory_report(FILE *f, const struct capture *cap) {
+  uint64_t reserved = 0, used = 0;
+  int i;
+
+  fprintf(f, "%-10s %12s %12s %12s\n", "memory", "reserved", "used", "high");
+  for (i = 0; i < N_MEM; i++) {
+    fprintf(f, "%-10s %12llu %12llu %12llu\n", mem_names[i],
+            (unsigned long long)cap->mem[i].reserved,
+            (unsigned long long)cap->mem[i].used,
+            (unsigned long long)cap->mem[i].high);
+    reserved += cap->mem[i].reserved;
+    used += cap->mem[i].used;
+  }
+  fprintf(f, "%-10s %12llu %12llu\n", "total", (unsigned long long)reserved,
+          (unsigned long long)used);
+  fprintf(f, "%-10s %12llu %12s %12llu\n", "rss",
+          (unsigned long long)cap->rss, "",
+          (unsigned long long)cap->rss_high);
+  if (cap->memory_budget)
+    fprintf(f, "%-10s %12llu\n", "budget",
+            (unsigned long long)cap->memory_budget);
+}
+
+static void latency_add(struct latency *lat, uint64_t ns) {
+  if (lat->n < lat->cap)
+    lat->ns[lat->n++] = ns;
+}
+
+/**
+ * Create the ring and its wake eventfd.
+ *
+ * @param cap The capture state; ring and wakefd are set on success.
+ * @return A memfd backing the ring, for handing to another process, or -1 on
+ * error.
+ */
+static int ring_create(struct capture *cap) {
+  void *p;
+  int memfd;
+
+  memfd = memfd_create("kbstats-ring", MFD_CLOEXEC);
+  if (memfd < 0 || ftruncate(memfd, sizeof(struct ring)) < 0) {
+    perror("kbstats: ring");
+    return -1;
+  }
+  p = mmap(NULL, sizeof(struct ring), PROT_READ | PROT_WRITE, MAP_SHARED,
+           memfd, 0);
+  cap->wakefd = eventfd(0, EFD_CLOEXEC);
+  if (p == MAP_FAILED || cap->wakefd < 0) {
+    perror("kbstats: ring");
+    close(memfd);
+    return -1;
+  }
+  cap->ring = p;
+
+  return memfd;
+}
+
+/**
+ * Describe a device the same way whatever port it is plugged into, by its
+ * bus, vendor, product and name. The debounce thresholds and key counts are
+ * kept under this, and the device cache checks it.
+ */
+static void device_identity(int fd, char *buf, size_t len) {
+  struct input_id id = {0};
+  char name[64] = "";
+
+  ioctl(fd, EVIOCGID, &id);
+  ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+  snprintf(buf, len, "%04x:%04x:%04x %s", id.bustype, id.vendor, id.product,
+           name);
+}
+
+/**
+ * Add an opened event device to the capture loop.
+ *
+ * @param cap The capture state.
+ * @param fd The file descriptor to the device.
+ * @return 0 on success or 1 otherwise.
+ */
+static int capture_add_device(struct capture *cap, int fd) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = cap->ndev};
+
+  if (cap->ndev == MAX_DEVICES) {
+    fprintf(stderr, "kbstats: too many devices (max %d)\n", MAX_DEVICES);
+    return 1;
+  }
+  if (epoll_ctl(cap->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("kbstats: epoll_ctl");
+    return 1;
+  }
+  device_identity(fd, cap->dev_id[cap->ndev], sizeof(cap->dev_id[cap->ndev]));
+  cap->fds[cap->ndev++] = fd;
+
+  return 0;
+}
+
+/**
+ * Leave out the key events the kernel reported as incomplete: after a
+ * SYN_DROPPED, everything up to and including the next SYN_REPORT, which may
+ * come in a later read.
+ *
+ * @param ev The events read.
+ * @param n The number of events.
+ * @param keys Indices of the key events in ev, filtered in place.
+ * @param nkeys The number of key events.
+ * @return The number of key events left.
+ */
+static int resync_keys(struct capture *cap, int dev,
+                       const struct input_event *ev, int n, uint16_t *keys,
+                       int nkeys) {
+  int i, j = 0, kept = 0;
+
+  if (!cap->resyncing[dev]) {
+    for (i = 0; i < n; i++) {
+      if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED)
+        break;
+    }
+    if (i == n)
+      return nkeys;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) {
+      PROBE(resync, dev);
+      cap->resyncing[dev] = 1;
+    }
+    if (j < nkeys && keys[j] == i) {
+      if (!cap->resyncing[dev])
+        keys[kept++] = i;
+      j++;
+    }
+    if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT)
+      cap->resyncing[dev] = 0;
+  }
+  return kept;
+}
+
+/**
+ * Read one batch from a device and pack its key events straight into the
+ * free slots of the ring. If the aggregator has fallen a whole ring behind,
+ * the overflow is counted and dropped rather than stalling the device.
+ *
+ * @param cap The capture state.
+ * @param dev Index of the device in cap->fds.
+ * @return 0 on success or 1 on a read error.
+ */
+static int read_device(struct capture *cap, int dev) {
+  struct input_event event[64];
+  uint16_t keys[64];
+  struct ring *ring = cap->ring;
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  uint64_t t_read, t;
+  int j, n, rd, nkeys, room, run;
+
+  rd = read(cap->fds[dev], event, sizeof(event));
+  t_read = now_ns();
+
+  if (rd < (int)sizeof(struct input_event)) {
+    printf("expected %d bytes, got %d\n", (int)sizeof(struct input_event), rd);
+    perror("\nevtest: error reading");
+    return 1;
+  }
+
+  if (!ring->first_event_us && cap->start_ns)
+    __atomic_store_n(&ring->first_event_us, (t_read - cap->start_ns) / 1000,
+                     __ATOMIC_RELAXED);
+
+  n = rd / sizeof(struct input_event);
+  PROBE(read_batch, dev, n, t_read);
+  nkeys = simd->key_filter(event, n, keys);
+  nkeys = resync_keys(cap, dev, event, n, keys, nkeys);
+  PROBE(decode, dev, n, nkeys);
+  if (!nkeys)
+    return 0;
+
+  if (!ring->epoch_us) {
+    t = (uint64_t)event[keys[0]].input_event_sec * 1000000 +
+        event[keys[0]].input_event_usec;
+    ring->epoch_us = t > RING_EPOCH_SLACK_US ? t - RING_EPOCH_SLACK_US : 1;
+  }
+
+  room = RING_SLOTS - (head - tail);
+  if (nkeys > room) {
+    __atomic_store_n(&ring->dropped, ring->dropped + nkeys - room,
+                     __ATOMIC_RELAXED);
+    nkeys = room;
+  }
+  /* packed straight into the free slots, in two runs if they wrap */
+  run = RING_SLOTS - head % RING_SLOTS;
+  if (run > nkeys)
+    run = nkeys;
+  simd->key_pack(event, keys, run, ring->epoch_us, dev,
+                 &ring->slot[head % RING_SLOTS]);
+  simd->key_pack(event, keys + run, nkeys - run, ring->epoch_us, dev,
+                 ring->slot);
+  /* epoch_us too, the first time */
+  __atomic_store_n(&ring->head, head + nkeys, __ATOMIC_RELEASE);
+
+  for (j = 0; cap->read_lat && j < nkeys; j++) {
+    const struct input_event *ev = &event[keys[j]];
+
+    t = (uint64_t)ev->input_event_sec * 1000000 + ev->input_event_usec;
+    if (ev->value == 1)
+      latency_add(cap->read_lat, t_read - t * 1000);
+  }
+
+  return 0;
+}
+
+/**
+ * Wake the aggregator if it is sleeping. Called once per batch of reads.
+ */
+static void ring_wake(struct capture *cap) {
+  uint64_t one = 1;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&cap->ring->waiting, __ATOMIC_RELAXED) &&
+      write(cap->wakefd, &one, sizeof(one)) < 0)
+    perror("kbstats: eventfd");
+}
+
+/*
+ * Statistics stages. Each enabled stage sees every key press and every word,
+ * in the order below; --stages picks which ones run. Before that, a stage
+ * with a filter sees every key event, presses or not, and can drop it.
+ *
+ * handle_record() calls the stages directly. Built with -DSTAGES=MASK, for
+ * example -DSTAGES='STAGE_BIT(COUNTS)|STAGE_BIT(RECORDS)', the pipeline is
+ * specialised: STAGE_ON() is a constant, so the chosen stages are inlined
+ * with no check per event and the rest are left out, and --stages is
+ * refused. --bench times the pipeline of either kind of build.
+ */
+enum stage_id {
+  STAGE_DEBOUNCE,
+  STAGE_COUNTS,
+  STAGE_RECORDS,
+  STAGE_WORDS,
+  STAGE_ROLLUPS,
+  STAGE_BIGRAMS,
+  STAGE_LAYOUT,
+  N_STAGES
+};
+
+static const char *const stage_names[N_STAGES] = {
+    "debounce", "counts", "records", "words", "rollups", "bigrams", "layout"};
+
+#define STAGE_BIT(s) (1u << STAGE_##s)
+#define ALL_STAGES ((1u << N_STAGES) - 1)
+
+#ifdef STAGES
+#define STAGE_ON(cap, i) ((STAGES) >> (i) & 1)
+#else
+#define STAGE_ON(cap, i) ((cap)->stages >> (i) & 1)
+#endif
+
+/* Run a stage's callback if the stage is on, between its USDT probes. */
+#define STAGE_RUN(cap, i, call)                                               \
+  do {                                                                         \
+    if (STAGE_ON(cap, i)) {                                                    \
+      PROBE(stage_enter, stage_names[i]);                                      \
+      call;                                                                    \
+      PROBE(stage_exit, stage_names[i]);                                       \
+    }                                                                          \
+  } while (0)
+
+static int debounce_stage_filter(struct capture *cap,
+                                 const struct key_record *rec) {
+  return debounce_key(&cap->debounce, rec,
+                      rec->dev < MAX_DEVICES ? cap->dev_id[rec->dev] : "");
+}
+
+/* The shard of key counts for the device a record came from. */
+static struct kb_stats *capture_counts(struct capture *cap,
+                                       const struct key_record *rec) {
+  return kb_shard(&cap->shards, rec,
+                  rec->dev < MAX_DEVICES ? cap->dev_id[rec->dev] : "");
+}
+
+static void counts_stage_key(struct capture *cap,
+                             const struct key_record *rec) {
+  capture_counts(cap, rec)->presses[rec->code]++;
+}
+
+static void records_stage_key(struct capture *cap,
+                              const struct key_record *rec) {
+  records_key(&cap->records, rec);
+}
+
+static void records_stage_word(struct capture *cap, const struct word *w) {
+  records_word(&cap->records, w);
+}
+
+static void words_stage_word(struct capture *cap, const struct word *w) {
+  words_word(&cap->words, w);
+}
+
+static void rollups_stage_key(struct capture *cap,
+                              const struct key_record *rec) {
+  struct rollup closed;
+
+  if (rollups_key(&cap->rollups, rec, &closed) && cap->views)
+    views_minute(cap->views, &closed);
+}
+
+static void rollups_stage_word(struct capture *cap, const struct word *w) {
+  rollups_word(&cap->rollups, w);
+}
+
+static void bigrams_stage_key(struct capture *cap,
+                              const struct key_record *rec) {
+  bigrams_key(&cap->bigrams, rec);
+}
+
+static void layout_stage_key(struct capture *cap,
+                             const struct key_record *rec) {
+  layout_key(&cap->layout, rec);
+}
+
+/**
+ * Parse a comma-separated list of stage names.
+ *
+ * @param list The list, e.g. "counts,records".
+ * @return A bitmask of the named stages, or 0 if a name is unknown.
+ */
+static unsigned int parse_stages(const char *list) {
+  unsigned int mask = 0;
+  const char *p = list;
+  int i;
+
+  while (*p) {
+    size_t len = strcspn(p, ",");
+
+    for (i = 0; i < N_STAGES; i++) {
+      if (strlen(stage_names[i]) == len &&
+          strncmp(stage_names[i], p, len) == 0)
+        break;
+    }
+    if (i == N_STAGES) {
+      fprintf(stderr, "kbstats: unknown stage %.*s\n", (int)len, p);
+      return 0;
+    }
+    mask |= 1u << i;
+    p += len + (p[len] == ',');
+  }
+  return mask;
+}
+
+/**
+ * Fold one key event into the running totals and, unless the capture is
+ * quiet, print the key.
+ */
+static void handle_record(struct capture *cap, const struct key_record *rec) {
+  struct kb_stats *counts = capture_counts(cap, rec);
+  int drop = 0;
+
+  counts->events++;
+  STAGE_RUN(cap, STAGE_DEBOUNCE, drop = debounce_stage_filter(cap, rec));
+  if (drop)
+    return;
+  if (rec->value == 1 && rec->code < KEY_CNT) {
+    counts->keystrokes++;
+    cap->dirty = 1;
+    STAGE_RUN(cap, STAGE_COUNTS, counts_stage_key(cap, rec));
+    STAGE_RUN(cap, STAGE_RECORDS, records_stage_key(cap, rec));
+    STAGE_RUN(cap, STAGE_ROLLUPS, rollups_stage_key(cap, rec));
+    STAGE_RUN(cap, STAGE_BIGRAMS, bigrams_stage_key(cap, rec));
+    STAGE_RUN(cap, STAGE_LAYOUT, layout_stage_key(cap, rec));
+    if (word_key(&cap->word, rec, &cap->layout)) {
+      STAGE_RUN(cap, STAGE_RECORDS, records_stage_word(cap, &cap->word));
+      STAGE_RUN(cap, STAGE_WORDS, words_stage_word(cap, &cap->word));
+      STAGE_RUN(cap, STAGE_ROLLUPS, rollups_stage_word(cap, &cap->word));
+      cap->word.len = 0;
+    }
+  }
+
+  if (cap->quiet)
+    return;
+
+  const char *code_name = codename(EV_KEY, rec->code);
+
+  // create malloced code_name
+  // and ptr to code_name_dup (to_free) to use in strtok
+  char *to_free;
+  char *code_name_dup = strdup(code_name);
+  to_free = code_name_dup;
+
+  // if code_name !contains "?"
+  if (strstr(code_name, "?") == NULL) {
+    char *prefix = strtok(code_name_dup, "_");
+    char *raw_delimited_key = strtok(NULL, "_");
+    printf("%s\n", raw_delimited_key);
+  }
+
+  free(code_name_dup);
+}
+
+/*
+ * The merge of a device group, see "Device groups" above: a binary min-heap
+ * of the events waiting, by kernel timestamp.
+ */
+static void merge_pop(struct capture *cap, struct device_group *g) {
+  struct key_record rec = g->heap[0].rec;
+  struct held last = g->heap[--g->n];
+  int i = 0, c;
+
+  while ((c = 2 * i + 1) < g->n) {
+    if (c + 1 < g->n &&
+        g->heap[c + 1].rec.time_us < g->heap[c].rec.time_us)
+      c++;
+    if (last.rec.time_us <= g->heap[c].rec.time_us)
+      break;
+    g->heap[i] = g->heap[c];
+    i = c;
+  }
+  g->heap[i] = last;
+
+  if (rec.time_us > g->passed_us)
+    g->passed_us = rec.time_us;
+  handle_record(cap, &rec);
+}
+
+/**
+ * Pass on the events of a group that have waited long enough, or all of
+ * them if all is set.
+ */
+static void merge_flush(struct capture *cap, struct device_group *g,
+                        uint64_t now, int all) {
+  while (g->n && (all || g->heap[0].rec.time_us + MERGE_WINDOW_US <=
+                             g->newest_us ||
+                  now - g->heap[0].since_ns >= MERGE_WINDOW_US * 1000ULL))
+    merge_pop(cap, g);
+}
+
+/**
+ * Hand a record to the statistics, through the merge of its device's group
+ * if it has one.
+ */
+static void merge_record(struct capture *cap, const struct key_record *rec,
+                         uint64_t now) {
+  struct device_group *g = group_of(cap->groups, rec->dev,
+                             rec->dev < MAX_DEVICES ? cap->dev_id[rec->dev]
+                                                    : "");
+  int i, p;
+
+  if (!g || rec->time_us < g->passed_us) {
+    handle_record(cap, rec);
+    return;
+  }
+  if (g->n == MERGE_SLOTS)
+    merge_pop(cap, g);
+
+  for (i = g->n++; i > 0; i = p) {
+    p = (i - 1) / 2;
+    if (g->heap[p].rec.time_us <= rec->time_us)
+      break;
+    g->heap[i] = g->heap[p];
+  }
+  g->heap[i].rec = *rec;
+  g->heap[i].since_ns = now;
+  if (rec->time_us > g->newest_us)
+    g->newest_us = rec->time_us;
+  merge_flush(cap, g, now, 0);
+}
+
+/**
+ * Pass on the events of every group that have waited long enough, or all of
+ * them if all is set.
+ */
+static void merge_flush_groups(struct capture *cap, int all) {
+  struct device_groups *gs = cap->groups;
+  uint64_t now = now_ns();
+  int i;
+
+  for (i = 0; gs && i < gs->n; i++)
+    merge_flush(cap, gs->group[i], now, all);
+}
+
+/**
+ * How long to sleep at most so that no event waits in a group for much more
+ * than MERGE_WINDOW_US.
+ *
+ * @return The timeout in ms, or -1 if no event is waiting.
+ */
+static int merge_timeout(const struct capture *cap) {
+  const struct device_groups *gs = cap->groups;
+  uint64_t now = now_ns(), due, next = UINT64_MAX;
+  int i;
+
+  for (i = 0; gs && i < gs->n; i++) {
+    if (!gs->group[i]->n)
+      continue;
+    due = gs->group[i]->heap[0].since_ns + MERGE_WINDOW_US * 1000ULL;
+    if (due < next)
+      next = due;
+  }
+  if (next == UINT64_MAX)
+    return -1;
+  return next > now ? (next - now + 999999) / 1000000 : 0;
+}
+
+/**
+ * Aggregate everything currently in the ring, in place, and publish the new
+ * totals.
+ */
+static void drain_ring(struct capture *cap) {
+  struct ring *ring = cap->ring;
+  uint64_t tail = ring->tail;
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t i, t_publish, now;
+  struct key_record rec;
+
+  if (tail == head) {
+    /* events of a group may have waited long enough */
+    if (cap->groups) {
+      merge_flush_groups(cap, 0);
+      snapshot_publish(cap);
+    }
+    return;
+  }
+
+  now = cap->groups ? now_ns() : 0;
+  for (i = tail; i != head; i++) {
+    key_unpack(ring->slot[i % RING_SLOTS], ring->epoch_us, &rec);
+    merge_record(cap, &rec, now);
+  }
+  if (cap->groups)
+    merge_flush_groups(cap, 0);
+
+  memory_update(cap);
+  snapshot_publish(cap);
+
+  if (cap->publish_lat) {
+    t_publish = now_ns();
+    for (i = tail; i != head; i++) {
+      key_unpack(ring->slot[i % RING_SLOTS], ring->epoch_us, &rec);
+      if (rec.value == 1)
+        latency_add(cap->publish_lat, t_publish - rec.time_us * 1000);
+    }
+  }
+
+  __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+  /* a flush the writer failed is due again, as one failed on the spot */
+  if (cap->persister &&
+      __atomic_exchange_n(&cap->persister->retry, 0, __ATOMIC_RELAXED)) {
+    cap->dirty = 1;
+    cap->flushed_ns = 0;
+  }
+  if (cap->dirty &&
+      (now_ns() - cap->flushed_ns >= STATS_FLUSH_SEC * 1000000000ULL ||
+       rollups_full(&cap->rollups)))
+    stats_save(cap);
+}
+
+/**
+ * Aggregator loop of a privilege separated capture: sleep until the reader
+ * signals new records, then drain the ring.
+ *
+ * @param cap The capture state, with ring, wakefd and peer set.
+ * @return 0 on success or 1 otherwise.
+ */
+static int aggregate_events(struct capture *cap) {
+  struct ring *ring = cap->ring;
+  struct pollfd pfd[2] = {{.fd = cap->wakefd, .events = POLLIN},
+                          {.fd = cap->peer, .events = POLLIN}};
+  uint64_t count;
+
+  while (!stop) {
+    drain_ring(cap);
+
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+      __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    if (poll(pfd, 2, merge_timeout(cap)) < 0 && errno != EINTR) {
+      perror("kbstats: poll");
+      return 1;
+    }
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    if (pfd[0].revents & POLLIN)
+      read(cap->wakefd, &count, sizeof(count));
+    if (pfd[1].revents)
+      break; /* the reader is gone */
+  }
+
+  archiver_stop(cap->archiver);
+  server_stop(cap->server);
+  persister_stop(cap);
+  drain_ring(cap);
+  merge_flush_groups(cap, 1);
+  return aggregator_finish(cap);
+}
+
+/**
+ * Print device events as they come in. This is the reader loop; without a
+ * peer process it also aggregates each batch itself.
+ *
+ * @param cap The capture state, with at least one device added.
+ * @return 0 on success or 1 otherwise.
+ */
+static int print_events(struct capture *cap) {
+  struct epoll_event ready[MAX_DEVICES + 1];
+  uint64_t events, keystrokes;
+  int i, n, timeout, merging;
+
+  while (!stop) {
+    /* without a peer, the merge of device groups waits here too */
+    timeout = cap->peer < 0 ? merge_timeout(cap) : -1;
+    merging = timeout >= 0 &&
+              (cap->idle_msec < 0 || timeout < cap->idle_msec);
+    n = epoll_wait(cap->epfd, ready, MAX_DEVICES + 1,
+                   merging ? timeout : cap->idle_msec);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("\nkbstats: epoll_wait");
+      return 1;
+    }
+    if (n == 0 && merging) {
+      drain_ring(cap);
+      continue;
+    }
+    if (n == 0)
+      break;
+
+    for (i = 0; i < n; i++) {
+      if (ready[i].data.u32 == MAX_DEVICES)
+        stop = 1; /* the aggregator is gone */
+      else if (read_device(cap, ready[i].data.u32))
+        return 1;
+    }
+
+    if (cap->peer < 0)
+      drain_ring(cap);
+    else
+      ring_wake(cap);
+
+    if (cap->expect) {
+      kb_totals(&cap->shards, &events, &keystrokes);
+      if (keystrokes >= cap->expect)
+        break;
+    }
+  }
+
+  for (i = 0; i < cap->ndev; i++)
+    ioctl(cap->fds[i], EVIOCGRAB, (void *)0);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Privilege separation. When started as root, capture forks an aggregator
+ * that drops to the invoking user (or nobody) before it sees any key data;
+ * the root process only reads devices into the ring. The ring and its
+ * eventfd are passed over a socketpair, which also tells each side when the
+ * other has exited.
+ */
+static int send_fds(int sock, const int *fds, int n) {
+  char buf[CMSG_SPACE(2 * sizeof(int))] = {0};
+  char byte = 0;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = buf,
+                       .msg_controllen = CMSG_SPACE(n * sizeof(int))};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+  return sendmsg(sock, &msg, 0) == 1 ? 0 : 1;
+}
+
+static int recv_fds(int sock, int *fds, int n) {
+  char buf[CMSG_SPACE(2 * sizeof(int))];
+  char byte;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = buf,
+                       .msg_controllen = CMSG_SPACE(n * sizeof(int))};
+  struct cmsghdr *cmsg;
+
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+    return 1;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(n * sizeof(int)))
+    return 1;
+  memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+
+  return 0;
+}
+
+/**
+ * Switch to the user that ran sudo, or to nobody, for good.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int drop_privileges(void) {
+  const char *sudo_uid = getenv("SUDO_UID");
+  const char *sudo_gid = getenv("SUDO_GID");
+  uid_t uid;
+  gid_t gid;
+
+  if (sudo_uid && sudo_gid) {
+    uid = strtoul(sudo_uid, NULL, 10);
+    gid = strtoul(sudo_gid, NULL, 10);
+  } else {
+    struct passwd *pw = getpwnam("nobody");
+    if (!pw) {
+      fprintf(stderr, "kbstats: no user to drop privileges to\n");
+      return 1;
+    }
+    uid = pw->pw_uid;
+    gid = pw->pw_gid;
+  }
+
+  if (setgroups(0, NULL) || setgid(gid) || setuid(uid)) {
+    perror("kbstats: dropping privileges");
+    return 1;
+  }
+  if (uid != 0 && setuid(0) == 0) {
+    fprintf(stderr, "kbstats: privileges could be regained\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Body of the aggregator process: let go of the devices inherited from the
+ * reader, drop root, then map the ring sent over sock and aggregate from it.
+ */
+static int run_aggregator(struct capture *cap, int sock) {
+  int i, fds[2];
+  void *p;
+
+  for (i = 0; i < cap->ndev; i++)
+    close(cap->fds[i]);
+  close(cap->epfd);
+
+  /* the snapshot may still be owned by root from an earlier run */
+  cap->snapshot = snapshot_open(SNAPSHOT_NAME);
+
+  if (drop_privileges() || aggregator_init(cap, 1) || recv_fds(sock, fds, 2)) {
+    fprintf(stderr, "kbstats: aggregator failed to start\n");
+    return EXIT_FAILURE;
+  }
+  if (serve_port) {
+    cap->server = server_start(cap, serve_port);
+    if (!cap->server)
+      return EXIT_FAILURE;
+  }
+  cap->archiver = archiver_start(cap);
+  cap->persister = persister_start(cap);
+
+  p = mmap(NULL, sizeof(struct ring), PROT_READ | PROT_WRITE, MAP_SHARED,
+           fds[0], 0);
+  close(fds[0]);
+  if (p == MAP_FAILED) {
+    perror("kbstats: ring");
+    return EXIT_FAILURE;
+  }
+  cap->ring = p;
+  cap->wakefd = fds[1];
+  cap->peer = sock;
+
+  return aggregate_events(cap);
+}
+
+/**
+ * Fork the unprivileged aggregator and hand it the ring.
+ *
+ * @param cap The capture state, with its devices added.
+ * @return The aggregator's pid, or -1 on error.
+ */
+static pid_t start_aggregator(struct capture *cap) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = MAX_DEVICES};
+  int sv[2], fds[2];
+  pid_t pid;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+    perror("kbstats: socketpair");
+    return -1;
+  }
+
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) {
+    perror("kbstats: fork");
+    return -1;
+  }
+  if (pid == 0) {
+    close(sv[0]);
+    exit(run_aggregator(cap, sv[1]));
+  }
+  close(sv[1]);
+
+  fds[0] = ring_create(cap);
+  fds[1] = cap->wakefd;
+  if (fds[0] < 0 || send_fds(sv[0], fds, 2) ||
+      epoll_ctl(cap->epfd, EPOLL_CTL_ADD, sv[0], &ev)) {
+    fprintf(stderr, "kbstats: can't hand the ring to the aggregator\n");
+    close(sv[0]);
+    return -1;
+  }
+  close(fds[0]);
+  cap->peer = sv[0];
+
+  return pid;
+}
+
+/**
+ * Grab and immediately ungrab the device.
+ *
+ * @param fd The file descriptor to the device.
+ * @return 0 if the grab was successful, or 1 otherwise.
+ */
+static int test_grab(int fd, int grab_flag) {
+  int rc;
+
+  rc = ioctl(fd, EVIOCGRAB, (void *)1);
+
+  if (rc == 0 && !grab_flag)
+    ioctl(fd, EVIOCGRAB, (void *)0);
+
+  return rc;
+}
+
+/*
+ * Startup. A capture normally prints the details of its device and checks
+ * that nothing else has grabbed it before it reads a single event. With
+ * --fast-start and no device given, it opens the devices of the last run
+ * from the device cache, STATS.devices, which lists each one's path and
+ * identity, and starts reading at once; the details, the grab check and
+ * rewriting the cache are left to a thread started once the capture is
+ * running. A cached path that now holds another device is skipped, and if
+ * none is left the devices are scanned as usual. How long the first event
+ * took is in the snapshot, and --loopback reports it.
+ */
+struct startup {
+  struct capture *cap;
+  char *paths[MAX_DEVICES]; /* of cap->fds */
+  int grab;
+};
+
+/**
+ * Work out where the device cache lives, next to the stats file.
+ *
+ * @return The path, to be freed by the caller, or NULL on error.
+ */
+static char *device_cache_path(void) {
+  char *stats = stats_file ? strdup(stats_file) : default_stats_path();
+  char *path = NULL;
+
+  if (stats)
+    asprintf(&path, "%s.devices", stats);
+  free(stats);
+
+  return path;
+}
+
+/**
+ * Open and add the devices in the device cache that are still there.
+ *
+ * @return The number of devices added.
+ */
+static int device_cache_open(struct startup *st) {
+  struct capture *cap = st->cap;
+  char line[PATH_MAX + DEVICE_ID_MAX + 2], id[DEVICE_ID_MAX], *tab;
+  char *path = device_cache_path();
+  FILE *f = path ? fopen(path, "r") : NULL;
+  int fd;
+
+  free(path);
+  if (!f)
+    return 0;
+
+  while (cap->ndev < MAX_DEVICES && fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    tab = strchr(line, '\t');
+    if (!tab)
+      continue;
+    *tab++ = '\0';
+    if ((fd = open(line, O_RDONLY)) < 0)
+      continue;
+    device_identity(fd, id, sizeof(id));
+    if (strcmp(id, tab) != 0) {
+      fprintf(stderr, "kbstats: %s is no longer \"%s\", skipped\n", line,
+              tab);
+      close(fd);
+      continue;
+    }
+    if (capture_add_device(cap, fd)) {
+      close(fd);
+      break;
+    }
+    st->paths[cap->ndev - 1] = strdup(line);
+  }
+  fclose(f);
+
+  return cap->ndev;
+}
+
+/**
+ * Replace the device cache with the devices being captured.
+ */
+static void device_cache_save(const struct startup *st) {
+  const struct capture *cap = st->cap;
+  char *path = device_cache_path(), *tmp = NULL;
+  FILE *f;
+  int i, err;
+
+  if (path)
+    asprintf(&tmp, "%s.tmp", path);
+  f = tmp ? fopen(tmp, "w") : NULL;
+  if (!f) {
+    free(path);
+    free(tmp);
+    return;
+  }
+
+  for (i = 0; i < cap->ndev; i++) {
+    if (st->paths[i])
+      fprintf(f, "%s\t%s\n", st->paths[i], cap->dev_id[i]);
+  }
+  err = fclose(f);
+  if (err || rename(tmp, path)) {
+    perror("kbstats: saving the device cache");
+    unlink(tmp);
+  }
+  free(path);
+  free(tmp);
+}
+
+/**
+ * Print the details of the devices, warn about any grabbed by another
+ * process, and remember them in the device cache.
+ *
+ * @return 0 on success or 1 if a device can't be queried.
+ */
+static int startup_probe(struct startup *st) {
+  struct capture *cap = st->cap;
+  int i;
+
+  for (i = 0; i < cap->ndev; i++) {
+    if (print_device_info(cap->fds[i]))
+      return 1;
+  }
+
+  printf("Testing ... (interrupt to exit)\n");
+
+  for (i = 0; i < cap->ndev; i++) {
+    if (!test_grab(cap->fds[i], st->grab))
+      continue;
+    printf("***********************************************\n");
+    printf("  This device is grabbed by another process.\n");
+    printf("  No events are available to evtest while the\n"
+           "  other grab is active.\n");
+    printf("  In most cases, this is caused by an X driver,\n"
+           "  try VT-switching and re-run evtest again.\n");
+    printf("  Run the following command to see processes with\n"
+           "  an open fd on this device\n"
+           " \"fuser -v %s\"\n",
+           st->paths[i]);
+    printf("***********************************************\n");
+  }
+
+  device_cache_save(st);
+  return 0;
+}
+
+static void *startup_thread(void *arg) {
+  startup_probe(arg);
+  return NULL;
+}
+
+/**
+ * Enter capture mode. The requested event device will be monitored, and any
+ * captured events will be decoded and printed on the console.
+ *
+ * @param device The device to monitor, or NULL if the user should be prompted
+ * (or, with --fast-start, the cached devices used).
+ * @return 0 on success, non-zero on error.
+ */
+static int do_capture(const char *device, int grab_flag) {
+  int fd;
+  char *filename = NULL;
+  struct capture cap = {.idle_msec = -1, .peer = -1};
+  struct startup st = {.cap = &cap, .grab = grab_flag};
+  pthread_t prober;
+  pid_t aggregator = 0;
+  int i, rc, probing = 0;
+
+  cap.start_ns = now_ns();
+  cap.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (cap.epfd < 0) {
+    perror("kbstats: epoll_create1");
+    return EXIT_FAILURE;
+  }
+
+  if (!device && fast_start_flag)
+    device_cache_open(&st);
+
+  if (cap.ndev == 0) {
+    if (!device) {
+      fprintf(stderr, "No device specified, trying to scan all of %s/%s*\n",
+              DEV_INPUT_EVENT, EVENT_DEV_NAME);
+
+      if (getuid() != 0)
+        fprintf(stderr,
+                "Not running as root, no devices may be available.\n");
+
+      filename = scan_devices();
+      if (!filename)
+        return usage();
+    } else {
+      filename = strdup(device);
+    }
+
+    if (!filename)
+      return EXIT_FAILURE;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+      perror("evtest");
+      if (errno == EACCES && getuid() != 0)
+        fprintf(stderr,
+                "You do not have access to %s. Try "
+                "running as root instead.\n",
+                filename);
+      goto error;
+    }
+    if (capture_add_device(&cap, fd)) {
+      close(fd);
+      goto error;
+    }
+    st.paths[0] = filename;
+    filename = NULL;
+  }
+
+  if (!isatty(fileno(stdout)))
+    setbuf(stdout, NULL);
+
+  if (!fast_start_flag && startup_probe(&st))
+    goto error;
+
+  signal(SIGINT, interrupt_handler);
+  signal(SIGTERM, interrupt_handler);
+
+  if (privsep_flag && geteuid() == 0) {
+    aggregator = start_aggregator(&cap);
+    if (aggregator < 0)
+      goto error;
+  } else {
+    if (ring_create(&cap) < 0 || aggregator_init(&cap, 1))
+      goto error;
+    cap.snapshot = snapshot_open(SNAPSHOT_NAME);
+    if (serve_port &&
+        !(cap.server = server_start(&cap, serve_port)))
+      goto error;
+    cap.archiver = archiver_start(&cap);
+    cap.persister = persister_start(&cap);
+  }
+
+  /* after the fork, which only takes the calling thread along */
+  if (fast_start_flag) {
+    probing = !pthread_create(&prober, NULL, startup_thread, &st);
+    if (!probing)
+      startup_probe(&st);
+  }
+
+  rc = print_events(&cap);
+  if (probing)
+    pthread_join(prober, NULL);
+  if (aggregator > 0) {
+    close(cap.peer);
+    waitpid(aggregator, NULL, 0);
+  } else {
+    archiver_stop(cap.archiver);
+    server_stop(cap.server);
+    persister_stop(&cap);
+    merge_flush_groups(&cap, 1);
+    rc |= aggregator_finish(&cap);
+  }
+  for (i = 0; i < cap.ndev; i++)
+    free(st.paths[i]);
+  return rc;
+
+error:
+  free(filename);
+  for (i = 0; i < cap.ndev; i++)
+    free(st.paths[i]);
+  return EXIT_FAILURE;
+}
+
+/**
+ * Print the personal records kept in the stats file.
+ *
+ * @return 0 on success or 1 if the stats file can't be read.
+ */
+static int do_records(void) {
+  struct capture cap = {.peer = -1};
+  char when[32];
+  int i;
+
+  if (aggregator_init(&cap, 1) || !cap.stats_path)
+    return EXIT_FAILURE;
+
+  printf("Personal records in %s:\n", cap.stats_path);
+  for (i = 0; i < REC_COUNT; i++) {
+    const struct personal_record *pr = &cap.records.best[i];
+    time_t t = pr->time;
+
+    if (!pr->time) {
+      printf("  %-26s        -\n", record_names[i]);
+      continue;
+    }
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+    printf("  %-26s %8.*f  %s", record_names[i], i == REC_STREAK ? 0 : 1,
+           pr->value, when);
+    if (i == REC_WORD)
+      printf("  (%u letters)", pr->detail);
+    printf("\n");
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Print the slowest frequently typed words kept in the stats file.
+ *
+ * @return 0 on success or 1 if the stats file can't be read.
+ */
+static int do_words(void) {
+  struct capture cap = {.peer = -1};
+  struct slow_word *slow;
+  uint32_t i;
+
+  if (aggregator_init(&cap, 1) || !cap.stats_path)
+    return EXIT_FAILURE;
+
+  slow = cap.words.info->slow;
+  qsort(slow, cap.words.nslow, sizeof(*slow), cmp_slow_word);
+
+  printf("Slowest words typed at least %d times, in %s:\n",
+         SLOW_WORD_MIN_COUNT, cap.stats_path);
+  for (i = 0; i < cap.words.nslow && slow[i].hash; i++) {
+    printf("  %6.1f ms/letter  %6u times  ", slow[i].us_per_letter / 1e3,
+           slow[i].count);
+    if (slow[i].text[0])
+      printf("%s\n", slow[i].text);
+    else
+      printf("#%08x (%u letters)\n", (unsigned int)(slow[i].hash >> 32),
+             slow[i].len);
+  }
+  if (i == 0)
+    printf("  none yet\n");
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Answer a metrics query from the command line.
+ *
+ * @param text The query.
+ * @return 0 on success or 1 otherwise.
+ */
+static int do_metrics(const char *text) {
+  struct capture cap = {.peer = -1};
+  struct metrics_query q;
+  struct metrics_result *r;
+  uint64_t start = now_ns();
+
+  if (metrics_parse(text, &q)) {
+    fprintf(stderr, "kbstats: bad query: %s\n", q.error);
+    return EXIT_FAILURE;
+  }
+  if (aggregator_init(&cap, 1) || !cap.stats_path)
+    return EXIT_FAILURE;
+  r = metrics_run(&q, cap.stats_path, cap.history_path, 0);
+  if (!r) {
+    fprintf(stderr, "kbstats: can't read %s\n", cap.history_path);
+    return EXIT_FAILURE;
+  }
+
+  metrics_print(&q, r, stdout, 0);
+  fprintf(stderr, "(%llu minutes in %.1f ms)\n", (unsigned long long)r->rows,
+          (now_ns() - start) / 1e6);
+  metrics_free(r);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Print the views named in the config file.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int do_views(void) {
+  struct capture cap = {.peer = -1};
+  int i;
+
+  if (aggregator_init(&cap, 1) || !cap.stats_path)
+    return EXIT_FAILURE;
+  if (!cap.views) {
+    printf("No views; add lines like \"view NAME = QUERY\" to the config "
+           "file.\n");
+    return EXIT_SUCCESS;
+  }
+
+  for (i = 0; i < cap.views->n; i++) {
+    struct view *v = &cap.views->view[i];
+
+    qsort(v->res.groups, v->res.ngroups, sizeof(*v->res.groups), cmp_group);
+    printf("%s%s = %s\n", i ? "\n" : "", v->name, v->text);
+    metrics_print(&v->q, &v->res, stdout, 0);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Migrate and archive the old history now rather than waiting for capture
+ * mode to.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int do_archive(void) {
+  struct capture cap = {.peer = -1};
+#if HAVE_ZSTD
+  struct archive_stats st;
+#endif
+  uint32_t migrated;
+
+  if (aggregator_init(&cap, 1) || !cap.history_path ||
+      history_migrate(cap.history_path, &migrated))
+    return EXIT_FAILURE;
+  if (migrated)
+    printf("Migrated %u blocks of %s to the latest layout.\n", migrated,
+           cap.history_path);
+#if HAVE_ZSTD
+  if (history_compact(cap.history_path, &st))
+    return EXIT_FAILURE;
+  if (st.blocks)
+    archive_report(stdout, cap.history_path, &st);
+  else
+    printf("Fewer than %d blocks of %s are older than %d days.\n",
+           ARCHIVE_MIN_BLOCKS, cap.history_path, ARCHIVE_AFTER_DAYS);
+  return EXIT_SUCCESS;
+#else
+  fprintf(stderr, "kbstats: built without zstd support "
+                  "(rebuild with -DHAVE_ZSTD -lzstd)\n");
+  return EXIT_FAILURE;
+#endif
+}
+
+/*
+ * Verify mode: check every block of the stats and history files against its
+ * checksum, the blocks in archives included, on up to VERIFY_THREADS threads.
+ * A file is mapped and its headers walked once to list the blocks, which the
+ * threads then take in turn.
+ */
+#define VERIFY_THREADS 8
+
+struct verify_item {
+  const uint8_t *block; /* header, then payload */
+  uint32_t crc;         /* of a plain block */
+  const uint8_t *dict;  /* of an archive, NULL if none */
+  uint32_t dict_len;
+};
+
+struct verify {
+  const char *path;
+  const uint8_t *base;
+  struct verify_item *items;
+  size_t nitems;
+  size_t next; /* item to take next */
+  /* updated atomically */
+  uint64_t checked, bad, unchecked, bytes;
+};
+
+static void verify_add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Check the blocks in an archive.
+ *
+ * @param dict The dictionary ar holds, updated if the archive needs another.
+ */
+static void verify_archive(struct verify *v, struct archive_reader *ar,
+                           const uint8_t **dict,
+                           const struct verify_item *it) {
+#if HAVE_ZSTD
+  struct block_header bh;
+  struct block_check bc = {0};
+  struct archive_header *h;
+  uint8_t *raw = NULL;
+  uint32_t pos;
+
+  memcpy(&bh, it->block, sizeof(bh));
+  h = malloc(bh.len ? bh.len : 1);
+  if (!h || bh.len < sizeof(*h))
+    goto bad;
+  memcpy(h, it->block + sizeof(bh), bh.len);
+  if (it->dict != *dict) {
+    if (archive_dict(ar, it->dict, it->dict_len))
+      goto bad;
+    *dict = it->dict;
+  }
+  raw = malloc(h->raw_len ? h->raw_len : 1);
+  if (!raw || archive_decode(ar, h, bh.len, raw))
+    goto bad;
+
+  for (pos = 0; pos + sizeof(bh) <= h->raw_len; pos += sizeof(bh) + bh.len) {
+    int pending = bc.pending;
+
+    memcpy(&bh, raw + pos, sizeof(bh));
+    if (bh.len > h->raw_len - pos - sizeof(bh))
+      break;
+    if (block_corrupt(&bc, &bh, raw + pos + sizeof(bh))) {
+      fprintf(stderr,
+              "kbstats: %s: archived block %u at offset %lld fails its "
+              "checksum\n",
+              v->path, bh.type, (long long)(h->from + pos));
+      verify_add(&v->bad, 1);
+    } else if (bh.type != BLOCK_CHECKSUM && bh.type != BLOCK_PAD) {
+      verify_add(pending ? &v->checked : &v->unchecked, 1);
+    }
+    verify_add(&v->bytes, sizeof(bh) + bh.len);
+  }
+  if (pos == h->raw_len) {
+    free(h);
+    free(raw);
+    return;
+  }
+bad:
+  fprintf(stderr, "kbstats: %s: bad archive at offset %ld\n", v->path,
+          (long)(it->block - v->base));
+  verify_add(&v->bad, 1);
+  free(h);
+  free(raw);
+#else
+  verify_add(&v->unchecked, 1);
+#endif
+}
+
+static void *verify_thread(void *arg) {
+  struct verify *v = arg;
+  struct archive_reader ar = {0};
+  const uint8_t *dict = NULL;
+  struct block_header bh;
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) <
+         v->nitems) {
+    const struct verify_item *it = &v->items[i];
+
+    memcpy(&bh, it->block, sizeof(bh));
+    if (bh.type == BLOCK_ARCHIVE) {
+      verify_archive(v, &ar, &dict, it);
+      continue;
+    }
+    if (block_crc(&bh, it->block + sizeof(bh)) == it->crc) {
+      verify_add(&v->checked, 1);
+    } else {
+      fprintf(stderr,
+              "kbstats: %s: block %u at offset %ld fails its checksum\n",
+              v->path, bh.type, (long)(it->block - v->base));
+      verify_add(&v->bad, 1);
+    }
+    verify_add(&v->bytes, sizeof(bh) + bh.len);
+  }
+  archive_reader_free(&ar);
+  return NULL;
+}
+
+/**
+ * Verify one file and print a line about it.
+ *
+ * @return 0 if every block with a checksum matches it, 1 otherwise.
+ */
+static int verify_file(const char *path) {
+  struct verify v = {.path = path};
+  struct stats_header hdr;
+  struct block_header bh;
+  const uint8_t *dict = NULL;
+  pthread_t thread[VERIFY_THREADS - 1];
+  uint32_t dict_len = 0, crc = 0;
+  int i, nthreads, pending = 0;
+  uint64_t start, ns;
+  size_t pos, cap = 0;
+  struct stat st;
+  void *p;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT)
+      return 0;
+    perror(path);
+    return 1;
+  }
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(hdr)) {
+    fprintf(stderr, "kbstats: %s is too short\n", path);
+    close(fd);
+    return 1;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror(path);
+    return 1;
+  }
+  v.base = p;
+  memcpy(&hdr, v.base, sizeof(hdr));
+  if (memcmp(hdr.magic, STATS_MAGIC, sizeof(hdr.magic)) != 0) {
+    fprintf(stderr, "kbstats: %s is not a stats file\n", path);
+    munmap(p, st.st_size);
+    return 1;
+  }
+
+  start = now_ns();
+  for (pos = sizeof(hdr); pos + sizeof(bh) <= (size_t)st.st_size;
+       pos += sizeof(bh) + bh.len) {
+    memcpy(&bh, v.base + pos, sizeof(bh));
+    if (bh.len > st.st_size - pos - sizeof(bh))
+      break;
+    if (bh.type == BLOCK_CHECKSUM) {
+      pending = bh.len == sizeof(struct block_checksum);
+      if (pending)
+        memcpy(&crc, v.base + pos + sizeof(bh), sizeof(crc));
+      continue;
+    }
+    if (bh.type == BLOCK_ARCHIVE_DICT) {
+      dict = v.base + pos + sizeof(bh);
+      dict_len = bh.len;
+    } else if (bh.type == BLOCK_ARCHIVE || pending) {
+      if (v.nitems == cap) {
+        cap = cap ? 2 * cap : 256;
+        v.items = realloc(v.items, cap * sizeof(*v.items));
+        if (!v.items) {
+          perror("kbstats: realloc");
+          munmap(p, st.st_size);
+          return 1;
+        }
+      }
+      v.items[v.nitems++] = (struct verify_item){
+          v.base + pos, crc, bh.type == BLOCK_ARCHIVE ? dict : NULL,
+          dict_len};
+    } else if (bh.type != BLOCK_PAD) {
+      v.unchecked++;
+    }
+    pending = 0;
+  }
+  if (pos != (size_t)st.st_size) {
+    fprintf(stderr, "kbstats: %s: truncated block at offset %zu\n", path,
+            pos);
+    v.bad++;
+  }
+
+  /* this thread is one of them */
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > VERIFY_THREADS)
+    nthreads = VERIFY_THREADS;
+  if (nthreads > (int)v.nitems)
+    nthreads = v.nitems;
+  for (i = 0; i < nthreads - 1; i++) {
+    if (pthread_create(&thread[i], NULL, verify_thread, &v))
+      break;
+  }
+  nthreads = i + 1;
+  verify_thread(&v);
+  for (i = 0; i < nthreads - 1; i++)
+    pthread_join(thread[i], NULL);
+  ns = now_ns() - start;
+
+  printf("%s: %llu blocks checked, %llu bad, %llu without a checksum; "
+         "%.1f MB/s (%s, %d thread%s)\n",
+         path, (unsigned long long)v.checked, (unsigned long long)v.bad,
+         (unsigned long long)v.unchecked, ns ? v.bytes * 1e3 / ns : 0.0,
+         crc32c_name, nthreads, nthreads == 1 ? "" : "s");
+  munmap(p, st.st_size);
+  free(v.items);
+  return v.bad != 0;
+}
+
+/**
+ * Check the stats and history files against their checksums.
+ *
+ * @return 0 if every block with a checksum matches it, 1 otherwise.
+ */
+static int do_verify(void) {
+  char *stats = stats_file ? strdup(stats_file) : default_stats_path();
+  char *history = NULL;
+  int bad;
+
+  if (!stats || asprintf(&history, "%s.history", stats) < 0) {
+    free(stats);
+    return EXIT_FAILURE;
+  }
+  bad = verify_file(stats);
+  bad |= verify_file(history);
+  free(stats);
+  free(history);
+  return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Arrow IPC export. The file holds one record batch per segment: the sealed
+ * ones from the history file, then today's from the stats file. Decoded
+ * segments already have the layout of a record batch body, so only the
+ * flatbuffer metadata around them needs building. Its shape is small and
+ * fixed, so it is written by hand, front to back: every table follows its
+ * vtable, and offsets to child objects are linked once the child has been
+ * written after its parent.
+ */
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_V5 4
+#define FB_MAX_FIELDS 8
+
+enum arrow_header {
+  ARROW_SCHEMA = 1,
+  ARROW_RECORD_BATCH = 3,
+};
+
+enum arrow_type {
+  ARROW_INT = 2,
+  ARROW_TIMESTAMP = 10,
+};
+
+/* a message in the footer */
+struct arrow_block {
+  int64_t offset;
+  int32_t meta_len; /* including the continuation and length prefix */
+  int32_t pad;
+  int64_t body_len;
+};
+
+struct fb {
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+  int err; /* out of memory */
+};
+
+struct arrow {
+  FILE *f;
+  struct fb fb;
+  struct segment seg;
+  struct arrow_block *blocks;
+  size_t nblocks;
+  int64_t pos; /* bytes written */
+  uint64_t rows;
+};
+
+/**
+ * Append bytes to a flatbuffer, or zeros if data is NULL. On allocation
+ * failure b->err is set and nothing is written.
+ *
+ * @return Where they were written.
+ */
+static size_t fb_put(struct fb *b, const void *data, size_t n) {
+  size_t pos = b->len;
+
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 1024;
+    void *p;
+
+    while (cap < b->len + n)
+      cap *= 2;
+    p = realloc(b->buf, cap);
+    if (!p) {
+      b->err = 1;
+      return pos;
+    }
+    b->buf = p;
+    b->cap = cap;
+  }
+  if (data)
+    memcpy(b->buf + pos, data, n);
+  else
+    memset(b->buf + pos, 0, n);
+  b->len += n;
+
+  return pos;
+}
+
+static void fb_pad(struct fb *b, size_t align) {
+  fb_put(b, NULL, (align - b->len % align) % align);
+}
+
+static void fb_set(struct fb *b, size_t at, const void *data, size_t n) {
+  if (at + n <= b->len)
+    memcpy(b->buf + at, data, n);
+}
+
+/* point the offset at 'at' to the object at 'target' */
+static void fb_link(struct fb *b, size_t at, size_t target) {
+  uint32_t off = target - at;
+
+  fb_set(b, at, &off, sizeof(off));
+}
+
+/**
+ * Write a table and its vtable.
+ *
+ * @param b The flatbuffer.
+ * @param n The number of fields.
+ * @param size The size of each field in bytes, 0 if absent; offsets to
+ * tables, vectors and strings take 4.
+ * @param slot Set to where each field is to be filled in.
+ * @return Where the table was written.
+ */
+static size_t fb_table(struct fb *b, int n, const uint8_t *size,
+                       size_t *slot) {
+  uint16_t vt[2 + FB_MAX_FIELDS];
+  size_t vtable, table;
+  int32_t soffset;
+  int i;
+
+  vt[0] = (2 + n) * sizeof(vt[0]);
+  vt[1] = sizeof(soffset);
+  for (i = 0; i < n; i++) {
+    vt[2 + i] = 0;
+    if (!size[i])
+      continue;
+    vt[1] = (vt[1] + size[i] - 1) / size[i] * size[i];
+    vt[2 + i] = vt[1];
+    vt[1] += size[i];
+  }
+
+  fb_pad(b, sizeof(vt[0]));
+  vtable = fb_put(b, vt, vt[0]);
+  fb_pad(b, 8);
+  table = fb_put(b, NULL, vt[1]);
+  soffset = table - vtable;
+  fb_set(b, table, &soffset, sizeof(soffset));
+  for (i = 0; i < n; i++)
+    slot[i] = table + vt[2 + i];
+
+  return table;
+}
+
+/**
+ * Write a vector of n elements, elem bytes each, whose elements are aligned
+ * to align bytes (at least 4). A NULL data leaves them zeroed.
+ *
+ * @return Where the vector was written.
+ */
+static size_t fb_vector(struct fb *b, size_t n, size_t elem, size_t align,
+                        const void *data) {
+  uint32_t len = n;
+  size_t pos;
+
+  while ((b->len + sizeof(len)) % align)
+    fb_put(b, NULL, 1);
+  pos = fb_put(b, &len, sizeof(len));
+  fb_put(b, data, n * elem);
+
+  return pos;
+}
+
+static size_t fb_string(struct fb *b, const char *s) {
+  size_t pos = fb_vector(b, strlen(s), 1, 4, s);
+
+  fb_put(b, NULL, 1);
+  return pos;
+}
+
+/**
+ * Write the Schema table: a UTC timestamp in seconds for the minute, then a
+ * uint32 for each count.
+ *
+ * @return Where the table was written.
+ */
+static size_t arrow_schema(struct fb *b) {
+  /* endianness, fields */
+  static const uint8_t schema_fields[] = {2, 4};
+  /* name, nullable, type_type, type, dictionary, children */
+  static const uint8_t field_fields[] = {4, 1, 1, 4, 0, 4};
+  /* unit (default SECOND), timezone */
+  static const uint8_t timestamp_fields[] = {0, 4};
+  /* bitWidth, is_signed (default false) */
+  static const uint8_t int_fields[] = {4, 0};
+  uint8_t type;
+  size_t s[2], f[6], t[2], schema, fields;
+  int i;
+
+  schema = fb_table(b, 2, schema_fields, s);
+  fields = fb_vector(b, ROLLUP_COLUMNS, 4, 4, NULL);
+  fb_link(b, s[1], fields);
+
+  for (i = 0; i < ROLLUP_COLUMNS; i++) {
+    fb_link(b, fields + 4 + 4 * i, fb_table(b, 6, field_fields, f));
+    fb_link(b, f[0], fb_string(b, rollup_column_names[i]));
+    type = i ? ARROW_INT : ARROW_TIMESTAMP;
+    fb_set(b, f[2], &type, 1);
+    if (i) {
+      fb_link(b, f[3], fb_table(b, 2, int_fields, t));
+      fb_set(b, t[0], &(int32_t){32}, sizeof(int32_t));
+    } else {
+      fb_link(b, f[3], fb_table(b, 2, timestamp_fields, t));
+      fb_link(b, t[1], fb_string(b, "UTC"));
+    }
+    fb_link(b, f[5], fb_vector(b, 0, 4, 4, NULL));
+  }
+
+  return schema;
+}
+
+/**
+ * Start the flatbuffer of a Message.
+ *
+ * @return The slot for the offset of its header table.
+ */
+static size_t arrow_message(struct fb *b, uint8_t header, int64_t body_len) {
+  /* version, header_type, header, bodyLength */
+  static const uint8_t message_fields[] = {2, 1, 4, 8};
+  size_t m[4];
+
+  b->len = 0;
+  fb_put(b, NULL, sizeof(uint32_t));
+  fb_link(b, 0, fb_table(b, 4, message_fields, m));
+  fb_set(b, m[0], &(int16_t){ARROW_V5}, sizeof(int16_t));
+  fb_set(b, m[1], &header, 1);
+  fb_set(b, m[3], &body_len, sizeof(body_len));
+
+  return m[2];
+}
+
+/**
+ * Write the Message in a->fb and its body. Record batches, the messages with
+ * a body, are noted for the footer.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int arrow_write(struct arrow *a, const void *body, int64_t body_len) {
+  int32_t prefix[2] = {-1};
+  struct arrow_block *blocks;
+
+  fb_pad(&a->fb, 8);
+  prefix[1] = a->fb.len;
+  if (a->fb.err || fwrite(prefix, sizeof(prefix), 1, a->f) != 1 ||
+      fwrite(a->fb.buf, a->fb.len, 1, a->f) != 1 ||
+      (body_len && fwrite(body, body_len, 1, a->f) != 1))
+    return 1;
+
+  if (body_len) {
+    blocks = realloc(a->blocks, (a->nblocks + 1) * sizeof(*blocks));
+    if (!blocks)
+      return 1;
+    a->blocks = blocks;
+    blocks[a->nblocks++] = (struct arrow_block){
+        .offset = a->pos,
+        .meta_len = sizeof(prefix) + a->fb.len,
+        .body_len = body_len,
+    };
+  }
+  a->pos += sizeof(prefix) + a->fb.len + body_len;
+
+  return 0;
+}
+
+/**
+ * Write a segment as a record batch. Its columns have no nulls, so every
+ * validity buffer is empty.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int arrow_batch(struct arrow *a, const struct segment *s) {
+  /* length, nodes, buffers */
+  static const uint8_t batch_fields[] = {8, 4, 4};
+  int64_t nodes[ROLLUP_COLUMNS][2] = {{0}};
+  int64_t buffers[2 * ROLLUP_COLUMNS][2] = {{0}};
+  size_t r[3], slot;
+  int i;
+
+  for (i = 0; i < ROLLUP_COLUMNS; i++) {
+    const uint8_t *col = i ? (uint8_t *)s->count[i - 1] : (uint8_t *)s->minute;
+
+    nodes[i][0] = s->rows;
+    buffers[2 * i + 1][0] = col - s->body;
+    buffers[2 * i + 1][1] = s->rows * (i ? sizeof(uint32_t) : sizeof(int64_t));
+  }
+
+  slot = arrow_message(&a->fb, ARROW_RECORD_BATCH, s->body_len);
+  fb_link(&a->fb, slot, fb_table(&a->fb, 3, batch_fields, r));
+  fb_set(&a->fb, r[0], &(int64_t){s->rows}, sizeof(int64_t));
+  fb_link(&a->fb, r[1], fb_vector(&a->fb, ROLLUP_COLUMNS, 16, 8, nodes));
+  fb_link(&a->fb, r[2], fb_vector(&a->fb, 2 * ROLLUP_COLUMNS, 16, 8, buffers));
+  a->rows += s->rows;
+
+  return arrow_write(a, s->body, s->body_len);
+}
+
+static int arrow_block(uint32_t type, const void *payload, uint32_t len,
+                       void *data) {
+  struct arrow *a = data;
+  int loaded = segment_load_block(&a->seg, type, payload, len);
+
+  if (loaded <= 0)
+    return loaded < 0;
+  return a->seg.rows ? arrow_batch(a, &a->seg) : 0;
+}
+
+/**
+ * Write the file magic and the Schema message.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int arrow_start(struct arrow *a) {
+  static const char magic[8] = ARROW_MAGIC;
+  size_t slot;
+
+  if (fwrite(magic, sizeof(magic), 1, a->f) != 1)
+    return 1;
+  a->pos = sizeof(magic);
+
+  slot = arrow_message(&a->fb, ARROW_SCHEMA, 0);
+  fb_link(&a->fb, slot, arrow_schema(&a->fb));
+  return arrow_write(a, NULL, 0);
+}
+
+/**
+ * Write the end-of-stream marker, the footer and the closing magic.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int arrow_finish(struct arrow *a) {
+  /* version, schema, dictionaries, recordBatches */
+  static const uint8_t footer_fields[] = {2, 4, 4, 4};
+  static const int32_t eos[2] = {-1, 0};
+  struct fb *b = &a->fb;
+  int32_t footer_len;
+  size_t ft[4];
+
+  b->len = 0;
+  fb_put(b, NULL, sizeof(uint32_t));
+  fb_link(b, 0, fb_table(b, 4, footer_fields, ft));
+  fb_set(b, ft[0], &(int16_t){ARROW_V5}, sizeof(int16_t));
+  fb_link(b, ft[1], arrow_schema(b));
+  fb_link(b, ft[2], fb_vector(b, 0, 4, 4, NULL));
+  fb_link(b, ft[3], fb_vector(b, a->nblocks, sizeof(struct arrow_block), 8,
+                              a->blocks));
+  fb_pad(b, 8);
+  footer_len = b->len;
+
+  return b->err || fwrite(eos, sizeof(eos), 1, a->f) != 1 ||
+         fwrite(b->buf, b->len, 1, a->f) != 1 ||
+         fwrite(&footer_len, sizeof(footer_len), 1, a->f) != 1 ||
+         fwrite(ARROW_MAGIC, strlen(ARROW_MAGIC), 1, a->f) != 1;
+}
+
+/**
+ * Export the per-minute history into an Arrow IPC file, replacing it.
+ *
+ * @param path The Arrow file.
+ * @return 0 on success or 1 otherwise.
+ */
+static int do_export_arrow(const char *path) {
+  struct capture cap = {.peer = -1};
+  struct arrow a = {0};
+  uint64_t start = now_ns();
+  int err;
+
+  if (aggregator_init(&cap, 1) || !cap.stats_path)
+    return EXIT_FAILURE;
+
+  a.f = fopen(path, "wb");
+  if (!a.f) {
+    perror("kbstats: export");
+    return EXIT_FAILURE;
+  }
+
+  err = arrow_start(&a) ||
+        history_read(cap.history_path, 0, arrow_block, &a) < 0 ||
+        history_read(cap.stats_path, 0, arrow_block, &a) < 0 ||
+        arrow_finish(&a);
+  err |= fclose(a.f);
+  free(a.fb.buf);
+  free(a.seg.body);
+  free(a.blocks);
+
+  if (err) {
+    fprintf(stderr, "kbstats: export to %s failed\n", path);
+    unlink(path);
+    return EXIT_FAILURE;
+  }
+
+  printf("Exported %llu minutes in %zu batches to %s in %.3f s\n",
+         (unsigned long long)a.rows, a.nblocks, path,
+         (now_ns() - start) / 1e9);
+  return EXIT_SUCCESS;
+}
+
+#if HAVE_SQLITE3
+/*
+ * SQLite export. Rollups and sessions are copied incrementally from the
+ * history file, starting at the offset the previous export stored in the
+ * database, so a day's minutes arrive once its segment is sealed; per-key and
+ * bigram totals are replaced from the stats file. The
+ * whole export is one transaction of prepared statements, and it only reads
+ * kbstats' files, so it never holds up a running capture.
+ */
+static const char export_schema[] =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS meta(key TEXT PRIMARY KEY, value INTEGER);"
+    "CREATE TABLE IF NOT EXISTS rollups(minute INTEGER PRIMARY KEY,"
+    " keystrokes INTEGER, chars INTEGER, backspaces INTEGER, words INTEGER);"
+    "CREATE TABLE IF NOT EXISTS sessions(start INTEGER PRIMARY KEY,"
+    " end INTEGER, keystrokes INTEGER, chars INTEGER, backspaces INTEGER,"
+    " words INTEGER);"
+    "CREATE TABLE IF NOT EXISTS keys(code INTEGER PRIMARY KEY, name TEXT,"
+    " presses INTEGER);"
+    "CREATE TABLE IF NOT EXISTS bigrams(first INTEGER, second INTEGER,"
+    " count INTEGER, mean_interval_ms REAL, PRIMARY KEY (first, second))"
+    " WITHOUT ROWID;";
+
+enum export_stmt {
+  EXPORT_ROLLUP,
+  EXPORT_SESSION,
+  EXPORT_KEY,
+  EXPORT_BIGRAM,
+  EXPORT_GET_OFFSET,
+  EXPORT_SET_OFFSET,
+  EXPORT_STMTS,
+};
+
+static const char *const export_sql[EXPORT_STMTS] = {
+    [EXPORT_ROLLUP] =
+        "INSERT INTO rollups VALUES (?1, ?2, ?3, ?4, ?5) "
+        "ON CONFLICT (minute) DO UPDATE SET "
+        "keystrokes = keystrokes + ?2, chars = chars + ?3, "
+        "backspaces = backspaces + ?4, words = words + ?5",
+    [EXPORT_SESSION] =
+        "INSERT INTO sessions VALUES (?1, ?2, ?3, ?4, ?5, ?6) "
+        "ON CONFLICT (start) DO UPDATE SET end = max(end, ?2), "
+        "keystrokes = keystrokes + ?3, chars = chars + ?4, "
+        "backspaces = backspaces + ?5, words = words + ?6",
+    [EXPORT_KEY] = "INSERT OR REPLACE INTO keys VALUES (?1, ?2, ?3)",
+    [EXPORT_BIGRAM] = "INSERT OR REPLACE INTO bigrams VALUES (?1, ?2, ?3, ?4)",
+    [EXPORT_GET_OFFSET] = "SELECT value FROM meta WHERE key = 'history'",
+    [EXPORT_SET_OFFSET] = "INSERT OR REPLACE INTO meta VALUES ('history', ?1)",
+};
+
+struct export {
+  sqlite3_stmt *stmt[EXPORT_STMTS];
+  struct segment seg;
+  uint64_t rollups, sessions;
+};
+
+static int export_row(sqlite3_stmt *stmt, int n, const int64_t *values) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    sqlite3_bind_int64(stmt, i + 1, values[i]);
+  i = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  return i != SQLITE_DONE;
+}
+
+static int export_block(uint32_t type, const void *payload, uint32_t len,
+                        void *data) {
+  struct export *ex = data;
+  uint32_t i;
+
+  if (type == BLOCK_SEGMENT) {
+    if (segment_decode(&ex->seg, payload, len))
+      return 1;
+    const struct segment *s = &ex->seg;
+
+    for (i = 0; i < s->rows; i++, ex->rollups++) {
+      int64_t v[] = {s->minute[i], s->count[COUNT_KEYSTROKES][i],
+                     s->count[COUNT_CHARS][i], s->count[COUNT_BACKSPACES][i],
+                     s->count[COUNT_WORDS][i]};
+      if (export_row(ex->stmt[EXPORT_ROLLUP], 5, v))
+        return 1;
+    }
+  } else if (type == BLOCK_SESSIONS) {
+    const struct session *s = payload;
+
+    for (i = 0; i < len / sizeof(*s); i++, ex->sessions++) {
+      int64_t v[] = {s[i].start, s[i].end, s[i].keystrokes,
+                     s[i].chars, s[i].backspaces, s[i].words};
+      if (export_row(ex->stmt[EXPORT_SESSION], 6, v))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Export the statistics into a SQLite database, creating it if needed.
+ *
+ * @param db_path The database file.
+ * @return 0 on success or 1 otherwise.
+ */
+static int do_export_sqlite(const char *db_path) {
+  struct capture cap = {.peer = -1};
+  struct export ex = {0};
+  struct kb_stats keys;
+  sqlite3 *db = NULL;
+  sqlite3_stmt *st;
+  uint64_t start = now_ns();
+  long offset = 0;
+  int i, j, nkeys = 0, nbigrams = 0, rc = EXIT_FAILURE;
+
+  if (aggregator_init(&cap, 1) || !cap.stats_path)
+    return EXIT_FAILURE;
+
+  if (sqlite3_open(db_path, &db) != SQLITE_OK ||
+      sqlite3_exec(db, export_schema, NULL, NULL, NULL) != SQLITE_OK)
+    goto out;
+  for (i = 0; i < EXPORT_STMTS; i++) {
+    if (sqlite3_prepare_v2(db, export_sql[i], -1, &ex.stmt[i], NULL))
+      goto out;
+  }
+  if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+    goto out;
+
+  st = ex.stmt[EXPORT_GET_OFFSET];
+  if (sqlite3_step(st) == SQLITE_ROW)
+    offset = sqlite3_column_int64(st, 0);
+  sqlite3_reset(st);
+
+  offset = history_read(cap.history_path, offset, export_block, &ex);
+  if (offset < 0) {
+    fprintf(stderr, "kbstats: can't read %s\n", cap.history_path);
+    goto rollback;
+  }
+  if (export_row(ex.stmt[EXPORT_SET_OFFSET], 1, (int64_t[]){offset}))
+    goto rollback;
+
+  kb_merge(&cap.shards, &keys);
+  st = ex.stmt[EXPORT_KEY];
+  for (i = 0; i < KEY_CNT; i++) {
+    if (!keys.presses[i])
+      continue;
+    sqlite3_bind_int(st, 1, i);
+    sqlite3_bind_text(st, 2, codename(EV_KEY, i), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st, 3, keys.presses[i]);
+    if (sqlite3_step(st) != SQLITE_DONE)
+      goto rollback;
+    sqlite3_reset(st);
+    nkeys++;
+  }
+
+  st = ex.stmt[EXPORT_BIGRAM];
+  for (i = 0; i < BIGRAM_KEYS; i++) {
+    for (j = 0; j < BIGRAM_KEYS; j++) {
+      uint64_t n = cap.bigrams.table->count[i * BIGRAM_KEYS + j];
+
+      if (!n)
+        continue;
+      sqlite3_bind_int(st, 1, i);
+      sqlite3_bind_int(st, 2, j);
+      sqlite3_bind_int64(st, 3, n);
+      sqlite3_bind_double(
+          st, 4, cap.bigrams.table->interval_us[i * BIGRAM_KEYS + j] / 1e3 / n);
+      if (sqlite3_step(st) != SQLITE_DONE)
+        goto rollback;
+      sqlite3_reset(st);
+      nbigrams++;
+    }
+  }
+
+  if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    goto rollback;
+
+  printf("Exported %llu minutes, %llu sessions, %d keys and %d bigrams to %s "
+         "in %.3f s\n",
+         (unsigned long long)ex.rollups, (unsigned long long)ex.sessions,
+         nkeys, nbigrams, db_path, (now_ns() - start) / 1e9);
+  rc = EXIT_SUCCESS;
+  goto out;
+
+rollback:
+  sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+out:
+  if (rc)
+    fprintf(stderr, "kbstats: export to %s failed: %s\n", db_path,
+            db ? sqlite3_errmsg(db) : "out of memory");
+  for (i = 0; i < EXPORT_STMTS; i++)
+    sqlite3_finalize(ex.stmt[i]);
+  sqlite3_close(db);
+  free(ex.seg.body);
+  return rc;
+}
+#else
+static int do_export_sqlite(const char *db_path) {
+  fprintf(stderr, "kbstats: built without SQLite support "
+                  "(rebuild with -DHAVE_SQLITE3 -lsqlite3)\n");
+  return EXIT_FAILURE;
+}
+#endif
+
+/*
+ * Loopback mode: virtual keyboards created through uinput are fed a scripted
+ * key stream and read back through the same capture loop as real devices, to
+ * measure latency and throughput without physical hardware.
+ */
+#define LOOPBACK_IDLE_MSEC 2000
+#define LOOPBACK_TEXT "the quick brown fox jumps over the lazy dog "
+
+static const unsigned short ascii_keys[128] = {
+    ['a'] = KEY_A,      ['b'] = KEY_B,     ['c'] = KEY_C,
+    ['d'] = KEY_D,      ['e'] = KEY_E,     ['f'] = KEY_F,
+    ['g'] = KEY_G,      ['h'] = KEY_H,     ['i'] = KEY_I,
+    ['j'] = KEY_J,      ['k'] = KEY_K,     ['l'] = KEY_L,
+    ['m'] = KEY_M,      ['n'] = KEY_N,     ['o'] = KEY_O,
+    ['p'] = KEY_P,      ['q'] = KEY_Q,     ['r'] = KEY_R,
+    ['s'] = KEY_S,      ['t'] = KEY_T,     ['u'] = KEY_U,
+    ['v'] = KEY_V,      ['w'] = KEY_W,     ['x'] = KEY_X,
+    ['y'] = KEY_Y,      ['z'] = KEY_Z,     ['0'] = KEY_0,
+    ['1'] = KEY_1,      ['2'] = KEY_2,     ['3'] = KEY_3,
+    ['4'] = KEY_4,      ['5'] = KEY_5,     ['6'] = KEY_6,
+    ['7'] = KEY_7,      ['8'] = KEY_8,     ['9'] = KEY_9,
+    [' '] = KEY_SPACE,  ['\n'] = KEY_ENTER, ['\t'] = KEY_TAB,
+    ['-'] = KEY_MINUS,  ['='] = KEY_EQUAL, ['['] = KEY_LEFTBRACE,
+    [']'] = KEY_RIGHTBRACE, [';'] = KEY_SEMICOLON, ['\''] = KEY_APOSTROPHE,
+    [','] = KEY_COMMA,  ['.'] = KEY_DOT,   ['/'] = KEY_SLASH,
+    ['\\'] = KEY_BACKSLASH,
+};
+
+struct loopback {
+  int ndev;
+  int ufd[MAX_DEVICES];
+  unsigned long rate;  /* keystrokes per second per device, 0 for flat out */
+  unsigned long count; /* keystrokes per device */
+  const char *text;
+};
+
+static unsigned short ascii_keycode(char c) {
+  return ascii_keys[tolower((unsigned char)c) & 0x7f];
+}
+
+/**
+ * Find the /dev/input node of a uinput device.
+ *
+ * @param sysname The name returned by UI_GET_SYSNAME, e.g. "input12".
+ * @param path Buffer for the event node path.
+ * @param len Size of the path buffer.
+ * @return 0 on success or 1 if the node does not exist (yet).
+ */
+static int loopback_event_node(const char *sysname, char *path, size_t len) {
+  struct dirent **namelist;
+  char dir[PATH_MAX];
+  int i, ndev;
+
+  snprintf(dir, sizeof(dir), "%s/%s", SYS_INPUT_VIRTUAL, sysname);
+  ndev = scandir(dir, &namelist, is_event_device, versionsort);
+  if (ndev <= 0)
+    return 1;
+
+  snprintf(path, len, "%s/%s", DEV_INPUT_EVENT, namelist[0]->d_name);
+  for (i = 0; i < ndev; i++)
+    free(namelist[i]);
+  free(namelist);
+
+  return 0;
+}
+
+/**
+ * Create a virtual keyboard and open its event node for reading.
+ *
+ * @param index Number used in the device name.
+ * @param reader Set to the file descriptor of the event node.
+ * @return The uinput file descriptor to inject events into, or -1 on error.
+ */
+static int loopback_create(int index, int *reader) {
+  struct uinput_setup setup;
+  char sysname[64], path[PATH_MAX];
+  int ufd, code, tries;
+
+  ufd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+  if (ufd < 0) {
+    perror("kbstats: /dev/uinput");
+    return -1;
+  }
+
+  ioctl(ufd, UI_SET_EVBIT, EV_KEY);
+  for (code = KEY_ESC; code <= KEY_SPACE; code++)
+    ioctl(ufd, UI_SET_KEYBIT, code);
+
+  memset(&setup, 0, sizeof(setup));
+  setup.id.bustype = BUS_VIRTUAL;
+  setup.id.vendor = 0x6b62; /* "kb" */
+  setup.id.product = index;
+  snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "kbstats loopback %d", index);
+
+  if (ioctl(ufd, UI_DEV_SETUP, &setup) || ioctl(ufd, UI_DEV_CREATE) ||
+      ioctl(ufd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+    perror("kbstats: uinput");
+    close(ufd);
+    return -1;
+  }
+
+  /* udev may take a moment to create the node */
+  *reader = -1;
+  for (tries = 0; tries < 200 && *reader < 0; tries++) {
+    if (loopback_event_node(sysname, path, sizeof(path)) == 0)
+      *reader = open(path, O_RDONLY | O_CLOEXEC);
+    if (*reader < 0)
+      usleep(10000);
+  }
+  if (*reader < 0) {
+    fprintf(stderr, "kbstats: no event node for %s\n", sysname);
+    ioctl(ufd, UI_DEV_DESTROY);
+    close(ufd);
+    return -1;
+  }
+
+  return ufd;
+}
+
+/**
+ * Injector thread: types the loopback text on every device at the requested
+ * rate. Each keystroke is one write() of press, sync, release, sync.
+ */
+static void *loopback_inject(void *arg) {
+  struct loopback *lb = arg;
+  struct input_event ev[4];
+  struct timespec next;
+  uint64_t period = lb->rate ? 1000000000ULL / lb->rate : 0;
+  size_t pos = 0, len = strlen(lb->text);
+  unsigned long i;
+  int d;
+
+  memset(ev, 0, sizeof(ev));
+  ev[0].type = ev[2].type = EV_KEY;
+  ev[0].value = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (i = 0; i < lb->count && !stop; i++) {
+    unsigned short key;
+
+    while (!(key = ascii_keycode(lb->text[pos++ % len])))
+      ;
+    ev[0].code = ev[2].code = key;
+
+    for (d = 0; d < lb->ndev; d++) {
+      if (write(lb->ufd[d], ev, sizeof(ev)) != sizeof(ev)) {
+        perror("kbstats: uinput write");
+        return NULL;
+      }
+    }
+
+    if (!period)
+      continue;
+    next.tv_nsec += period;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void latency_report(const char *what, struct latency *lat) {
+  if (!lat->n) {
+    printf("%-18s no samples\n", what);
+    return;
+  }
+  qsort(lat->ns, lat->n, sizeof(*lat->ns), cmp_u64);
+  printf("%-18s p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n",
+         what, lat->ns[lat->n / 2] / 1e3, lat->ns[lat->n * 99 / 100] / 1e3,
+         lat->ns[lat->n * 999 / 1000] / 1e3, lat->ns[lat->n - 1] / 1e3);
+}
+
+/**
+ * Enter loopback mode: create virtual keyboards, type on them and report
+ * the time to the first event and the injection-to-read and
+ * injection-to-snapshot latencies. The kernel
+ * timestamp of each event (CLOCK_MONOTONIC, set when uinput accepts the
+ * write) serves as the injection time.
+ *
+ * @param ndev Number of virtual keyboards to create.
+ * @param rate Keystrokes per second per device, 0 for as fast as possible.
+ * @param count Keystrokes to type on each device.
+ * @param text Text to type, repeated as needed; NULL for a pangram.
+ * @return 0 if every keystroke was seen, non-zero otherwise.
+ */
+static int do_loopback(int ndev, unsigned long rate, unsigned long count,
+                       const char *text) {
+  struct loopback lb = {.ndev = 0, .rate = rate, .count = count};
+  struct capture cap = {
+      .quiet = 1, .idle_msec = LOOPBACK_IDLE_MSEC, .peer = -1};
+  struct latency read_lat = {0}, publish_lat = {0};
+  clockid_t clk = CLOCK_MONOTONIC;
+  char shm_name[64];
+  pthread_t injector;
+  uint64_t start, elapsed, events, keystrokes = 0;
+  int i, ringfd, rc = EXIT_FAILURE;
+  const char *c;
+
+  lb.text = text ? text : LOOPBACK_TEXT;
+  for (c = lb.text; *c && !ascii_keycode(*c); c++)
+    ;
+  if (!*c) {
+    fprintf(stderr, "kbstats: nothing typeable in \"%s\"\n", lb.text);
+    return EXIT_FAILURE;
+  }
+  if (ndev < 1 || ndev > MAX_DEVICES) {
+    fprintf(stderr, "kbstats: loopback needs 1 to %d devices\n", MAX_DEVICES);
+    return EXIT_FAILURE;
+  }
+#ifdef STAGES
+  if (STAGE_ON(&cap, STAGE_DEBOUNCE)) {
+    fprintf(stderr, "kbstats: loopback needs a build without debounce\n");
+    return EXIT_FAILURE;
+  }
+#endif
+
+  cap.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (cap.epfd < 0) {
+    perror("kbstats: epoll_create1");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < ndev; i++) {
+    int reader;
+
+    lb.ufd[i] = loopback_create(i, &reader);
+    if (lb.ufd[i] < 0)
+      goto out;
+    lb.ndev++;
+    ioctl(reader, EVIOCSCLOCKID, &clk);
+    if (capture_add_device(&cap, reader)) {
+      close(reader);
+      goto out;
+    }
+  }
+
+  /* the devices are there; time the rest of the startup too */
+  cap.start_ns = now_ns();
+  ringfd = ring_create(&cap);
+  if (ringfd < 0 || aggregator_init(&cap, 0))
+    goto out;
+  close(ringfd);
+  /* keys are injected far faster than a switch bounces */
+  cap.stages &= ~STAGE_BIT(DEBOUNCE);
+  /* and typed by ascii_keycode(), on QWERTY: nothing to infer */
+  cap.layout.fixed = LAYOUT_PINNED;
+
+  snprintf(shm_name, sizeof(shm_name), "%s-loopback-%d", SNAPSHOT_NAME,
+           (int)getpid());
+  cap.snapshot = snapshot_open(shm_name);
+  cap.expect = (uint64_t)count * ndev;
+  read_lat.cap = publish_lat.cap = cap.expect;
+  read_lat.ns = calloc(cap.expect, sizeof(uint64_t));
+  publish_lat.ns = calloc(cap.expect, sizeof(uint64_t));
+  if (!read_lat.ns || !publish_lat.ns) {
+    perror("kbstats: calloc");
+    goto out;
+  }
+  cap.read_lat = &read_lat;
+  cap.publish_lat = &publish_lat;
+
+  signal(SIGINT, interrupt_handler);
+  signal(SIGTERM, interrupt_handler);
+
+  printf("Typing %lu keystrokes on each of %d virtual keyboards", count, ndev);
+  if (rate)
+    printf(" at %lu/s", rate);
+  printf(" ...\n");
+
+  start = now_ns();
+  if (pthread_create(&injector, NULL, loopback_inject, &lb)) {
+    fprintf(stderr, "kbstats: can't start injector thread\n");
+    goto out;
+  }
+  rc = print_events(&cap);
+  elapsed = now_ns() - start;
+  stop = 1;
+  pthread_join(injector, NULL);
+
+  kb_totals(&cap.shards, &events, &keystrokes);
+  printf("Received %llu of %llu keystrokes in %.3f s (%.0f keystrokes/s)\n",
+         (unsigned long long)keystrokes, (unsigned long long)cap.expect,
+         elapsed / 1e9, keystrokes / (elapsed / 1e9));
+  for (i = 0; i < cap.shards.nknown; i++)
+    printf("  %llu from %s\n",
+           (unsigned long long)cap.shards.known[i]->stats.keystrokes,
+           cap.shards.known[i]->id);
+  printf("%-18s %8.1f us\n", "start -> 1st event",
+         (double)cap.ring->first_event_us);
+  latency_report("inject -> read", &read_lat);
+  latency_report("inject -> snapshot", &publish_lat);
+  memory_report(stdout, &cap);
+
+  if (rc == 0 && keystrokes != cap.expect)
+    rc = EXIT_FAILURE;
+
+out:
+  for (i = 0; i < lb.ndev; i++) {
+    ioctl(lb.ufd[i], UI_DEV_DESTROY);
+    close(lb.ufd[i]);
+  }
+  for (i = 0; i < cap.ndev; i++)
+    close(cap.fds[i]);
+  close(cap.epfd);
+  if (cap.ring) {
+    munmap(cap.ring, sizeof(*cap.ring));
+    close(cap.wakefd);
+  }
+  if (cap.snapshot) {
+    munmap(cap.snapshot, sizeof(*cap.snapshot));
+    shm_unlink(shm_name);
+  }
+  free(read_lat.ns);
+  free(publish_lat.ns);
+
+  return rc;
+}
+
+/*
+ * Benchmark mode: time the batch kernels of every SIMD variant this CPU
+ * supports, or just the one forced with --simd, and check them against the
+ * scalar versions; then time the checksum and the statistics pipeline.
+ */
+#define BENCH_BATCHES (1 << 20)
+#define BENCH_MERGES (1 << 16)
+#define BENCH_SCANS (1 << 14)
+#define BENCH_ROWS 1437 /* a day of minutes, less a few to exercise tails */
+#define BENCH_EVENTS (1 << 18)
+#define BENCH_CRC_BYTES (1 << 20) /* about a stats file */
+#define BENCH_CRC_ROUNDS 64
+
+/* keeps the compiler from dropping the timed loops */
+static volatile uint64_t bench_sink;
+
+static int bench_variant(const struct simd_kernels *k,
+                         const struct input_event *batch, int n) {
+  static uint64_t dst[KEY_CNT], src[KEY_CNT], ref[KEY_CNT];
+  static float rows[BENCH_ROWS], pairs[LAYOUT_PAIRS];
+  uint64_t bits[(BENCH_ROWS + 63) / 64], ref_bits[(BENCH_ROWS + 63) / 64];
+  struct agg agg = {0, 0, INFINITY, -INFINITY}, ref_agg = agg;
+  uint16_t idx[64], ref_idx[64];
+  uint64_t packed[64], ref_packed[64];
+  uint64_t start, filter_ns, pack_ns, merge_ns, scan_ns, dot_ns, checksum = 0;
+  double dot, ref_dot;
+  uint64_t dot_bits;
+  /* the first few keys come before the epoch and are clamped */
+  uint64_t epoch = batch[n / 8].input_event_sec * 1000000ULL;
+  int i, nkeys, ref_keys;
+
+  ref_keys = key_filter_scalar(batch, n, ref_idx);
+  nkeys = k->key_filter(batch, n, idx);
+  key_pack_scalar(batch, ref_idx, ref_keys, epoch, 5, ref_packed);
+  k->key_pack(batch, ref_idx, ref_keys, epoch, 5, packed);
+  for (i = 0; i < KEY_CNT; i++) {
+    src[i] = i * 2654435761u;
+    dst[i] = ref[i] = i;
+  }
+  counts_merge_scalar(ref, src, KEY_CNT);
+  k->counts_merge(dst, src, KEY_CNT);
+  for (i = 0; i < BENCH_ROWS; i++)
+    rows[i] = i * 7919 % 97 / 5.0f;
+  range_bits_scalar(rows, BENCH_ROWS, 2, 12, ref_bits);
+  masked_agg_scalar(rows, ref_bits, 5, BENCH_ROWS - 2, &ref_agg);
+  k->range_bits(rows, BENCH_ROWS, 2, 12, bits);
+  k->masked_agg(rows, bits, 5, BENCH_ROWS - 2, &agg);
+  /* a layout check: weights of a keymap and a window of bigrams */
+  for (i = 0; i < LAYOUT_PAIRS; i++)
+    pairs[i] = i * 2654435761u >> 29;
+  ref_dot = dot_scalar(layout_model[0], pairs, LAYOUT_PAIRS);
+  dot = k->dot(layout_model[0], pairs, LAYOUT_PAIRS);
+  if (nkeys != ref_keys || memcmp(idx, ref_idx, nkeys * sizeof(*idx)) ||
+      memcmp(packed, ref_packed, nkeys * sizeof(*packed)) ||
+      memcmp(dst, ref, sizeof(dst)) || memcmp(bits, ref_bits, sizeof(bits)) ||
+      agg.count != ref_agg.count || agg.min != ref_agg.min ||
+      agg.max != ref_agg.max || fabs(agg.sum - ref_agg.sum) > 1e-3 ||
+      fabs(dot - ref_dot) > 1e-5 * fabs(ref_dot)) {
+    fprintf(stderr, "kbstats: %s kernels disagree with scalar\n", k->name);
+    return 1;
+  }
+
+  start = now_ns();
+  for (i = 0; i < BENCH_BATCHES; i++)
+    checksum += k->key_filter(batch, n, idx);
+  filter_ns = now_ns() - start;
+
+  start = now_ns();
+  for (i = 0; i < BENCH_BATCHES; i++) {
+    k->key_pack(batch, idx, nkeys, epoch, 5, packed);
+    checksum += packed[i % nkeys];
+  }
+  pack_ns = now_ns() - start;
+
+  start = now_ns();
+  for (i = 0; i < BENCH_MERGES; i++)
+    k->counts_merge(dst, src, KEY_CNT);
+  merge_ns = now_ns() - start;
+
+  start = now_ns();
+  for (i = 0; i < BENCH_SCANS; i++) {
+    k->range_bits(rows, BENCH_ROWS, 2, 12, bits);
+    k->masked_agg(rows, bits, 0, BENCH_ROWS, &agg);
+  }
+  scan_ns = now_ns() - start;
+
+  start = now_ns();
+  for (i = 0; i < BENCH_SCANS; i++)
+    dot += k->dot(layout_model[i % N_KEYMAPS], pairs, LAYOUT_PAIRS);
+  dot_ns = now_ns() - start;
+
+  memcpy(&dot_bits, &dot, sizeof(dot_bits)); /* of either sign */
+  bench_sink = checksum + dst[KEY_MAX] + agg.count + dot_bits;
+  printf("%-8s key_filter %6.2f ns/event  key_pack %6.2f ns/key  "
+         "counts_merge %6.2f GB/s  filter+agg %5.2f ns/row  "
+         "dot %5.2f ns/pair\n",
+         k->name, (double)filter_ns / ((uint64_t)BENCH_BATCHES * n),
+         (double)pack_ns / ((uint64_t)BENCH_BATCHES * nkeys),
+         (double)BENCH_MERGES * sizeof(dst) / merge_ns,
+         (double)scan_ns / ((uint64_t)BENCH_SCANS * BENCH_ROWS),
+         (double)dot_ns / ((uint64_t)BENCH_SCANS * LAYOUT_PAIRS));
+  return 0;
+}
+
+/**
+ * Time the statistics pipeline of this build on typed text, a press or a
+ * release every 10 ms. Run it on the runtime build, with and without
+ * --stages, and on builds with -DSTAGES to compare them.
+ *
+ * @return 0 on success or 1 if the aggregator can't be set up.
+ */
+static int bench_pipeline(void) {
+  static struct capture cap = {.peer = -1, .quiet = 1};
+  struct key_record *recs = malloc(BENCH_EVENTS * sizeof(*recs));
+  size_t len = strlen(LOOPBACK_TEXT);
+  uint64_t start, ns, t = 1760000000ULL * 1000000;
+  char list[64] = "";
+  int i;
+
+  if (!recs || aggregator_init(&cap, 0)) {
+    fprintf(stderr, "kbstats: can't set up the pipeline\n");
+    free(recs);
+    return 1;
+  }
+  cap.layout.fixed = LAYOUT_PINNED; /* the text passes for QWERTZ */
+  for (i = 0; i < BENCH_EVENTS; i++) {
+    recs[i].time_us = t + i * 10000ULL;
+    recs[i].dev = 0;
+    recs[i].code = ascii_keycode(LOOPBACK_TEXT[i / 2 % len]);
+    recs[i].value = !(i & 1);
+  }
+
+  start = now_ns();
+  for (i = 0; i < BENCH_EVENTS; i++)
+    handle_record(&cap, &recs[i]);
+  ns = now_ns() - start;
+
+  for (i = 0; i < N_STAGES; i++) {
+    if (STAGE_ON(&cap, i))
+      snprintf(list + strlen(list), sizeof(list) - strlen(list), "%s%s",
+               *list ? "," : "", stage_names[i]);
+  }
+#ifdef STAGES
+  printf("pipeline (fixed: %s) %6.2f ns/event\n", list,
+         (double)ns / BENCH_EVENTS);
+#else
+  printf("pipeline (runtime: %s) %6.2f ns/event\n", list,
+         (double)ns / BENCH_EVENTS);
+#endif
+  free(recs);
+  return 0;
+}
+
+/**
+ * Check the CRC32C in use against the table version and the standard check
+ * value, across alignments and in pieces, and time both on a stats file's
+ * worth of bytes.
+ *
+ * @return 0 on success or 1 if they disagree.
+ */
+static int bench_crc32c(void) {
+  uint8_t *buf = malloc(BENCH_CRC_BYTES + 8);
+  uint64_t start, hw_ns, table_ns;
+  uint32_t crc = 0;
+  int i, bad;
+
+  if (!buf) {
+    perror("kbstats: malloc");
+    return 1;
+  }
+  for (i = 0; i < BENCH_CRC_BYTES + 8; i++)
+    buf[i] = i * 2654435761u >> 24;
+  bad = crc32c(0, "123456789", 9) != 0xe3069283 ||
+        crc32c_table(0, "123456789", 9) != 0xe3069283 ||
+        crc32c(crc32c(0, buf, 100), buf + 100, 900) != crc32c(0, buf, 1000);
+  for (i = 0; i < 8; i++)
+    bad |= crc32c(0, buf + i, 1000 + i) != crc32c_table(0, buf + i, 1000 + i);
+  if (bad) {
+    fprintf(stderr, "kbstats: %s crc32c disagrees with the table\n",
+            crc32c_name);
+    free(buf);
+    return 1;
+  }
+
+  start = now_ns();
+  for (i = 0; i < BENCH_CRC_ROUNDS; i++)
+    crc = crc32c(crc, buf, BENCH_CRC_BYTES);
+  hw_ns = now_ns() - start;
+  start = now_ns();
+  for (i = 0; i < BENCH_CRC_ROUNDS / 16; i++)
+    crc = crc32c_table(crc, buf, BENCH_CRC_BYTES);
+  table_ns = now_ns() - start;
+
+  bench_sink = crc;
+  printf("crc32c (%s) %6.2f GB/s, %6.1f us per MiB  table %6.2f GB/s\n",
+         crc32c_name,
+         (double)BENCH_CRC_ROUNDS * BENCH_CRC_BYTES / hw_ns,
+         hw_ns / 1e3 / BENCH_CRC_ROUNDS,
+         (double)BENCH_CRC_ROUNDS / 16 * BENCH_CRC_BYTES / table_ns);
+  free(buf);
+  return 0;
+}
+
+/**
+ * Enter benchmark mode.
+ *
+ * @param force The variant forced with --simd, or NULL for all of them.
+ * @return 0 on success, non-zero if a kernel gave a wrong result.
+ */
+static int do_bench(const char *force) {
+  struct input_event batch[64];
+  int i, rc = 0;
+
+  /* what a keyboard sends: scancode, key, sync */
+  memset(batch, 0, sizeof(batch));
+  for (i = 0; i < 64; i++) {
+    batch[i].type = (i % 3 == 0) ? EV_MSC : (i % 3 == 1) ? EV_KEY : EV_SYN;
+    batch[i].code = batch[i].type == EV_KEY ? KEY_A + i % 26 : 0;
+    batch[i].value = batch[i].type == EV_KEY ? i & 1 : 0;
+    batch[i].input_event_sec = 1760000000 + i / 3;
+    batch[i].input_event_usec = i * 15601 % 1000000;
+  }
+
+  layout_model_init();
+  printf("Dispatch selected %s\n", simd->name);
+  for (i = 0; i < N_SIMD_VARIANTS; i++) {
+    const struct simd_kernels *k = &simd_variants[i];
+
+    if (force ? k != simd : !k->supported())
+      continue;
+    rc |= bench_variant(k, batch, 64);
+  }
+  rc |= bench_crc32c();
+  rc |= bench_pipeline();
+
+  return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Soak mode: push a large number of synthetic key events through the reader
+ * and the aggregator in accelerated time, typing SOAK_DAY_KEYS keystrokes a
+ * day, 16 hours' worth, on SOAK_DEVICES keyboards grouped as one. The
+ * keyboards are unplugged and plugged back in SOAK_HOTPLUGS times between
+ * restarts, the kernel reports a SYN_DROPPED every SOAK_DROP_EVERY
+ * keystrokes, and capture restarts SOAK_SEGMENTS - 1 times with a changed
+ * config, every other time after a crash that loses what was typed since the
+ * last save. Each run between restarts is a child process, as it would be in
+ * production. The parent then checks that the RSS of each run has levelled
+ * off, that the stats file stays the same size and the history grows by at
+ * most a day's worth a day, that the cost of an event has not grown, and
+ * that the totals, the history and the views add up to what was typed.
+ */
+#define SOAK_EVENTS 1000000000ULL /* key events, presses and releases */
+#define SOAK_SEGMENTS 8
+#define SOAK_DEVICES 2
+#define SOAK_KEY_USEC 10000 /* between keystrokes, the devices taking turns */
+#define SOAK_HOLD_USEC 4000
+#define SOAK_DAY_KEYS (16 * 3600 * (1000000 / SOAK_KEY_USEC))
+#define SOAK_BATCH 62 /* events per write, so keystrokes straddle reads */
+#define SOAK_DROP_EVERY 5000 /* keystrokes of a device */
+#define SOAK_HOTPLUGS 3      /* per run */
+#define SOAK_RSS_SLACK (4 << 20)
+#define SOAK_DAY_HISTORY (SEGMENT_MAX_LEN(SEGMENT_ROWS) + 4096)
+#define SOAK_SLOWDOWN 3 /* allowed of the cost per event, over the first run */
+
+struct soak {
+  uint64_t start_us; /* midnight of the first day */
+  uint64_t unit[SOAK_DEVICES]; /* keystrokes of each device so far */
+  int phase[SOAK_DEVICES];     /* event of the keystroke next */
+  uint64_t generated;          /* key events, dropped or not */
+  uint64_t events, keystrokes; /* key events and presses not dropped */
+  uint64_t saved_events, saved_keystrokes; /* as of the last save */
+  uint64_t last_us;                        /* latest event */
+  unsigned long hotplugs, resyncs;
+  /* of the run in progress */
+  uint64_t ns; /* reading and aggregating */
+  uint64_t rss_warm, rss;
+};
+
+/**
+ * Make up the next event of a soak keyboard. A keystroke is a press, a sync,
+ * a release and a sync; one in SOAK_DROP_EVERY comes after a SYN_DROPPED
+ * instead, and is counted as lost.
+ */
+static void soak_event(struct soak *sk, int d, struct input_event *ev) {
+  uint64_t k = sk->unit[d] * SOAK_DEVICES + d, t;
+  int dropped = sk->unit[d] % SOAK_DROP_EVERY == SOAK_DROP_EVERY - 1;
+  int phase = sk->phase[d];
+
+  t = sk->start_us + k / SOAK_DAY_KEYS * 86400000000ULL +
+      k % SOAK_DAY_KEYS * SOAK_KEY_USEC + (phase >= 2) * SOAK_HOLD_USEC;
+  memset(ev, 0, sizeof(*ev));
+  ev->input_event_sec = t / 1000000;
+  ev->input_event_usec = t % 1000000;
+  ev->type = EV_SYN;
+  ev->code = SYN_REPORT;
+  if (dropped ? phase == 1 || phase == 2 : phase % 2 == 0) {
+    ev->type = EV_KEY;
+    ev->code = ascii_keycode(LOOPBACK_TEXT[k % strlen(LOOPBACK_TEXT)]);
+    ev->value = phase < 2;
+    sk->generated++;
+    sk->events += !dropped;
+    sk->keystrokes += !dropped && phase == 0;
+  } else if (dropped && phase == 0) {
+    ev->code = SYN_DROPPED;
+    sk->resyncs++;
+  }
+  sk->last_us = t;
+
+  if (++sk->phase[d] == 4) {
+    sk->phase[d] = 0;
+    sk->unit[d]++;
+  }
+}
+
+/* Whether every soak keyboard is between keystrokes. */
+static int soak_between(const struct soak *sk) {
+  int d;
+
+  for (d = 0; d < SOAK_DEVICES; d++) {
+    if (sk->phase[d])
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Plug in a soak keyboard: a pipe added to the capture, with the identity of
+ * the keyboard whatever index it gets.
+ *
+ * @return The write end of the pipe, or -1 on error.
+ */
+static int soak_plug(struct capture *cap, int d, int *dev) {
+  int fds[2];
+
+  if (pipe2(fds, O_CLOEXEC)) {
+    perror("kbstats: pipe");
+    return -1;
+  }
+  *dev = cap->ndev;
+  if (capture_add_device(cap, fds[0])) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  snprintf(cap->dev_id[*dev], sizeof(cap->dev_id[*dev]),
+           "0006:6b62:%04x soak keyboard %d", d, d);
+  return fds[1];
+}
+
+static void soak_unplug(struct capture *cap, int dev, int wfd) {
+  epoll_ctl(cap->epfd, EPOLL_CTL_DEL, cap->fds[dev], NULL);
+  close(cap->fds[dev]);
+  cap->fds[dev] = -1;
+  close(wfd);
+}
+
+/**
+ * Note what a crash now would fall back on: everything typed so far, but for
+ * the events a group is still holding.
+ */
+static void soak_saved(struct soak *sk, const struct capture *cap) {
+  uint64_t events = 0, keystrokes = 0;
+  int i, j;
+
+  for (i = 0; cap->groups && i < cap->groups->n; i++) {
+    for (j = 0; j < cap->groups->group[i]->n; j++) {
+      events++;
+      keystrokes += cap->groups->group[i]->heap[j].rec.value == 1;
+    }
+  }
+  sk->saved_events = sk->events - events;
+  sk->saved_keystrokes = sk->keystrokes - keystrokes;
+}
+
+/**
+ * One run of the soak, between restarts, in a child process: type until
+ * end key events have been generated, then stop cleanly or crash.
+ *
+ * @return 0 on success or 1 otherwise.
+ */
+static int soak_run(struct soak *sk, uint64_t end, int crash) {
+  static struct capture cap = {.peer = -1, .quiet = 1};
+  struct input_event batch[SOAK_BATCH];
+  uint64_t begin = sk->generated, flushed, t;
+  uint64_t plug = (end - begin) / (SOAK_HOTPLUGS + 1), next_plug = plug;
+  int wfd[SOAK_DEVICES], dev[SOAK_DEVICES], d, i, ringfd, plugs = 0;
+
+  cap.epfd = epoll_create1(EPOLL_CLOEXEC);
+  ringfd = cap.epfd < 0 ? -1 : ring_create(&cap);
+  if (ringfd < 0 || aggregator_init(&cap, 1))
+    return 1;
+  close(ringfd);
+  cap.layout.fixed = LAYOUT_PINNED; /* typed by soak_event(), on QWERTY */
+  for (d = 0; d < SOAK_DEVICES; d++) {
+    if ((wfd[d] = soak_plug(&cap, d, &dev[d])) < 0)
+      return 1;
+  }
+  flushed = cap.flushed_ns;
+  sk->ns = sk->rss_warm = 0;
+
+  while (!stop && (sk->generated < end || !soak_between(sk))) {
+    /* between keystrokes, so that the new device isn't resyncing */
+    if (sk->generated - begin >= next_plug && plugs < SOAK_HOTPLUGS &&
+        soak_between(sk)) {
+      d = plugs++ % SOAK_DEVICES;
+      soak_unplug(&cap, dev[d], wfd[d]);
+      if ((wfd[d] = soak_plug(&cap, d, &dev[d])) < 0)
+        return 1;
+      sk->hotplugs++;
+      next_plug += plug;
+    }
+
+    for (d = 0; d < SOAK_DEVICES; d++) {
+      for (i = 0; i < SOAK_BATCH; i++)
+        soak_event(sk, d, &batch[i]);
+      if (write(wfd[d], batch, sizeof(batch)) != sizeof(batch)) {
+        perror("kbstats: soak write");
+        return 1;
+      }
+    }
+    t = now_ns();
+    for (d = 0; d < SOAK_DEVICES; d++) {
+      if (read_device(&cap, dev[d]))
+        return 1;
+    }
+    drain_ring(&cap);
+    sk->ns += now_ns() - t;
+
+    if (cap.flushed_ns != flushed) {
+      flushed = cap.flushed_ns;
+      soak_saved(sk, &cap);
+    }
+    /* by now the rollups have been saved and their segments freed */
+    if (!sk->rss_warm && sk->generated - begin >= (end - begin) / 4) {
+      cap.rss_ns = 0;
+      memory_update(&cap);
+      sk->rss_warm = cap.rss;
+    }
+  }
+
+  cap.rss_ns = 0;
+  memory_update(&cap);
+  sk->rss = cap.rss;
+  if (crash || stop)
+    return 0; /* an interrupted run is reported by the parent */
+  merge_flush_groups(&cap, 1);
+  if (aggregator_finish(&cap))
+    return 1;
+  soak_saved(sk, &cap);
+  return 0;
+}
+
+/**
+ * Write the config of a run: the group of soak keyboards and a view, and a
+ * second view every other run.
+ */
+static int soak_config(const char *path, int run) {
+  FILE *f = fopen(path, "w");
+
+  if (!f) {
+    perror("kbstats: soak config");
+    return 1;
+  }
+  fprintf(f, "group soak = soak keyboard 0, soak keyboard 1\n");
+  fprintf(f, "view soak_keys = sum(keystrokes)\n");
+  if (run % 2)
+    fprintf(f, "view soak_wpm = p50(wpm), max(wpm) group by weekday\n");
+  return fclose(f) != 0;
+}
+
+static uint64_t file_size(const char *path) {
+  struct stat st;
+
+  return stat(path, &st) ? 0 : (uint64_t)st.st_size;
+}
+
+/**
+ * Load the stats left by the soak as capture would, and check them against
+ * what was typed.
+ *
+ * @return 0 if everything adds up or 1 otherwise.
+ */
+static int soak_verify(const struct soak *sk) {
+  static struct capture cap = {.peer = -1, .quiet = 1};
+  struct metrics_query q;
+  struct metrics_result *all = NULL, *closed = NULL;
+  uint64_t events, keystrokes, sum = 0, view = 0, recomputed = 0;
+  int i, bad;
+
+  if (aggregator_init(&cap, 1))
+    return 1;
+  kb_totals(&cap.shards, &events, &keystrokes);
+  printf("%-12s %12llu of %12llu\n", "events", (unsigned long long)events,
+         (unsigned long long)sk->saved_events);
+  printf("%-12s %12llu of %12llu\n", "keystrokes",
+         (unsigned long long)keystrokes,
+         (unsigned long long)sk->saved_keystrokes);
+  bad = events != sk->saved_events || keystrokes != sk->saved_keystrokes;
+  if (!STAGE_ON(&cap, STAGE_ROLLUPS))
+    return bad;
+
+  metrics_parse("sum(keystrokes)", &q);
+  all = metrics_run(&q, cap.stats_path, cap.history_path, 0);
+  closed = metrics_run(&q, cap.stats_path, cap.history_path, 1);
+  if (!all || !closed) {
+    metrics_free(all);
+    metrics_free(closed);
+    return 1;
+  }
+  if (all->ngroups)
+    sum = metrics_value(&q, &all->groups[0], 0);
+  if (closed->ngroups)
+    recomputed = metrics_value(&q, &closed->groups[0], 0);
+  for (i = 0; cap.views && i < cap.views->n; i++) {
+    if (strcmp(cap.views->view[i].name, "soak_keys") == 0 &&
+        cap.views->view[i].res.ngroups)
+      view = metrics_value(&q, &cap.views->view[i].res.groups[0], 0);
+  }
+  printf("%-12s %12llu of %12llu\n", "history", (unsigned long long)sum,
+         (unsigned long long)keystrokes);
+  printf("%-12s %12llu of %12llu\n", "view", (unsigned long long)view,
+         (unsigned long long)recomputed);
+  metrics_free(all);
+  metrics_free(closed);
+  return bad || sum != keystrokes || view != recomputed;
+}
+
+/**
+ * Enter soak mode. Everything is kept in a new directory under /tmp, which
+ * is removed if the soak passes.
+ *
+ * @param target Key events to generate, at least.
+ * @return 0 if every bound held and the totals add up, non-zero otherwise.
+ */
+static int do_soak(uint64_t target) {
+  char dir[] = "/tmp/kbstats-soak-XXXXXX";
+  char *stats = NULL, *history = NULL, *config = NULL;
+  uint64_t stats_first = 0, stats_now, history_now, day, days;
+  double ns_first = 0, ns_event;
+  struct soak *sk;
+  int run, crash, status, bad = 0;
+  pid_t pid;
+
+  sk = mmap(NULL, sizeof(*sk), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (sk == MAP_FAILED || !mkdtemp(dir) ||
+      asprintf(&stats, "%s/stats", dir) < 0 ||
+      asprintf(&history, "%s.history", stats) < 0 ||
+      asprintf(&config, "%s/config", dir) < 0) {
+    perror("kbstats: soak");
+    return EXIT_FAILURE;
+  }
+  stats_file = stats;
+  config_file = config;
+
+  /* ending about now */
+  days = target / 2 / SOAK_DAY_KEYS + 1;
+  sk->start_us = (time(NULL) / 86400 - days) * 86400000000ULL;
+
+  signal(SIGINT, interrupt_handler);
+  signal(SIGTERM, interrupt_handler);
+  printf("Typing %llu events over %llu days in %d runs, in %s ...\n",
+         (unsigned long long)target, (unsigned long long)days, SOAK_SEGMENTS,
+         dir);
+  printf("%-4s %6s %12s %10s %10s %10s %10s %10s  %s\n", "run", "day",
+         "events", "ns/event", "rss", "growth", "stats", "history",
+         "stopped");
+
+  for (run = 0; run < SOAK_SEGMENTS && !stop && !bad; run++) {
+    crash = run % 2 && run < SOAK_SEGMENTS - 1;
+    if (soak_config(config, run))
+      return EXIT_FAILURE;
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+      perror("kbstats: fork");
+      return EXIT_FAILURE;
+    }
+    if (pid == 0)
+      _exit(soak_run(sk, target * (run + 1) / SOAK_SEGMENTS, crash));
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      ;
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "kbstats: soak run %d failed\n", run + 1);
+      bad = 1;
+      break;
+    }
+    if (stop)
+      break; /* interrupted with the run, which is left unchecked */
+
+    /* a crash loses what came after the last save */
+    if (crash) {
+      sk->events = sk->saved_events;
+      sk->keystrokes = sk->saved_keystrokes;
+    }
+    day = (sk->last_us - sk->start_us) / 86400000000ULL + 1;
+    stats_now = file_size(stats);
+    history_now = file_size(history);
+    ns_event = (double)sk->ns * SOAK_SEGMENTS / target;
+    if (!run) {
+      stats_first = stats_now;
+      ns_first = ns_event;
+    }
+    printf("%-4d %6llu %12llu %10.1f %10llu %10lld %10llu %10llu  %s\n",
+           run + 1, (unsigned long long)day,
+           (unsigned long long)sk->generated, ns_event,
+           (unsigned long long)sk->rss,
+           (long long)(sk->rss - sk->rss_warm), (unsigned long long)stats_now,
+           (unsigned long long)history_now, crash ? "crash" : "clean");
+
+    if (sk->rss > sk->rss_warm + SOAK_RSS_SLACK) {
+      fprintf(stderr, "kbstats: RSS grew by more than %d bytes\n",
+              SOAK_RSS_SLACK);
+      bad = 1;
+    }
+    if (stats_now > stats_first + SEGMENT_MAX_LEN(SEGMENT_ROWS) + 65536) {
+      fprintf(stderr, "kbstats: the stats file keeps growing\n");
+      bad = 1;
+    }
+    if (history_now > day * SOAK_DAY_HISTORY) {
+      fprintf(stderr, "kbstats: the history grows by more than %llu bytes "
+                      "a day\n", (unsigned long long)SOAK_DAY_HISTORY);
+      bad = 1;
+    }
+    if (ns_event > ns_first * SOAK_SLOWDOWN) {
+      fprintf(stderr, "kbstats: events cost over %d times what they did\n",
+              SOAK_SLOWDOWN);
+      bad = 1;
+    }
+  }
+
+  printf("%lu hotplugs, %lu resyncs\n", sk->hotplugs, sk->resyncs);
+  if (!bad && !stop)
+    bad = soak_verify(sk);
+  if (bad || stop) {
+    printf("Soak %s, files kept in %s\n", bad ? "FAILED" : "stopped", dir);
+    return EXIT_FAILURE;
+  }
+  printf("Soak passed\n");
+  unlink(stats);
+  unlink(history);
+  unlink(config);
+  rmdir(dir);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Perform a one-shot state query on a specific device. The query can be of
+ * any known mode, on any valid keycode.
+ *
+ * @param device Path to the evdev device node that should be queried.
+ * @param query_mode The event type that is being queried (should be EV_KEY)
+ * @param keycode The code of the key to be queried
+ * @return 0 if the state bit is unset, 10 if the state bit is set, 1 on error.
+ */
+static int query_device(const char *device, const struct query_mode *query_mode,
+                        int keycode) {
+  int fd;
+  int r;
+  unsigned long state[NBITS(query_mode->max)];
+
+  fd = open(device, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return EXIT_FAILURE;
+  }
+  memset(state, 0, sizeof(state));
+  r = ioctl(fd, query_mode->rq, state);
+  close(fd);
+
+  if (r == -1) {
+    perror("ioctl");
+    return EXIT_FAILURE;
+  }
+
+  if (test_bit(keycode, state))
+    return 10; /* different from EXIT_FAILURE */
+  else
+    return 0;
+}
+
+/**
+ * Look up a key by its textual name or number.
+ *
+ * @param query_mode The event type the key belongs to.
+ * @param kstr The key name (e.g. KEY_5) or its numerical value.
+ * @return The key code, or -1 if it could not be found.
+ */
+static int get_keycode(const struct query_mode *query_mode, const char *kstr) {
+  const char *const *type_names = names[query_mode->event_type];
+  int i;
+
+  if (isdigit((unsigned char)kstr[0]))
+    return atoi(kstr);
+
+  for (i = 0; i <= query_mode->max; i++) {
+    if (type_names[i] && strcmp(type_names[i], kstr) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static int do_query(const char *device, const char *event_type,
+                    const char *keyname) {
+  const struct query_mode *query_mode;
+  int keycode;
+
+  if (!device) {
+    fprintf(stderr, "Device argument is required for query.\n");
+    return usage();
+  }
+
+  query_mode = find_query_mode_by_name(event_type);
+  if (!query_mode) {
+    fprintf(stderr, "Unrecognised event type: %s\n", event_type);
+    return usage();
+  }
+
+  keycode = get_keycode(query_mode, keyname);
+  if (keycode < 0 || keycode > query_mode->max) {
+    fprintf(stderr, "Unrecognised key name: %s\n", keyname);
+    return usage();
+  }
+
+  return query_device(device, query_mode, keycode);
+}
+
+static const struct option long_options[] = {
+    {"grab", no_argument, &grab_flag, 1},
+    {"no-privsep", no_argument, &privsep_flag, 0},
+    {"fast-start", no_argument, &fast_start_flag, 1},
+    {"query", no_argument, NULL, MODE_QUERY},
+    {"version", no_argument, NULL, MODE_VERSION},
+    {"loopback", optional_argument, NULL, MODE_LOOPBACK},
+    {"rate", required_argument, NULL, 'r'},
+    {"count", required_argument, NULL, 'c'},
+    {"text", required_argument, NULL, 't'},
+    {"simd", required_argument, NULL, 's'},
+    {"bench", no_argument, NULL, MODE_BENCH},
+    {"soak", optional_argument, NULL, MODE_SOAK},
+    {"records", no_argument, NULL, MODE_RECORDS},
+    {"stats-file", required_argument, NULL, 'f'},
+    {"words", no_argument, NULL, MODE_WORDS},
+    {"word-text", no_argument, &word_text_flag, 1},
+    {"stages", required_argument, NULL, 'S'},
+    {"export-sqlite", required_argument, NULL, MODE_EXPORT_SQLITE},
+    {"export-arrow", required_argument, NULL, MODE_EXPORT_ARROW},
+    {"serve", optional_argument, NULL, 'p'},
+    {"metrics", required_argument, NULL, MODE_METRICS},
+    {"views", no_argument, NULL, MODE_VIEWS},
+    {"archive", no_argument, NULL, MODE_ARCHIVE},
+    {"verify", no_argument, NULL, MODE_VERIFY},
+    {"config", required_argument, NULL, 'C'},
+    {"memory-budget", required_argument, NULL, 'm'},
+    {"sync", required_argument, NULL, 'y'},
+    {"layout", required_argument, NULL, 'k'},
+    {0, },
+};
+
+int main(int argc, char **argv) {
+  const char *device = NULL;
+  const char *keyname;
+  const char *event_type;
+  enum evtest_mode mode = MODE_CAPTURE;
+  int loopback_devices = 1;
+  unsigned long rate = 0, count = 10000;
+  const char *text = NULL;
+  const char *simd_variant = NULL;
+  const char *export_path = NULL;
+  const char *metrics_query = NULL;
+  uint64_t soak_events = SOAK_EVENTS;
+
+  while (1) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "", long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 0:
+      break;
+    case MODE_QUERY:
+      mode = c;
+      break;
+    case MODE_VERSION:
+      return version();
+    case MODE_LOOPBACK:
+      mode = c;
+      if (optarg)
+        loopback_devices = atoi(optarg);
+      break;
+    case 'r':
+      rate = strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      count = strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      text = optarg;
+      break;
+    case 's':
+      simd_variant = optarg;
+      break;
+    case MODE_BENCH:
+    case MODE_RECORDS:
+    case MODE_WORDS:
+    case MODE_VIEWS:
+    case MODE_ARCHIVE:
+    case MODE_VERIFY:
+      mode = c;
+      break;
+    case MODE_EXPORT_SQLITE:
+    case MODE_EXPORT_ARROW:
+      mode = c;
+      export_path = optarg;
+      break;
+    case MODE_METRICS:
+      mode = c;
+      metrics_query = optarg;
+      break;
+    case MODE_SOAK:
+      mode = c;
+      if (optarg)
+        soak_events = strtoull(optarg, NULL, 0);
+      break;
+    case 'S':
+#ifdef STAGES
+      fprintf(stderr, "kbstats: this build's stages are fixed\n");
+      return EXIT_FAILURE;
+#endif
+      stage_mask = parse_stages(optarg);
+      if (!stage_mask)
+        return usage();
+      break;
+    case 'f':
+      stats_file = optarg;
+      break;
+    case 'C':
+      config_file = optarg;
+      break;
+    case 'p':
+      serve_port = optarg ? atoi(optarg) : SERVE_PORT;
+      break;
+    case 'm':
+      if (parse_size(optarg, &memory_budget)) {
+        fprintf(stderr, "kbstats: bad memory budget %s\n", optarg);
+        return usage();
+      }
+      break;
+    case 'y':
+      for (sync_point = 0; sync_point < N_SYNC_POINTS; sync_point++) {
+        if (strcmp(optarg, sync_names[sync_point]) == 0)
+          break;
+      }
+      if (sync_point == N_SYNC_POINTS) {
+        fprintf(stderr, "kbstats: unknown sync point %s\n", optarg);
+        return usage();
+      }
+      break;
+    case 'k':
+      layout_keymap = strcmp(optarg, "auto") == 0 ? -1 : keymap_find(optarg);
+      if (layout_keymap < 0 && strcmp(optarg, "auto") != 0) {
+        fprintf(stderr, "kbstats: unknown layout %s\n", optarg);
+        return usage();
+      }
+      break;
+    default:
+      return usage();
+    }
+  }
+
+  crc32c_init();
+  if (simd_init(simd_variant))
+    return EXIT_FAILURE;
+
+  if (mode == MODE_BENCH)
+    return do_bench(simd_variant);
+
+  if (mode == MODE_SOAK)
+    return do_soak(soak_events);
+
+  if (mode == MODE_RECORDS)
+    return do_records();
+
+  if (mode == MODE_WORDS)
+    return do_words();
+
+  if (mode == MODE_EXPORT_SQLITE)
+    return do_export_sqlite(export_path);
+
+  if (mode == MODE_EXPORT_ARROW)
+    return do_export_arrow(export_path);
+
+  if (mode == MODE_METRICS)
+    return do_metrics(metrics_query);
+
+  if (mode == MODE_VIEWS)
+    return do_views();
+
+  if (mode == MODE_ARCHIVE)
+    return do_archive();
+
+  if (mode == MODE_VERIFY)
+    return do_verify();
+
+  if (mode == MODE_LOOPBACK)
+    return do_loopback(loopback_devices, rate, count, text);
+
+  if (optind < argc)
+    device = argv[optind++];
+
+  if (mode == MODE_CAPTURE)
+    return do_capture(device, grab_flag);
+
+  if ((argc - optind) < 2) {
+    fprintf(stderr, "Query mode requires device, type and key parameters\n");
+    return usage();
+  }
+
+  event_type = argv[optind++];
+  keyname = argv[optind++];
+
+  return do_query(device, event_type, keyname);
 }